@@ -0,0 +1,148 @@
+"""pyperf benchmarks of multimerge.merge() against heapq.merge() and
+sorted(chain()).
+
+Every case is timed three times, as "<case>/multimerge", "<case>/heapq"
+and "<case>/sorted". The cases cover:
+
+    shape/k=K/run=R   K inputs, whose items interleave in runs of R
+    skew/...          inputs of very different lengths
+    key/..., reverse  a key function, or reverse=True
+    type/T            int, float, str and tuple items
+    source/...        lists against generators
+    build/k=K         only building the tree: the first item of K inputs
+
+Run it with, for example:
+
+    python benchmarks/bench_merge.py --fast -o results.json
+    python benchmarks/compare.py benchmarks/baseline.json results.json
+
+and pass --select to only run the cases whose names contain a string.
+pyperf's own options, such as --rigorous, work too.
+"""
+
+import heapq
+import operator
+import random
+import time
+from collections import deque
+from functools import partial
+from itertools import chain
+
+import pyperf
+import multimerge
+
+# Items in each shape/ case.
+N = 200_000
+
+
+def interleaved(k, run, n=N, item=float):
+    """k sorted lists, which together hold range(n) in runs of run
+    consecutive items from the same list."""
+    lists = [[] for _ in range(k)]
+    for i in range(n):
+        lists[i // run % k].append(item(i))
+    return lists
+
+
+def skewed(sizes, item=float):
+    """Sorted lists of random items with the given sizes."""
+    rng = random.Random(len(sizes))
+    return [sorted(item(rng.random()) for _ in range(size))
+            for size in sizes]
+
+
+def cases():
+    """Yield (name, make_lists, options, generators, build_only).
+
+    The lists are only made when a case is run, since pyperf starts a
+    fresh process for each benchmark."""
+    for k in [2, 16, 256, 4096, 100_000]:
+        for run in [1, 100, 100_000]:
+            if run > 1 and run * k > N:
+                continue
+            yield (f"shape/k={k}/run={run}",
+                   partial(interleaved, k, run), {}, False, False)
+
+    yield ("skew/one-big-1000-small",
+           partial(skewed, [N] + [1] * 1000), {}, False, False)
+    yield ("skew/geometric-k=16",
+           partial(skewed, [N >> i for i in range(1, 17)]), {}, False, False)
+
+    lists = partial(interleaved, 16, 1)
+    yield "key/none", lists, {}, False, False
+    yield "key/abs", lists, {"key": abs}, False, False
+    yield ("key/itemgetter",
+           partial(interleaved, 16, 1, item=lambda i: (i, str(i))),
+           {"key": operator.itemgetter(0)}, False, False)
+    yield ("reverse",
+           lambda: [lst[::-1] for lst in interleaved(16, 1)],
+           {"reverse": True}, False, False)
+
+    for name, item in [("int", int), ("float", float),
+                       ("str", lambda i: f"{i:08}"),
+                       ("tuple", lambda i: (i // 2, i % 2))]:
+        yield (f"type/{name}",
+               partial(interleaved, 16, 1, item=item), {}, False, False)
+
+    yield "source/list", lists, {}, False, False
+    yield "source/generator", lists, {}, True, False
+
+    for k in [16, 1024, 100_000]:
+        yield (f"build/k={k}",
+               partial(lambda k: [[i] for i in range(k)], k),
+               {}, False, True)
+
+
+def sorted_chain(*iterables, key=None, reverse=False):
+    return sorted(chain(*iterables), key=key, reverse=reverse)
+
+
+IMPLEMENTATIONS = [
+    ("multimerge", multimerge.merge),
+    ("heapq", heapq.merge),
+    ("sorted", sorted_chain),
+]
+
+_lists = {}
+
+
+def time_merge(loops, name, func, make_lists, options, generators,
+               build_only):
+    if name not in _lists:
+        _lists[name] = make_lists()
+    lists = _lists[name]
+    timer = time.perf_counter
+    total = 0.0
+    for _ in range(loops):
+        if generators:
+            iterables = [(x for x in lst) for lst in lists]
+        else:
+            iterables = lists
+        t0 = timer()
+        result = func(*iterables, **options)
+        if build_only:
+            next(iter(result))
+        else:
+            deque(result, maxlen=0)
+        total += timer() - t0
+    return total
+
+
+def main():
+    runner = pyperf.Runner()
+    runner.argparser.add_argument(
+        "--select", default="",
+        help="only run the cases whose names contain this string")
+    runner.metadata["description"] = __doc__.partition("\n")[0]
+    args = runner.parse_args()
+    for name, make_lists, options, generators, build_only in cases():
+        if args.select not in name:
+            continue
+        for impl, func in IMPLEMENTATIONS:
+            runner.bench_time_func(f"{name}/{impl}", time_merge, name, func,
+                                   make_lists, options, generators,
+                                   build_only)
+
+
+if __name__ == "__main__":
+    main()
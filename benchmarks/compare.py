@@ -0,0 +1,52 @@
+"""Compare two result files of bench_merge.py and fail on regressions.
+
+    python benchmarks/compare.py baseline.json results.json [--threshold 1.1]
+
+Prints the ratio of the new to the old median time of every
+multimerge benchmark found in both files (and, with --all, the heapq and
+sorted ones too), then exits with status 1 if any multimerge benchmark
+got slower by more than the threshold.
+"""
+
+import argparse
+import sys
+
+import pyperf
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.partition("\n")[0])
+    parser.add_argument("baseline")
+    parser.add_argument("results")
+    parser.add_argument("--threshold", type=float, default=1.10,
+                        help="the slowdown that counts as a regression "
+                             "(default: %(default)s)")
+    parser.add_argument("--all", action="store_true",
+                        help="also show the heapq and sorted benchmarks")
+    args = parser.parse_args()
+
+    old = {bench.get_name(): bench for bench in
+           pyperf.BenchmarkSuite.load(args.baseline).get_benchmarks()}
+    new = pyperf.BenchmarkSuite.load(args.results).get_benchmarks()
+
+    regressions = []
+    for bench in new:
+        name = bench.get_name()
+        ours = name.endswith("/multimerge")
+        if name not in old or not (ours or args.all):
+            continue
+        ratio = bench.median() / old[name].median()
+        flag = ""
+        if ours and ratio > args.threshold:
+            regressions.append(name)
+            flag = "  REGRESSION"
+        print(f"{name:50} {ratio:6.3f}x{flag}")
+
+    if regressions:
+        print(f"{len(regressions)} benchmark(s) slower than "
+              f"{args.threshold}x the baseline")
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,4 +1,14 @@
 #include "Python.h"
+#if PY_VERSION_HEX < 0x030B0000
+#  include "longintrepr.h"
+#endif
+
+/* Critical sections are new in 3.13. Before that (and in builds with the
+   GIL), the GIL already serializes access to each merge object. */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#  define Py_BEGIN_CRITICAL_SECTION(op) {
+#  define Py_END_CRITICAL_SECTION() }
+#endif
 
 /*
 This implements a k-way merge algorithm that acts as a drop-in
@@ -19,10 +29,29 @@ Algorithm for multimerge.merge:
 
 - For each leaf node:
 
-    - leaf->right will be an iterator
+    - leaf->right will be the source of items: an exact list or tuple,
+      which is indexed directly, or else an iterator (possibly wrapped
+      in a prefetcher)
     - leaf->left will be the most recent item produced by leaf->right
     - leaf->leaf will be leaf itself.
-    - leaf->key will be the keyfunc(leaf->left).
+    - leaf->key will be the keyfunc(leaf->left), or, if keys= was given,
+      the corresponding item of leaf->keys_it.
+    - leaf->source will be the index of the iterable leaf->right came
+      from, and leaf->ordinal the position of leaf->left within it.
+
+- A leaf whose source is another merge object with the same keyfunc
+  and reverse flag (see shares_keys) takes each item's key from the
+  root of that merge instead of calling keyfunc again. The inner merge
+  is marked as a donor, so that it keeps computing keys even once it
+  is down to one leaf.
+
+- A deferred leaf (from merge(..., lower_bounds=...)) has not been
+  opened yet: leaf->right is the iterable itself, leaf->left is NULL,
+  leaf->key is the lower bound, and leaf->ordinal is -1. It plays its
+  games like any other leaf. When it wins overall, nothing before its
+  bound is left, so it is opened and refilled as if its bound had just
+  been popped, and the games are replayed. The flat layout does the same
+  with items[i] == NULL and ordinals[i] == -1.
 
 - For each non-leaf node:
 
@@ -40,6 +69,12 @@ Algorithm for multimerge.merge:
       iterator that produced the previously yielded value.
     - If the iterator is exhausted, delete that leaf and promote its
       sibling to where their common parent is in the tree.
+    - If that leaves the tree more than REBALANCE_SLACK levels deeper
+      than ceil(log2(leaves)), rebuild it from its leaves, left to right,
+      as build_tree does. A leaf that was deep pays one comparison per
+      level for every item it produces, and since a rebuild can only be
+      due again once the leaves have shrunk to a quarter, its cost is
+      amortized over those exhaustions.
     - Everywhere that the previously yielded champion had won, namely,
       at each of the relevant leaf's ancestors, re-evaluate the winner
       among that ancestor's two children, and copy the winner's leaf
@@ -56,12 +91,158 @@ Algorithm for multimerge.merge:
       iterators, and other nodes hold the sole strong references to
       their children.
     - The merge object holds the sole strong reference to the root.
+
+- Comparisons:
+
+    - Like listobject.c's unsafe_*_compare family, build_tree checks
+      whether all of the initial keys share one exact built-in type
+      (float, int, str, bytes, or tuple). If so, the games use a
+      comparison function specialized for that type instead of going
+      through PyObject_RichCompareBool.
+    - The first time refill_leaf produces a key of some other type,
+      the merge object falls back to the generic comparison for good.
+    - unsafe_tuple_lt goes field by field, comparing fields of one
+      scalar type directly, and calls == and < only on other fields.
+    - A key of operator.itemgetter or attrgetter is not called: its
+      fields (from its __reduce__) are read by fields_key, which fills
+      in the tuple of the key last popped if nothing else holds it.
+    - replay_path and flat_replay expand their loop once per direction
+      and per comparison worth inlining (float and int), and pick the
+      copy matching mo->lt on entry, so the loop itself calls through
+      no function pointer and tests no flags.
+
+- Galloping:
+
+    - When one leaf wins MIN_GALLOP times in a row, find the
+      "runner-up": the best key among the siblings of that leaf's
+      ancestors, i.e., the key that would win if the leaf were removed.
+    - From then on, each new key from that leaf is compared only against
+      the runner-up. While the leaf keeps winning, no other game can
+      change, so replay_games returns right away. The keys of the
+      leaf's ancestors are left stale in the meantime; nothing reads
+      them until the next full replay recomputes them bottom-up.
+    - As soon as the leaf loses or is exhausted, do a full replay and
+      start counting again.
+    - take() and into() go further when the galloping leaf reads a
+      list or tuple whose items are their own keys: winner_run gallops
+      and bisects over the rest of it for the last item that still
+      beats the runner-up, and the whole run is copied out at once.
+
+- Adding and removing iterables (merge.add_iterable, merge.remove):
+
+    - Each node records its number of leaves and its height. The tree
+      is kept shaped like a binary counter: walking down the right
+      spine, stop at the first node whose subtree is perfect
+      (nleaves == 1 << height) and replace it with a new parent of it
+      and the new leaf. The depth stays O(log k), and the new leaf is
+      the rightmost one, so it loses every tie, as its index says.
+    - leaf_of maps each source index to its leaf (or NULL once it has
+      left the merge), so remove() finds its leaf directly, then
+      promotes the sibling as for an exhausted iterator and replays
+      the path above it.
+    - Both first "settle" the merge: the tree is built and the popped
+      item replaced, leaving state 3, so that the structure can change
+      safely before the root is popped.
+    - This is only supported for the linked tree; a tree of losers
+      cannot recompute the games at a leaf that is not the winner.
+
+- Set operations (intersect, threshold, difference):
+
+    - These are merges in another mode. Each key is counted by popping
+      every item with it; since ties go to the earlier source, each
+      source's items with that key are consecutive, so a change of
+      source means one more source has it.
+    - When a key falls short, skip_to moves every leaf to the first key
+      that could still qualify: the largest key of any leaf for
+      intersect, or the key of the first source for difference. Leaves
+      reading a list or tuple gallop and then bisect over it; the rest
+      are stepped one item at a time, after calling the iterator's own
+      seek() method if it has one. merge.skip_to does the same for any
+      key.
+    - The games above each leaf that moved are marked by clearing their
+      (borrowed) keys, and then replay_subtree plays just the marked
+      ones, bottom-up, so each is played once however many leaves
+      below it moved.
+
+
+Flat layout (merge(..., flat=True)):
+====================================
+
+- Instead of merge_node objects, keep a "tree of losers" as described
+  in Knuth, TAOCP Vol. 3, 5.4.1, stored implicitly in C arrays.
+
+- There are k leaves, numbered 0..k-1 in the order of the iterables.
+  Leaf i owns items[i], keys[i] and iters[i]. Once its iterator is
+  exhausted, keys[i] is set to NULL, which loses to every other key.
+
+- losers[0] is the index of the overall winner. For 1 <= n < k,
+  losers[n] is the index of the leaf that lost the game at internal
+  node n. The children of node n are 2n and 2n+1, and position k+i
+  stands for leaf i, so the parent of leaf i is node (k+i)/2.
+
+- After refilling the winning leaf, walk from it to the root, playing
+  one game per level against the loser stored there. The leaf with the
+  lower index wins ties, so the output is the same as for the tree of
+  merge_nodes, including stability.
+
+Threads:
+========
+
+- The module does not need the GIL (Py_MOD_GIL_NOT_USED). In a
+  free-threaded build, every method of a merge object that looks at or
+  changes its state (the tree, the flat arrays, and mo->state) runs
+  inside a critical section on that merge object, so one merge can be
+  shared between threads and each item is produced exactly once.
+
+- Merge nodes and prefetchers are only ever reached through their
+  merge object, so they need no locks of their own. Exact lists used
+  as sources are read inside a critical section on the list.
+
+- Separate merge objects share no mutable state and run in parallel.
+  The freelist of merge nodes is kept in the module state, and it is
+  not used when the GIL is disabled.
+
+- Every type, including the internal ones, is a heap type made in
+  multimerge_exec and kept in the module state, so each interpreter that
+  imports the module gets its own, and the module supports a GIL per
+  interpreter (Py_MOD_PER_INTERPRETER_GIL_SUPPORTED). The internal types
+  are recognized by their slot functions, which are the same in every
+  interpreter.
 */
 
+/* Recently freed nodes are kept for reuse, since a tree of k leaves has
+   2k-1 nodes, and merging many small inputs would otherwise spend much
+   of its time in the allocator. With the GIL disabled, threads would
+   race on the freelist, so it is not used. */
+#ifdef Py_GIL_DISABLED
+#  define MERGE_NODE_MAXFREELIST 0
+#else
+#  define MERGE_NODE_MAXFREELIST 512
+#endif
+
+struct merge_node;
+
 typedef struct merge_state {
     PyObject *merge_type;
+    PyObject *mmap_records_type;
+    PyObject *amerge_type;
+    PyObject *amerge_anext_type;
+    /* Internal types, not added to the module: */
+    PyObject *merge_node_type;
+    PyObject *prefetcher_type;
+    PyObject *run_reader_type;
+    PyObject *amerge_slot_type;
+    /* operator.itemgetter and attrgetter, whose fields are read natively: */
+    PyObject *itemgetter_type;
+    PyObject *attrgetter_type;
+#if MERGE_NODE_MAXFREELIST > 0
+    struct merge_node *node_freelist[MERGE_NODE_MAXFREELIST];
+    int node_numfree;
+#endif
 } merge_state;
 
+static void clear_node_freelist(merge_state *state);
+
 static merge_state *
 get_merge_state(PyObject *module)
 {
@@ -73,6 +254,15 @@ mergemodule_traverse(PyObject *module, visitproc visit, void *arg)
 {
     merge_state *state = get_merge_state(module);
     Py_VISIT(state->merge_type);
+    Py_VISIT(state->mmap_records_type);
+    Py_VISIT(state->amerge_type);
+    Py_VISIT(state->amerge_anext_type);
+    Py_VISIT(state->merge_node_type);
+    Py_VISIT(state->prefetcher_type);
+    Py_VISIT(state->run_reader_type);
+    Py_VISIT(state->amerge_slot_type);
+    Py_VISIT(state->itemgetter_type);
+    Py_VISIT(state->attrgetter_type);
     return 0;
 }
 
@@ -81,6 +271,15 @@ mergemodule_clear(PyObject *module)
 {
     merge_state *state = get_merge_state(module);
     Py_CLEAR(state->merge_type);
+    Py_CLEAR(state->mmap_records_type);
+    Py_CLEAR(state->amerge_type);
+    Py_CLEAR(state->amerge_anext_type);
+    Py_CLEAR(state->merge_node_type);
+    Py_CLEAR(state->prefetcher_type);
+    Py_CLEAR(state->run_reader_type);
+    Py_CLEAR(state->amerge_slot_type);
+    Py_CLEAR(state->itemgetter_type);
+    Py_CLEAR(state->attrgetter_type);
     return 0;
 }
 
@@ -89,11 +288,169 @@ mergemodule_free(PyObject *module)
 {
     merge_state *state = get_merge_state(module);
     Py_CLEAR(state->merge_type);
+    Py_CLEAR(state->mmap_records_type);
+    Py_CLEAR(state->amerge_type);
+    Py_CLEAR(state->amerge_anext_type);
+    Py_CLEAR(state->merge_node_type);
+    Py_CLEAR(state->prefetcher_type);
+    Py_CLEAR(state->run_reader_type);
+    Py_CLEAR(state->amerge_slot_type);
+    Py_CLEAR(state->itemgetter_type);
+    Py_CLEAR(state->attrgetter_type);
+    clear_node_freelist(state);
 }
 
-/* merge node object ********************************************************/
+/* comparison functions *****************************************************/
 
-struct merge_node;
+/* Each of these computes PyObject_RichCompareBool(v, w, Py_LT), but
+   assumes that both arguments have the exact type the function was
+   chosen for, so it can skip the generic rich-comparison dispatch. */
+
+typedef int (*lt_func)(PyObject *v, PyObject *w);
+
+#if PY_VERSION_HEX >= 0x030C0000
+#  define LONG_IS_COMPACT(op) PyUnstable_Long_IsCompact((PyLongObject *)(op))
+#  define LONG_COMPACT_VALUE(op) \
+        PyUnstable_Long_CompactValue((PyLongObject *)(op))
+#else
+#  define LONG_IS_COMPACT(op) (Py_ABS(Py_SIZE(op)) <= 1)
+#  define LONG_COMPACT_VALUE(op) \
+        ((Py_ssize_t)Py_SIZE(op) \
+         * (Py_ssize_t)((PyLongObject *)(op))->ob_digit[0])
+#endif
+
+static int
+safe_object_lt(PyObject *v, PyObject *w)
+{
+    return PyObject_RichCompareBool(v, w, Py_LT);
+}
+
+static int
+unsafe_float_lt(PyObject *v, PyObject *w)
+{
+    assert(PyFloat_CheckExact(v) && PyFloat_CheckExact(w));
+    return PyFloat_AS_DOUBLE(v) < PyFloat_AS_DOUBLE(w);
+}
+
+static int
+unsafe_long_lt(PyObject *v, PyObject *w)
+{
+    assert(PyLong_CheckExact(v) && PyLong_CheckExact(w));
+    if (LONG_IS_COMPACT(v) && LONG_IS_COMPACT(w)) {
+        return LONG_COMPACT_VALUE(v) < LONG_COMPACT_VALUE(w);
+    }
+    return PyObject_RichCompareBool(v, w, Py_LT);
+}
+
+static int
+unsafe_str_lt(PyObject *v, PyObject *w)
+{
+    assert(PyUnicode_CheckExact(v) && PyUnicode_CheckExact(w));
+    if (PyUnicode_KIND(v) != PyUnicode_1BYTE_KIND
+        || PyUnicode_KIND(w) != PyUnicode_1BYTE_KIND)
+    {
+        return PyObject_RichCompareBool(v, w, Py_LT);
+    }
+    Py_ssize_t vlen = PyUnicode_GET_LENGTH(v);
+    Py_ssize_t wlen = PyUnicode_GET_LENGTH(w);
+    int res = memcmp(PyUnicode_DATA(v), PyUnicode_DATA(w),
+                     Py_MIN(vlen, wlen));
+    return res != 0 ? res < 0 : vlen < wlen;
+}
+
+static int
+unsafe_bytes_lt(PyObject *v, PyObject *w)
+{
+    assert(PyBytes_CheckExact(v) && PyBytes_CheckExact(w));
+    Py_ssize_t vlen = PyBytes_GET_SIZE(v);
+    Py_ssize_t wlen = PyBytes_GET_SIZE(w);
+    int res = memcmp(PyBytes_AS_STRING(v), PyBytes_AS_STRING(w),
+                     Py_MIN(vlen, wlen));
+    return res != 0 ? res < 0 : vlen < wlen;
+}
+
+/* The comparison to use for two objects of exact type tp,
+   or NULL if there is nothing better than safe_object_lt. */
+static lt_func
+scalar_lt_for_type(PyTypeObject *tp)
+{
+    if (tp == &PyFloat_Type) {
+        return unsafe_float_lt;
+    }
+    if (tp == &PyLong_Type) {
+        return unsafe_long_lt;
+    }
+    if (tp == &PyUnicode_Type) {
+        return unsafe_str_lt;
+    }
+    if (tp == &PyBytes_Type) {
+        return unsafe_bytes_lt;
+    }
+    return NULL;
+}
+
+/* Whether v < w for two tuples, with the same result as tuple's own
+   comparison: the first elements that are not equal decide it, or else
+   the lengths do. Elements of one exact scalar type are compared
+   directly; float needs its own case, since NaN is neither less than
+   nor equal to anything. */
+static int
+unsafe_tuple_lt(PyObject *v, PyObject *w)
+{
+    assert(PyTuple_CheckExact(v) && PyTuple_CheckExact(w));
+    Py_ssize_t vlen = PyTuple_GET_SIZE(v);
+    Py_ssize_t wlen = PyTuple_GET_SIZE(w);
+    Py_ssize_t n = Py_MIN(vlen, wlen);
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *vi = PyTuple_GET_ITEM(v, i);
+        PyObject *wi = PyTuple_GET_ITEM(w, i);
+        if (vi == wi) {
+            continue;
+        }
+        PyTypeObject *tp = Py_TYPE(vi);
+        if (tp == &PyFloat_Type && Py_IS_TYPE(wi, tp)) {
+            double x = PyFloat_AS_DOUBLE(vi), y = PyFloat_AS_DOUBLE(wi);
+            if (x == y) {
+                continue;
+            }
+            return x < y;
+        }
+        lt_func lt;
+        if (Py_IS_TYPE(wi, tp) && (lt = scalar_lt_for_type(tp)) != NULL) {
+            /* These types are totally ordered. */
+            int cmp = lt(vi, wi);
+            if (cmp != 0) {
+                return cmp;
+            }
+            cmp = lt(wi, vi);
+            if (cmp != 0) {
+                return cmp < 0 ? cmp : 0;
+            }
+            continue;
+        }
+        int eq = PyObject_RichCompareBool(vi, wi, Py_EQ);
+        if (eq < 0) {
+            return -1;
+        }
+        if (!eq) {
+            return PyObject_RichCompareBool(vi, wi, Py_LT);
+        }
+    }
+    return vlen < wlen;
+}
+
+/* The comparison to use when every key has exact type tp. */
+static lt_func
+lt_for_type(PyTypeObject *tp)
+{
+    if (tp == &PyTuple_Type) {
+        return unsafe_tuple_lt;
+    }
+    lt_func lt = scalar_lt_for_type(tp);
+    return lt != NULL ? lt : safe_object_lt;
+}
+
+/* merge node object ********************************************************/
 
 typedef struct merge_node {
     PyObject_HEAD
@@ -102,9 +459,20 @@ typedef struct merge_node {
     struct merge_node *parent; /* borrowed */
     PyObject *left;            /* strong */
     PyObject *right;           /* strong */
+    PyObject *keys_it;         /* strong; only for leaves, and maybe NULL */
+    Py_ssize_t source;         /* only for leaves */
+    Py_ssize_t ordinal;        /* only for leaves */
+    Py_ssize_t nleaves;        /* leaves in this subtree */
+    int height;                /* 0 for a leaf */
 } merge_node;
 
-static PyTypeObject merge_node_type;
+static void merge_node_dealloc(merge_node *node);
+
+static inline int
+is_merge_node(PyObject *op)
+{
+    return Py_TYPE(op)->tp_dealloc == (destructor)merge_node_dealloc;
+}
 
 static inline int
 is_leaf(merge_node *node)
@@ -123,10 +491,9 @@ leaf_pop_item(merge_node *node)
 }
 
 static inline PyObject *
-leaf_iterator(merge_node *node)
+leaf_source(merge_node *node)
 {
     assert(is_leaf(node));
-    assert(PyIter_Check(node->right));
     return node->right;
 }
 
@@ -134,7 +501,7 @@ static inline merge_node *
 left_child(merge_node *node)
 {
     assert(!is_leaf(node));
-    assert(Py_TYPE(node->right) == &merge_node_type);
+    assert(is_merge_node(node->left));
     return (merge_node *)node->left;
 }
 
@@ -142,7 +509,7 @@ static inline merge_node *
 right_child(merge_node *node)
 {
     assert(!is_leaf(node));
-    assert(Py_TYPE(node->right) == &merge_node_type);
+    assert(is_merge_node(node->right));
     return (merge_node *)node->right;
 }
 
@@ -154,6 +521,7 @@ merge_node_clear(merge_node *node)
     }
     Py_CLEAR(node->left);
     Py_CLEAR(node->right);
+    Py_CLEAR(node->keys_it);
     return 0;
 }
 
@@ -165,481 +533,6337 @@ merge_node_traverse(merge_node *node, visitproc visit, void *arg)
     }
     Py_VISIT(node->left);
     Py_VISIT(node->right);
+    Py_VISIT(node->keys_it);
+    Py_VISIT(Py_TYPE(node));
     return 0;
 }
 
+/* A new merge node with its fields uninitialized. */
+static merge_node *
+new_merge_node(merge_state *state)
+{
+    PyTypeObject *tp = (PyTypeObject *)state->merge_node_type;
+#if MERGE_NODE_MAXFREELIST > 0
+    if (state->node_numfree > 0) {
+        merge_node *node = state->node_freelist[--state->node_numfree];
+        PyObject_Init((PyObject *)node, tp);
+        return node;
+    }
+#endif
+    return PyObject_GC_New(merge_node, tp);
+}
+
 static void
 merge_node_dealloc(merge_node *node)
 {
+    PyTypeObject *tp = Py_TYPE(node);
     PyObject_GC_UnTrack(node);
     if (is_leaf(node)) {
         Py_XDECREF(node->key);
     }
     Py_XDECREF(node->left);
     Py_XDECREF(node->right);
-    Py_TYPE(node)->tp_free(node);
-}
-
-static PyTypeObject merge_node_type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "multimerge.merge_node",
-    .tp_basicsize = sizeof(merge_node),
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
-    .tp_dealloc = (destructor)merge_node_dealloc,
-    .tp_clear = (inquiry)merge_node_clear,
-    .tp_traverse = (traverseproc)merge_node_traverse,
-    .tp_free = PyObject_GC_Del,
+    Py_XDECREF(node->keys_it);
+#if MERGE_NODE_MAXFREELIST > 0
+    /* The type is made by multimerge_exec, so it has a module state. */
+    merge_state *state = PyType_GetModuleState(tp);
+    if (state->node_numfree < MERGE_NODE_MAXFREELIST) {
+        state->node_freelist[state->node_numfree++] = node;
+        Py_DECREF(tp);
+        return;
+    }
+#endif
+    tp->tp_free(node);
+    Py_DECREF(tp);
+}
+
+static void
+clear_node_freelist(merge_state *state)
+{
+#if MERGE_NODE_MAXFREELIST > 0
+    while (state->node_numfree > 0) {
+        PyObject_GC_Del(state->node_freelist[--state->node_numfree]);
+    }
+#endif
+}
+
+static PyType_Slot merge_node_type_slots[] = {
+    {Py_tp_dealloc, merge_node_dealloc},
+    {Py_tp_clear, merge_node_clear},
+    {Py_tp_traverse, merge_node_traverse},
+    {0, NULL},
 };
 
-/* merge object *************************************************************/
+static PyType_Spec merge_node_type_spec = {
+    .name = "multimerge.merge_node",
+    .basicsize = sizeof(merge_node),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+             | Py_TPFLAGS_DISALLOW_INSTANTIATION
+#endif
+             ,
+    .slots = merge_node_type_slots,
+};
+
+/* prefetch buffer object ***************************************************/
+
+/* With merge(..., prefetch=N), an iterator that is not an exact list or
+   tuple is wrapped in one of these, which pulls up to N items at a time
+   into a C array so that most refills are a load from that array rather
+   than a call to the iterator's tp_iternext. */
 
 typedef struct {
     PyObject_HEAD
-    merge_node *root;
-    PyObject *iterables;
-    PyObject *keyfunc;
-    char reverse;
-    char state;
-} mergeobject;
+    PyObject *it;              /* strong; NULL once exhausted */
+    PyObject **buf;            /* strong references in buf[pos:len] */
+    Py_ssize_t pos;
+    Py_ssize_t len;
+    Py_ssize_t size;
+} prefetcher;
 
-static PyTypeObject merge_type;
+static void prefetcher_dealloc(prefetcher *pf);
 
-static int
-construct_leaf(PyObject *iterable, PyObject *keyfunc, merge_node **node)
+static inline int
+is_prefetcher(PyObject *op)
 {
-    PyObject *it = NULL, *item = NULL, *key = NULL;
+    return Py_TYPE(op)->tp_dealloc == (destructor)prefetcher_dealloc;
+}
 
-    assert(iterable != NULL);
-    it = PyObject_GetIter(iterable);
-    if (it == NULL) {
-        goto error;
+static PyObject *
+prefetcher_new(merge_state *state, PyObject *it, Py_ssize_t size)
+{
+    assert(size > 0);
+    prefetcher *pf = PyObject_GC_New(prefetcher,
+                                     (PyTypeObject *)state->prefetcher_type);
+    if (pf == NULL) {
+        return NULL;
+    }
+    pf->buf = PyMem_New(PyObject *, size);
+    if (pf->buf == NULL) {
+        pf->it = NULL;
+        Py_DECREF(pf);
+        return PyErr_NoMemory();
     }
+    Py_INCREF(it);
+    pf->it = it;
+    pf->pos = pf->len = 0;
+    pf->size = size;
+    PyObject_GC_Track(pf);
+    return (PyObject *)pf;
+}
 
-    item = PyIter_Next(it);
-    if (item == NULL) {
-        if (PyErr_Occurred()) {
-            goto error;
+/* Refill the empty buffer and return the first item, or NULL if the
+   iterator is exhausted or raised. Items that were fetched before an
+   exception are discarded, so the exception is raised early. */
+static PyObject *
+prefetcher_fill(prefetcher *pf)
+{
+    assert(pf->pos == pf->len);
+    pf->pos = pf->len = 0;
+    while (pf->it != NULL && pf->len < pf->size) {
+        PyObject *item = PyIter_Next(pf->it);
+        if (item == NULL) {
+            Py_CLEAR(pf->it);
+            if (PyErr_Occurred()) {
+                while (pf->len > 0) {
+                    Py_DECREF(pf->buf[--pf->len]);
+                }
+                return NULL;
+            }
+            break;
         }
-        Py_DECREF(it);
-        return 0;
+        pf->buf[pf->len++] = item;
     }
-
-    if (keyfunc == NULL) {
-        Py_INCREF(item);
-        key = item;
+    if (pf->len == 0) {
+        return NULL;
     }
-    else {
-        key = PyObject_CallOneArg(keyfunc, item);
-        if (key == NULL) {
-            goto error;
-        }
+    return pf->buf[pf->pos++];
+}
+
+static inline PyObject *
+prefetcher_next(prefetcher *pf)
+{
+    if (pf->pos < pf->len) {
+        return pf->buf[pf->pos++];
     }
+    return prefetcher_fill(pf);
+}
 
-    *node = PyObject_GC_New(merge_node, &merge_node_type);
-    if (*node == NULL) {
-        goto error;
+static int
+prefetcher_clear(prefetcher *pf)
+{
+    while (pf->pos < pf->len) {
+        Py_DECREF(pf->buf[--pf->len]);
     }
+    Py_CLEAR(pf->it);
+    return 0;
+}
 
-    (*node)->key = key;
-    (*node)->left = item;
-    (*node)->right = it;
-    (*node)->parent = NULL;
-    (*node)->leaf = (*node);
-    return 1;
+static int
+prefetcher_traverse(prefetcher *pf, visitproc visit, void *arg)
+{
+    for (Py_ssize_t i = pf->pos; i < pf->len; i++) {
+        Py_VISIT(pf->buf[i]);
+    }
+    Py_VISIT(pf->it);
+    Py_VISIT(Py_TYPE(pf));
+    return 0;
+}
 
-error:
-    Py_XDECREF(it);
-    Py_XDECREF(item);
-    Py_XDECREF(key);
-    return -1;
+static void
+prefetcher_dealloc(prefetcher *pf)
+{
+    PyTypeObject *tp = Py_TYPE(pf);
+    PyObject_GC_UnTrack(pf);
+    if (pf->buf != NULL) {
+        prefetcher_clear(pf);
+        PyMem_Free(pf->buf);
+    }
+    tp->tp_free(pf);
+    Py_DECREF(tp);
 }
 
-static merge_node *
-construct_parent(merge_node *left, merge_node *right, int reverse)
+static PyType_Slot prefetcher_type_slots[] = {
+    {Py_tp_dealloc, prefetcher_dealloc},
+    {Py_tp_clear, prefetcher_clear},
+    {Py_tp_traverse, prefetcher_traverse},
+    {0, NULL},
+};
+
+static PyType_Spec prefetcher_type_spec = {
+    .name = "multimerge.prefetcher",
+    .basicsize = sizeof(prefetcher),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+             | Py_TPFLAGS_DISALLOW_INSTANTIATION
+#endif
+             ,
+    .slots = prefetcher_type_slots,
+};
+
+/* run readers **************************************************************/
+
+/* A source reading back a run spilled by sort_external(): a file holding
+   a series of pickled lists, each one preceded by its length in bytes
+   as 8 little-endian bytes. */
+typedef struct {
+    PyObject_HEAD
+    PyObject *file;            /* strong; NULL once exhausted */
+    PyObject *loads;           /* strong; pickle.loads */
+    PyObject *batch;           /* strong; the list being read, or NULL */
+    Py_ssize_t pos;
+} run_reader;
+
+static PyObject *run_reader_next(run_reader *rr);
+
+static inline int
+is_run_reader(PyObject *op)
 {
-    assert(left != NULL);
-    assert(right != NULL);
+    return Py_TYPE(op)->tp_iternext == (iternextfunc)run_reader_next;
+}
 
-    int cmp;
-    if (reverse) {
-        cmp = PyObject_RichCompareBool(left->key, right->key, Py_LT);
+#define RUN_HEADER_SIZE 8
+
+static PyObject *
+run_reader_new(merge_state *state, PyObject *file, PyObject *loads)
+{
+    run_reader *rr = PyObject_GC_New(run_reader,
+                                     (PyTypeObject *)state->run_reader_type);
+    if (rr == NULL) {
+        return NULL;
     }
-    else {
-        cmp = PyObject_RichCompareBool(right->key, left->key, Py_LT);
+    Py_INCREF(file);
+    Py_INCREF(loads);
+    rr->file = file;
+    rr->loads = loads;
+    rr->batch = NULL;
+    rr->pos = 0;
+    PyObject_GC_Track(rr);
+    return (PyObject *)rr;
+}
+
+/* Read exactly n bytes from the file. If may_end is true, an empty bytes
+   object at the end of the file is allowed too. */
+static PyObject *
+run_read(run_reader *rr, Py_ssize_t n, int may_end)
+{
+    PyObject *data = PyObject_CallMethod(rr->file, "read", "n", n);
+    if (data == NULL) {
+        return NULL;
     }
-    if (cmp < 0) {
+    if (!PyBytes_Check(data)) {
+        PyErr_SetString(PyExc_TypeError, "run file did not return bytes");
+        Py_DECREF(data);
         return NULL;
     }
-    merge_node *winner = cmp ? right : left;
-    merge_node *parent = PyObject_GC_New(merge_node, &merge_node_type);
-    if (parent == NULL) {
+    if (PyBytes_GET_SIZE(data) != n
+        && !(may_end && PyBytes_GET_SIZE(data) == 0))
+    {
+        PyErr_SetString(PyExc_ValueError, "run file is truncated");
+        Py_DECREF(data);
         return NULL;
     }
-    parent->key = winner->key;
-    parent->leaf = winner->leaf;
-    parent->left = (PyObject *)left;
-    parent->right = (PyObject *)right;
-    parent->parent = NULL;
-    Py_INCREF(left);
-    Py_INCREF(right);
-    left->parent = right->parent = parent;
-    return parent;
+    return data;
 }
 
-static int
-build_tree(mergeobject *mo)
+/* Close the file, keeping any exception that is already set. */
+static void
+run_reader_close(run_reader *rr)
 {
-    assert(mo->state == 0);
-    assert(PyTuple_CheckExact(mo->iterables));
-
-    Py_ssize_t n0 = PyTuple_GET_SIZE(mo->iterables);
-    PyObject *new_nodes = NULL;
-    PyObject *nodes = PyList_New(0);
-    if (nodes == NULL) {
-        return -1;
+    if (rr->file == NULL) {
+        return;
     }
-    
-    /* first put each nonempty iterator into a leaf. */
-    for (Py_ssize_t i=0; i < n0; i++) {
-        PyObject *it = PyTuple_GET_ITEM(mo->iterables, i);
-        merge_node *leaf;
-        int result = construct_leaf(it, mo->keyfunc, &leaf);
-        if (result < 0) {
-            goto error;
-        }
-        if (result) {
-            if (PyList_Append(nodes, (PyObject *)leaf) < 0) {
-                Py_DECREF(leaf);
-                goto error;
-            }
-            Py_DECREF(leaf);
-        }
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+    PyObject *res = PyObject_CallMethod(rr->file, "close", NULL);
+    if (res == NULL) {
+        PyErr_WriteUnraisable(rr->file);
     }
-    Py_CLEAR(mo->iterables);
+    Py_XDECREF(res);
+    PyErr_Restore(type, value, tb);
+    Py_CLEAR(rr->file);
+}
 
-    n0 = PyList_GET_SIZE(nodes);
-    if (n0 == 0) {
-        /* All iterators were empty. */
-        goto error;
+static PyObject *
+run_reader_fill(run_reader *rr)
+{
+    Py_CLEAR(rr->batch);
+    if (rr->file == NULL) {
+        return NULL;
     }
-    if (n0 == 1) {
-        /* Only one node, so don't compute keys. */
-        Py_CLEAR(mo->keyfunc);
+    PyObject *header = run_read(rr, RUN_HEADER_SIZE, 1);
+    if (header == NULL) {
+        return NULL;
+    }
+    if (PyBytes_GET_SIZE(header) == 0) {
+        Py_DECREF(header);
+        run_reader_close(rr);
+        return NULL;
+    }
+    const unsigned char *h = (const unsigned char *)PyBytes_AS_STRING(header);
+    unsigned long long n = 0;
+    for (int i = RUN_HEADER_SIZE - 1; i >= 0; i--) {
+        n = (n << 8) | h[i];
+    }
+    Py_DECREF(header);
+    if (n > PY_SSIZE_T_MAX) {
+        PyErr_SetString(PyExc_ValueError, "run file is corrupt");
+        return NULL;
+    }
+    PyObject *data = run_read(rr, (Py_ssize_t)n, 0);
+    if (data == NULL) {
+        return NULL;
+    }
+    PyObject *batch = PyObject_CallOneArg(rr->loads, data);
+    Py_DECREF(data);
+    if (batch == NULL) {
+        return NULL;
+    }
+    if (!PyList_CheckExact(batch) || PyList_GET_SIZE(batch) == 0) {
+        PyErr_SetString(PyExc_ValueError, "run file is corrupt");
+        Py_DECREF(batch);
+        return NULL;
     }
+    rr->batch = batch;
+    rr->pos = 1;
+    PyObject *item = PyList_GET_ITEM(batch, 0);
+    Py_INCREF(item);
+    return item;
+}
 
-    /* Now repeatedly unite pairs of adjacent nodes by adding a common
-       parent. Stop once we have one united binary tree. */
-    while (n0 > 1) {
-        Py_ssize_t n1 = (n0 + 1) / 2;
-        new_nodes = PyList_New(n1);
-        if (new_nodes == NULL) {
-            goto error;
-        }
-        Py_ssize_t j = 0;
-        if (n0 & 1) {
-            PyObject *first = PyList_GET_ITEM(nodes, 0);
-            Py_INCREF(first);
-            PyList_SET_ITEM(new_nodes, j, first);
-            j++;
-        }
-        for (Py_ssize_t i = n0 & 1; i < n0 - 1; (i += 2), (j++)) {
-            merge_node *left = (merge_node *)PyList_GET_ITEM(nodes, i);
-            merge_node *right = (merge_node *)PyList_GET_ITEM(nodes, i + 1);
-            merge_node *parent = construct_parent(left, right, mo->reverse);
-            if (parent == NULL) {
-                goto error;
-            }
-            PyList_SET_ITEM(new_nodes, j, (PyObject *)parent);
-        }
-        assert(j == n1);
-        Py_SETREF(nodes, new_nodes);
-        n0 = n1;
+static inline PyObject *
+run_reader_next(run_reader *rr)
+{
+    if (rr->batch != NULL && rr->pos < PyList_GET_SIZE(rr->batch)) {
+        PyObject *item = PyList_GET_ITEM(rr->batch, rr->pos++);
+        Py_INCREF(item);
+        return item;
     }
+    return run_reader_fill(rr);
+}
 
-    mo->root = (merge_node *)PyList_GET_ITEM(nodes, 0);
-    Py_INCREF(mo->root);
-    Py_DECREF(nodes);
+static int
+run_reader_clear(run_reader *rr)
+{
+    Py_CLEAR(rr->file);
+    Py_CLEAR(rr->loads);
+    Py_CLEAR(rr->batch);
     return 0;
-
-error:
-    Py_CLEAR(mo->iterables);
-    Py_XDECREF(new_nodes);
-    Py_XDECREF(nodes);
-    return -1;
-}
+}
 
 static int
-refill_leaf(merge_node *leaf, PyObject *keyfunc)
+run_reader_traverse(run_reader *rr, visitproc visit, void *arg)
 {
-    PyObject *it = leaf_iterator(leaf);
-    PyObject *item = PyIter_Next(it);
-    if (item == NULL) {
-        if (PyErr_Occurred()) {
-            return -1;
-        }
-        return 0;
-    }
-    PyObject *key;
-    if (keyfunc == NULL) {
-        key = item;
-        Py_INCREF(key);
-    }
-    else {
-        key = PyObject_CallOneArg(keyfunc, item);
-        if (key == NULL) {
-            Py_DECREF(item);
-            return -1;
-        }
-    }
-    assert(leaf->left == NULL);
-    leaf->left = item;
-    assert(leaf->key == NULL);
-    leaf->key = key;
-    return 1;
+    Py_VISIT(rr->file);
+    Py_VISIT(rr->loads);
+    Py_VISIT(rr->batch);
+    Py_VISIT(Py_TYPE(rr));
+    return 0;
 }
 
-static merge_node *
-promote_sibling_of(merge_node *leaf)
+static void
+run_reader_dealloc(run_reader *rr)
 {
-    merge_node *parent = leaf->parent;
-    if (parent == NULL) {
-        /* End the iteration now. */
-        return NULL;
-    }
-    merge_node *left = left_child(parent);
-    merge_node *right = right_child(parent);
-    merge_node *sibling = (leaf == left) ? right : left;
+    PyTypeObject *tp = Py_TYPE(rr);
+    PyObject_GC_UnTrack(rr);
+    run_reader_close(rr);
+    run_reader_clear(rr);
+    tp->tp_free(rr);
+    Py_DECREF(tp);
+}
 
-    parent->key = sibling->key;
-    parent->leaf = sibling->leaf;
-    parent->left = sibling->left;
-    parent->right = sibling->right;
+static PyType_Slot run_reader_type_slots[] = {
+    {Py_tp_dealloc, run_reader_dealloc},
+    {Py_tp_clear, run_reader_clear},
+    {Py_tp_traverse, run_reader_traverse},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, run_reader_next},
+    {0, NULL},
+};
 
-    if (is_leaf(sibling)) {
-        /* sibling was a leaf, so parent is now a leaf. */
-        parent->leaf = parent;
-    }
-    else {
-        left_child(sibling)->parent = parent;
-        right_child(sibling)->parent = parent;
-    }
+static PyType_Spec run_reader_type_spec = {
+    .name = "multimerge.run_reader",
+    .basicsize = sizeof(run_reader),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+             | Py_TPFLAGS_DISALLOW_INSTANTIATION
+#endif
+             ,
+    .slots = run_reader_type_slots,
+};
 
-    /* Clear these so we don't decref them; 
-       they were just moved into the parent. */
-    sibling->left = NULL;
-    sibling->right = NULL;
-    sibling->key = NULL;
-    
-    Py_DECREF(leaf);
-    Py_DECREF(sibling);
+/* memory-mapped records ****************************************************/
 
-    assert(is_leaf(parent->leaf));
-    return parent;
+/* A source reading the records of a file straight out of a read-only
+   memory map: either the pieces between separators, or fixed-size
+   records. Each record is produced as a bytes object, without the
+   separator. */
+#define MMAP_SEP_MAX 16
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *path;            /* strong */
+    PyObject *map;             /* strong; the mmap.mmap, NULL when done */
+    Py_buffer view;            /* of map, while map is not NULL */
+    Py_ssize_t pos;
+    Py_ssize_t record_size;    /* 0 for records ended by sep */
+    char sep[MMAP_SEP_MAX];
+    Py_ssize_t sep_len;
+} mmap_records;
+
+/* Release the map, keeping any exception that is already set. */
+static void
+mmap_records_close(mmap_records *mr)
+{
+    if (mr->map == NULL) {
+        return;
+    }
+    PyBuffer_Release(&mr->view);
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+    PyObject *res = PyObject_CallMethod(mr->map, "close", NULL);
+    if (res == NULL) {
+        PyErr_WriteUnraisable(mr->map);
+    }
+    Py_XDECREF(res);
+    PyErr_Restore(type, value, tb);
+    Py_CLEAR(mr->map);
 }
 
+/* Map the whole of the open file, or leave mr->map NULL if it is empty. */
 static int
-replay_games(mergeobject *mo)
+mmap_records_map(mmap_records *mr, PyObject *file)
 {
-    assert(mo->state == 1);
-    merge_node *root = mo->root;
-    merge_node *node = root->leaf;
-    
-    switch (refill_leaf(node, mo->keyfunc)) {
-    case -1:
-        /* error */
-        return -1;
-    case 0:
-        /* iterator empty */
-        node = promote_sibling_of(node);
-        if (node == NULL) {
-            return -1;
-        }
-        if (is_leaf(root)) {
-            /* Only one iterator is left, so use values as keys. */
-            Py_CLEAR(mo->keyfunc);
+    PyObject *mmap = NULL, *size = NULL, *fd = NULL, *map = NULL;
+    int result = -1;
+    size = PyObject_CallMethod(file, "seek", "ii", 0, 2);
+    if (size == NULL) {
+        goto done;
+    }
+    int is_empty = PyObject_Not(size);
+    if (is_empty != 0) {
+        result = is_empty < 0 ? -1 : 0;
+        goto done;
+    }
+    mmap = PyImport_ImportModule("mmap");
+    fd = PyObject_CallMethod(file, "fileno", NULL);
+    if (mmap == NULL || fd == NULL) {
+        goto done;
+    }
+    PyObject *mmap_type = PyObject_GetAttrString(mmap, "mmap");
+    PyObject *access = PyObject_GetAttrString(mmap, "ACCESS_READ");
+    PyObject *args = Py_BuildValue("(Oi)", fd, 0);
+    PyObject *kwargs = access ? Py_BuildValue("{s:O}", "access", access)
+                              : NULL;
+    if (mmap_type != NULL && args != NULL && kwargs != NULL) {
+        map = PyObject_Call(mmap_type, args, kwargs);
+    }
+    Py_XDECREF(mmap_type);
+    Py_XDECREF(access);
+    Py_XDECREF(args);
+    Py_XDECREF(kwargs);
+    if (map == NULL) {
+        goto done;
+    }
+    /* Ask for aggressive readahead where the platform supports it. */
+    PyObject *advice = PyObject_GetAttrString(mmap, "MADV_SEQUENTIAL");
+    if (advice != NULL) {
+        PyObject *res = PyObject_CallMethod(map, "madvise", "O", advice);
+        Py_DECREF(advice);
+        if (res == NULL) {
+            goto done;
         }
-        break;
-    case 1:
-        /* got a value */
-        break;
+        Py_DECREF(res);
     }
-
-    #define DO_GAMES(OP1, OP2) do {                              \
-        while (node != root) {                                   \
-            node = node->parent;                                 \
-            merge_node *left = left_child(node);                 \
-            merge_node *right = right_child(node);               \
-            int cmp = PyObject_RichCompareBool(OP1, OP2, Py_LT); \
-            if (cmp < 0) {                                       \
-                return -1;                                       \
-            }                                                    \
-            merge_node *winner = cmp ? right : left;             \
-            node->key = winner->key;                             \
-            node->leaf = winner->leaf;                           \
-        }                                                        \
-    } while (0)
-
-    if (mo->reverse) {
-        /* winner = right if left < right else left */
-        DO_GAMES(left->key, right->key);
+    else if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        PyErr_Clear();
     }
     else {
-        /* winner = right if right < left else left */
-        DO_GAMES(right->key, left->key);
+        goto done;
     }
-
-    #undef DO_GAMES
-    return 0;
+    if (PyObject_GetBuffer(map, &mr->view, PyBUF_SIMPLE) < 0) {
+        goto done;
+    }
+    mr->map = map;
+    map = NULL;
+    result = 0;
+done:
+    if (map != NULL) {
+        PyObject *res = PyObject_CallMethod(map, "close", NULL);
+        if (res == NULL) {
+            PyErr_WriteUnraisable(map);
+        }
+        Py_XDECREF(res);
+        Py_DECREF(map);
+    }
+    Py_XDECREF(mmap);
+    Py_XDECREF(size);
+    Py_XDECREF(fd);
+    return result;
 }
 
 static PyObject *
-merge_next(mergeobject *mo)
+mmap_records_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    switch (mo->state) {
-    case 0:
-        if (build_tree(mo) < 0) {
-            mo->state = 2;
+    PyObject *path, *sep = Py_None, *record_size_obj = Py_None;
+    char *kwlist[] = {"", "sep", "record_size", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O$O:mmap_records",
+                                     kwlist, &path, &sep,
+                                     &record_size_obj)) {
+        return NULL;
+    }
+    Py_ssize_t record_size = 0;
+    const char *sep_data = "\n";
+    Py_ssize_t sep_len = 1;
+    if (record_size_obj != Py_None) {
+        if (sep != Py_None) {
+            PyErr_SetString(PyExc_TypeError,
+                            "sep and record_size cannot both be given");
             return NULL;
         }
-        mo->state = 1;
-        break;
-    case 1:
-        if (replay_games(mo) < 0) {
-            mo->state = 2;
+        record_size = PyNumber_AsSsize_t(record_size_obj,
+                                         PyExc_OverflowError);
+        if (record_size == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (record_size < 1) {
+            PyErr_SetString(PyExc_ValueError,
+                            "record_size must be at least 1");
             return NULL;
         }
-        break;
-    case 2:
-        return NULL;
     }
-    return leaf_pop_item(mo->root->leaf);
-}
-
-static PyObject *
-merge_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-    PyObject *key = NULL;
-    int reverse = 0;
-
-    if (kwds != NULL) {
-        char *kwlist[] = {"key", "reverse", NULL};
-        PyObject *tmpargs = PyTuple_New(0);
-        if (tmpargs == NULL) {
+    else if (sep != Py_None) {
+        if (!PyBytes_Check(sep)) {
+            PyErr_Format(PyExc_TypeError, "sep must be bytes, not %.200s",
+                         Py_TYPE(sep)->tp_name);
             return NULL;
         }
-        if (!PyArg_ParseTupleAndKeywords(tmpargs, kwds, "|Op:merge",
-                                         kwlist, &key, &reverse)) {
-            Py_DECREF(tmpargs);
+        sep_data = PyBytes_AS_STRING(sep);
+        sep_len = PyBytes_GET_SIZE(sep);
+        if (sep_len < 1 || sep_len > MMAP_SEP_MAX) {
+            PyErr_SetString(PyExc_ValueError,
+                            "sep must be between 1 and 16 bytes long");
             return NULL;
         }
-        Py_DECREF(tmpargs);
     }
 
-    int state;
+    mmap_records *mr = (mmap_records *)type->tp_alloc(type, 0);
+    if (mr == NULL) {
+        return NULL;
+    }
+    Py_INCREF(path);
+    mr->path = path;
+    mr->map = NULL;
+    mr->pos = 0;
+    mr->record_size = record_size;
+    memcpy(mr->sep, sep_data, sep_len);
+    mr->sep_len = sep_len;
 
-    assert(PyTuple_CheckExact(args));
-    if (PyTuple_GET_SIZE(args) == 0) {
-        state = 2;
-        args = NULL;
-        key = NULL;
+    PyObject *file = NULL;
+    PyObject *io = PyImport_ImportModule("io");
+    if (io != NULL) {
+        file = PyObject_CallMethod(io, "open", "Os", path, "rb");
+        Py_DECREF(io);
+    }
+    if (file == NULL) {
+        Py_DECREF(mr);
+        return NULL;
+    }
+    /* The map keeps its own handle, so the file is closed right away. */
+    int err = mmap_records_map(mr, file);
+    PyObject *res = PyObject_CallMethod(file, "close", NULL);
+    Py_DECREF(file);
+    if (err < 0 || res == NULL) {
+        Py_XDECREF(res);
+        Py_DECREF(mr);
+        return NULL;
+    }
+    Py_DECREF(res);
+    if (record_size && mr->map && mr->view.len % record_size) {
+        PyErr_SetString(PyExc_ValueError,
+                        "file size is not a multiple of record_size");
+        Py_DECREF(mr);
+        return NULL;
+    }
+    return (PyObject *)mr;
+}
+
+static PyObject *
+mmap_records_next_lock_held(mmap_records *mr)
+{
+    if (mr->map == NULL) {
+        return NULL;
+    }
+    const char *buf = (const char *)mr->view.buf;
+    Py_ssize_t len = mr->view.len, pos = mr->pos;
+    if (pos >= len) {
+        mmap_records_close(mr);
+        return NULL;
+    }
+    Py_ssize_t end, next;
+    if (mr->record_size) {
+        end = next = pos + mr->record_size;
     }
     else {
-        state = 0;
-        if (key == Py_None) {
-            key = NULL;
+        /* Find the next separator, by its first byte then the rest. */
+        const char *p = buf + pos;
+        const char *stop = buf + len - mr->sep_len + 1;
+        for (;;) {
+            if (p >= stop) {
+                end = next = len;
+                break;
+            }
+            p = memchr(p, mr->sep[0], stop - p);
+            if (p == NULL) {
+                end = next = len;
+                break;
+            }
+            if (memcmp(p, mr->sep, mr->sep_len) == 0) {
+                end = p - buf;
+                next = end + mr->sep_len;
+                break;
+            }
+            p++;
         }
     }
+    mr->pos = next;
+    return PyBytes_FromStringAndSize(buf + pos, end - pos);
+}
 
-    mergeobject *mo = (mergeobject *)type->tp_alloc(type, 0);
-    if (mo) {
-        Py_XINCREF(args);
-        Py_XINCREF(key);
-        mo->root = NULL;
-        mo->iterables = args;
-        mo->keyfunc = key;
-        mo->reverse = reverse;
-        mo->state = state;
-        return (PyObject *)mo;
-    }
-    return NULL;
+static PyObject *
+mmap_records_next(mmap_records *mr)
+{
+    PyObject *item;
+    Py_BEGIN_CRITICAL_SECTION(mr);
+    item = mmap_records_next_lock_held(mr);
+    Py_END_CRITICAL_SECTION();
+    return item;
 }
 
 static int
-merge_clear(mergeobject *mo)
+mmap_records_traverse(mmap_records *mr, visitproc visit, void *arg)
 {
-    Py_CLEAR(mo->root);
-    Py_CLEAR(mo->iterables);
-    Py_CLEAR(mo->keyfunc);
+    Py_VISIT(Py_TYPE(mr));
+    Py_VISIT(mr->path);
+    Py_VISIT(mr->map);
     return 0;
 }
 
 static void
-merge_dealloc(mergeobject *mo)
+mmap_records_dealloc(mmap_records *mr)
 {
-    PyObject_GC_UnTrack(mo);
-    merge_clear(mo);
-    Py_TYPE(mo)->tp_free(mo);
+    PyTypeObject *tp = Py_TYPE(mr);
+    PyObject_GC_UnTrack(mr);
+    mmap_records_close(mr);
+    Py_XDECREF(mr->path);
+    tp->tp_free(mr);
+    Py_DECREF(tp);
 }
 
-static int
-merge_traverse(mergeobject *mo, visitproc visit, void *arg)
+/* Pickled as the path, to be mapped again, and the position reached. */
+static PyObject *
+mmap_records_reduce(mmap_records *mr, PyObject *Py_UNUSED(ignored))
 {
-    Py_VISIT(mo->root);
-    Py_VISIT(mo->iterables);
-    Py_VISIT(mo->keyfunc);
-    return 0;
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(mr);
+    res = Py_BuildValue("O(O)(Nnn)", Py_TYPE(mr), mr->path,
+                        PyBytes_FromStringAndSize(mr->sep, mr->sep_len),
+                        mr->record_size, mr->map ? mr->pos : -1);
+    Py_END_CRITICAL_SECTION();
+    return res;
 }
 
-PyDoc_STRVAR(merge_doc,
-"merge(*iterables, key=None, reverse=False) --> merge object\n\
-\n\
-Merge multiple sorted inputs into a single sorted output.\n\
-\n\
-Similar to sorted(itertools.chain(*iterables)) but returns a generator,\n\
-does not pull the data into memory all at once, and assumes that each of\n\
-the input streams is already sorted (smallest to largest).\n\
-\n\
->>> list(merge([1,3,5,7], [0,2,4,8], [5,10,15,20], [], [25]))\n\
-[0, 1, 2, 3, 4, 5, 5, 7, 8, 10, 15, 20, 25]\n\
+static PyObject *
+mmap_records_setstate_lock_held(mmap_records *mr, PyObject *state)
+{
+    PyObject *sep;
+    Py_ssize_t record_size, pos;
+    if (!PyTuple_Check(state)
+        || !PyArg_ParseTuple(state, "O!nn;invalid mmap_records state",
+                             &PyBytes_Type, &sep, &record_size, &pos))
+    {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError,
+                            "mmap_records state must be a tuple");
+        }
+        return NULL;
+    }
+    Py_ssize_t len = mr->map ? mr->view.len : 0;
+    if (PyBytes_GET_SIZE(sep) < 1 || PyBytes_GET_SIZE(sep) > MMAP_SEP_MAX
+        || record_size < 0 || pos < -1
+        || (record_size && pos > 0 && pos % record_size))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid mmap_records state");
+        return NULL;
+    }
+    if (pos > len || (record_size && len % record_size)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the file has changed since it was pickled");
+        return NULL;
+    }
+    memcpy(mr->sep, PyBytes_AS_STRING(sep), PyBytes_GET_SIZE(sep));
+    mr->sep_len = PyBytes_GET_SIZE(sep);
+    mr->record_size = record_size;
+    if (pos < 0) {
+        mmap_records_close(mr);
+    }
+    else {
+        mr->pos = pos;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+mmap_records_setstate(mmap_records *mr, PyObject *state)
+{
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(mr);
+    res = mmap_records_setstate_lock_held(mr, state);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PyMethodDef mmap_records_methods[] = {
+    {"__reduce__", (PyCFunction)mmap_records_reduce, METH_NOARGS, NULL},
+    {"__setstate__", (PyCFunction)mmap_records_setstate, METH_O, NULL},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(mmap_records_doc,
+"mmap_records(path, sep=b'\\n', *, record_size=None)\n\
+--\n\
 \n\
-If *key* is not None, applies a key function to each element to determine\n\
-its sort order.\n\
+Return an iterator over the records of the file at path, read through a\n\
+read-only memory map. The records are the bytes between occurrences of\n\
+sep (which are not included, and there is no empty record after a final\n\
+sep), or if record_size is given, consecutive pieces of that many bytes.\n\
 \n\
->>> list(merge(['dog', 'horse'], ['cat', 'fish', 'kangaroo'], key=len))\n\
-['dog', 'cat', 'fish', 'horse', 'kangaroo']");
+merge() reads these records without going through the iterator\n\
+protocol, so sorted files can be merged with, for example,\n\
+merge(*map(mmap_records, paths)). Pickling saves the path and the\n\
+position reached, and unpickling maps the file again.");
 
-static PyType_Slot merge_type_slots[] = {
-    {Py_tp_dealloc, merge_dealloc},
-    {Py_tp_doc, (void *)merge_doc},
-    {Py_tp_traverse, merge_traverse},
-    {Py_tp_clear, merge_clear},
+static PyType_Slot mmap_records_type_slots[] = {
+    {Py_tp_dealloc, mmap_records_dealloc},
+    {Py_tp_doc, (void *)mmap_records_doc},
+    {Py_tp_traverse, mmap_records_traverse},
     {Py_tp_iter, PyObject_SelfIter},
-    {Py_tp_iternext, merge_next},
-    {Py_tp_new, merge_new},
+    {Py_tp_iternext, mmap_records_next},
+    {Py_tp_methods, mmap_records_methods},
+    {Py_tp_new, mmap_records_new},
     {0, NULL},
 };
 
-static PyType_Spec merge_type_spec = {
-    .name = "multimerge.merge",
-    .basicsize = sizeof(mergeobject),
+static PyType_Spec mmap_records_type_spec = {
+    .name = "multimerge.mmap_records",
+    .basicsize = sizeof(mmap_records),
     .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
-    .slots = merge_type_slots,
+    .slots = mmap_records_type_slots,
 };
 
-static int
-multimerge_exec(PyObject *module)
+/* A leaf's source, and its keys' source, is either an exact list or
+   tuple, read at the position of the next item, or an iterator. */
+static inline PyObject *
+source_next(PyObject *src, Py_ssize_t index)
 {
-    merge_state *state = get_merge_state(module);
-    state->merge_type = PyType_FromModuleAndSpec(module,
-                                                 &merge_type_spec, NULL);
-    if (state->merge_type == NULL) {
+    PyObject *item;
+    if (PyList_CheckExact(src)) {
+#ifdef Py_GIL_DISABLED
+        /* Another thread may be resizing the list. */
+        item = NULL;
+        Py_BEGIN_CRITICAL_SECTION(src);
+        if (index < PyList_GET_SIZE(src)) {
+            item = PyList_GET_ITEM(src, index);
+            Py_INCREF(item);
+        }
+        Py_END_CRITICAL_SECTION();
+        return item;
+#else
+        if (index >= PyList_GET_SIZE(src)) {
+            return NULL;
+        }
+        item = PyList_GET_ITEM(src, index);
+#endif
+    }
+    else if (PyTuple_CheckExact(src)) {
+        if (index >= PyTuple_GET_SIZE(src)) {
+            return NULL;
+        }
+        item = PyTuple_GET_ITEM(src, index);
+    }
+    else if (is_prefetcher(src)) {
+        return prefetcher_next((prefetcher *)src);
+    }
+    else if (is_run_reader(src)) {
+        return run_reader_next((run_reader *)src);
+    }
+    else if (Py_TYPE(src)->tp_iternext == (iternextfunc)mmap_records_next) {
+        return mmap_records_next((mmap_records *)src);
+    }
+    else {
+        return PyIter_Next(src);
+    }
+    Py_INCREF(item);
+    return item;
+}
+
+/* merge object *************************************************************/
+
+/* How many consecutive wins by one leaf before galloping. */
+#define MIN_GALLOP 7
+
+/* What a merge object produces. */
+enum merge_mode {
+    MODE_ALL,           /* every item */
+    MODE_UNIQUE,        /* the first item with each key */
+    MODE_GROUPBY,       /* (key, items) pairs */
+    MODE_INTERSECT,     /* the first item of each key found in every input */
+    MODE_THRESHOLD,     /* ... found in at least mo->threshold inputs */
+    MODE_DIFFERENCE,    /* ... found in the first input and no other */
+};
+
+/* Counters for merge.stats(). They are only compiled in if
+   MULTIMERGE_STATS is defined, which setup.py does when the environment
+   variable of the same name is set. */
+#ifdef MULTIMERGE_STATS
+typedef struct {
+    Py_ssize_t comparisons;
+    Py_ssize_t key_calls;
+    Py_ssize_t exhausted;      /* inputs that ran out, or were empty */
+    int max_depth;
+    Py_ssize_t *refills;       /* reads after the tree was built, by source */
+    Py_ssize_t nrefills;       /* the size of refills */
+} merge_stats;
+#  define STAT_ADD(mo, field, n) ((mo)->stats.field += (n))
+#  define STAT_REFILL(mo, source) stat_refill((mo), (source), 1)
+#  define STAT_REFILLS(mo, source, n) stat_refill((mo), (source), (n))
+#  define STAT_INPUTS(mo, n) stat_inputs((mo), (n))
+#  define STAT_DEPTH(mo) stat_depth(mo)
+#else
+#  define STAT_ADD(mo, field, n) ((void)0)
+#  define STAT_REFILL(mo, source) ((void)0)
+#  define STAT_REFILLS(mo, source, n) ((void)(source))
+#  define STAT_INPUTS(mo, n) ((void)0)
+#  define STAT_DEPTH(mo) ((void)0)
+#endif
+
+/* An entry of the flat layout's tree of losers. */
+typedef struct {
+    Py_ssize_t leaf;
+    PyObject *key;             /* borrowed from keys[leaf] */
+} flat_game;
+
+typedef struct {
+    PyObject_HEAD
+    merge_state *module_state; /* of the module that made this type */
+    merge_node *root;
+    PyObject *iterables;
+    PyObject *key_iterables;   /* NULL unless keys= was given */
+    PyObject *keyfunc;
+    PyObject *fields;          /* NULL unless keyfunc is read natively */
+    PyTypeObject *key_type;    /* borrowed; NULL if keys are mixed */
+    lt_func lt;
+    Py_ssize_t prefetch;       /* 0 unless prefetch= was given */
+    PyObject *lower_bounds;    /* NULL unless lower_bounds= was given */
+    Py_ssize_t ndeferred;      /* deferred inputs not yet opened */
+    Py_ssize_t nopen;          /* opened inputs not yet exhausted */
+    Py_ssize_t max_open;       /* -1 if unlimited */
+    PyObject *last_key;        /* strong; key last produced with unique= */
+    Py_ssize_t threshold;      /* inputs needed, for intersect and threshold */
+    Py_ssize_t limit;          /* outputs left before stopping, or -1 */
+    PyObject *stop_key;        /* strong; stop at a key not before this */
+    /* Only used for the tree of merge_nodes: */
+    merge_node **leaf_of;      /* borrowed; the leaf of each source or NULL */
+    Py_ssize_t nsources;       /* sources so far, including added ones */
+    Py_ssize_t leaf_of_size;
+    /* Only used for the flat layout: */
+    Py_ssize_t nleaves;
+    Py_ssize_t nlive;          /* leaves that are not yet exhausted */
+    PyObject **items;          /* strong; one block holds all 4 arrays */
+    PyObject **keys;           /* strong; NULL once exhausted */
+    PyObject **iters;          /* strong */
+    PyObject **keys_iters;     /* strong; all NULL unless keys= was given */
+    Py_ssize_t *sources;       /* one block holds sources and ordinals */
+    Py_ssize_t *ordinals;
+    flat_game *losers;         /* losers[0] is the overall winner */
+    /* Galloping: */
+    Py_ssize_t streak;         /* consecutive wins by the current winner */
+    PyObject *runner_up;       /* borrowed; NULL if there is no other leaf */
+    char runner_up_later;      /* runner-up is after the winner in order */
+    char galloping;
+    char single;               /* one leaf is left, so keys aren't needed */
+    char mode;                 /* an enum merge_mode */
+    char donor;                /* another merge has taken keys from this */
+    char has_keys;             /* keys= was given */
+    char flat;
+    char with_source;
+    char reverse;
+    char state;
+    char fields_are_attrs;     /* fields are attribute names, not items */
+#ifdef MULTIMERGE_STATS
+    merge_stats stats;
+#endif
+} mergeobject;
+
+#ifdef MULTIMERGE_STATS
+/* Make room to count the refills of n inputs. */
+static void
+stat_inputs(mergeobject *mo, Py_ssize_t n)
+{
+    merge_stats *st = &mo->stats;
+    if (n <= st->nrefills) {
+        return;
+    }
+    Py_ssize_t *refills = PyMem_Resize(st->refills, Py_ssize_t, n);
+    if (refills == NULL) {
+        /* Not worth failing the merge for. */
+        return;
+    }
+    for (Py_ssize_t i = st->nrefills; i < n; i++) {
+        refills[i] = 0;
+    }
+    st->refills = refills;
+    st->nrefills = n;
+}
+
+static void
+stat_refill(mergeobject *mo, Py_ssize_t source, Py_ssize_t n)
+{
+    merge_stats *st = &mo->stats;
+    if (source >= st->nrefills) {
+        stat_inputs(mo, Py_MAX(2 * st->nrefills, source + 1));
+        if (source >= st->nrefills) {
+            return;
+        }
+    }
+    st->refills[source] += n;
+}
+
+static int
+tree_depth(mergeobject *mo)
+{
+    int depth = 0;
+    if (mo->flat) {
+        while (((Py_ssize_t)1 << depth) < mo->nleaves) {
+            depth++;
+        }
+    }
+    else if (mo->root != NULL) {
+        depth = mo->root->height;
+    }
+    return depth;
+}
+
+/* Note the depth of the tree, after it has grown. */
+static void
+stat_depth(mergeobject *mo)
+{
+    mo->stats.max_depth = Py_MAX(mo->stats.max_depth, tree_depth(mo));
+}
+#endif
+
+/* Whether key a comes strictly before key b, or -1 on error. */
+static inline int
+key_precedes(mergeobject *mo, PyObject *a, PyObject *b)
+{
+    STAT_ADD(mo, comparisons, 1);
+    return mo->reverse ? mo->lt(b, a) : mo->lt(a, b);
+}
+
+/* Like key_precedes, for keys that might not have the same type, such as
+   one from before mo->key_type was last changed. */
+static int
+any_key_precedes(mergeobject *mo, PyObject *a, PyObject *b)
+{
+    if (Py_TYPE(a) != Py_TYPE(b)) {
+        /* mo->lt may be specialized for only one of these. */
+        STAT_ADD(mo, comparisons, 1);
+        return mo->reverse ? safe_object_lt(b, a) : safe_object_lt(a, b);
+    }
+    return key_precedes(mo, a, b);
+}
+
+/* Whether a galloping leaf with this new key still beats the runner-up,
+   or -1 on error. */
+static inline int
+gallop_continues(mergeobject *mo, PyObject *key)
+{
+    if (mo->runner_up == NULL) {
+        return 1;
+    }
+    if (mo->runner_up_later) {
+        /* The galloping leaf wins ties. */
+        int cmp = key_precedes(mo, mo->runner_up, key);
+        return cmp < 0 ? -1 : !cmp;
+    }
+    return key_precedes(mo, key, mo->runner_up);
+}
+
+static inline void
+stop_galloping(mergeobject *mo)
+{
+    mo->galloping = 0;
+    mo->streak = 0;
+    mo->runner_up = NULL;
+}
+
+static inline void
+note_key_type(mergeobject *mo, PyObject *key)
+{
+    if (mo->key_type != NULL && Py_TYPE(key) != mo->key_type) {
+        /* Mixed key types: use generic comparisons from now on. */
+        mo->key_type = NULL;
+        mo->lt = safe_object_lt;
+    }
+}
+
+/* Whether keys must be computed even with only one leaf left, since
+   every mode but MODE_ALL compares each key with the one before it, and
+   stop_key= compares each key with the stop key. */
+static inline int
+needs_keys(mergeobject *mo)
+{
+    return (!mo->single || mo->mode != MODE_ALL || mo->stop_key != NULL
+            || mo->donor);
+}
+
+static int take_with_key(mergeobject *inner, PyObject **pitem,
+                         PyObject **pkey);
+
+/* Whether src is a merge whose keys are the ones this merge would
+   compute for its items, so that it can take them instead. */
+static inline int
+shares_keys(mergeobject *mo, PyObject *src)
+{
+    if (!Py_IS_TYPE(src, Py_TYPE(mo)) || src == (PyObject *)mo) {
+        return 0;
+    }
+    mergeobject *inner = (mergeobject *)src;
+    if (inner->keyfunc != mo->keyfunc || inner->reverse != mo->reverse
+        || inner->mode != MODE_ALL || inner->with_source || inner->has_keys)
+    {
+        return 0;
+    }
+    if (!inner->donor) {
+        if (inner->single && inner->keyfunc != NULL) {
+            /* The key of its next item may not have been computed. */
+            return 0;
+        }
+        inner->donor = 1;
+    }
+    return 1;
+}
+
+/* Native keys **************************************************************/
+
+/* If the key function is an operator.itemgetter or attrgetter, remember
+   what it gets, so that keys can be made without calling it. */
+static void
+read_getter(mergeobject *mo)
+{
+    PyObject *keyfunc = mo->keyfunc;
+    if (keyfunc == NULL) {
+        return;
+    }
+    merge_state *state = mo->module_state;
+    int attrs = Py_IS_TYPE(keyfunc, (PyTypeObject *)state->attrgetter_type);
+    if (!attrs
+        && !Py_IS_TYPE(keyfunc, (PyTypeObject *)state->itemgetter_type))
+    {
+        return;
+    }
+    /* Both pickle as (type, fields). */
+    PyObject *reduced = PyObject_CallMethod(keyfunc, "__reduce__", NULL);
+    if (reduced == NULL) {
+        PyErr_Clear();
+        return;
+    }
+    PyObject *fields = NULL;
+    if (PyTuple_Check(reduced) && PyTuple_GET_SIZE(reduced) == 2
+        && PyTuple_CheckExact(PyTuple_GET_ITEM(reduced, 1))
+        && PyTuple_GET_SIZE(PyTuple_GET_ITEM(reduced, 1)) > 0)
+    {
+        fields = PyTuple_GET_ITEM(reduced, 1);
+    }
+    for (Py_ssize_t i = 0; attrs && fields != NULL
+                           && i < PyTuple_GET_SIZE(fields); i++)
+    {
+        /* Dotted names are left to attrgetter itself. */
+        PyObject *attr = PyTuple_GET_ITEM(fields, i);
+        if (!PyUnicode_CheckExact(attr)
+            || PyUnicode_FindChar(attr, '.', 0, PY_SSIZE_T_MAX, 1) != -1)
+        {
+            PyErr_Clear();
+            fields = NULL;
+        }
+    }
+    Py_XINCREF(fields);
+    Py_XSETREF(mo->fields, fields);
+    mo->fields_are_attrs = (char)attrs;
+    Py_DECREF(reduced);
+}
+
+/* Get one field of item, as the getter would. */
+static inline PyObject *
+get_field(mergeobject *mo, PyObject *item, PyObject *field)
+{
+    if (mo->fields_are_attrs) {
+        return PyObject_GetAttr(item, field);
+    }
+    if (PyTuple_CheckExact(item) && PyLong_CheckExact(field)
+        && LONG_IS_COMPACT(field))
+    {
+        Py_ssize_t i = LONG_COMPACT_VALUE(field);
+        if (i < 0) {
+            i += PyTuple_GET_SIZE(item);
+        }
+        if (0 <= i && i < PyTuple_GET_SIZE(item)) {
+            PyObject *res = PyTuple_GET_ITEM(item, i);
+            Py_INCREF(res);
+            return res;
+        }
+    }
+    return PyObject_GetItem(item, field);
+}
+
+/* The key of item, from mo->fields: the field itself if there is one,
+   or else a new tuple of them, since keys are single objects everywhere
+   else (groupby= hands them out, and pickling stores them). */
+static PyObject *
+fields_key(mergeobject *mo, PyObject *item)
+{
+    PyObject *fields = mo->fields;
+    Py_ssize_t n = PyTuple_GET_SIZE(fields);
+    if (n == 1) {
+        return get_field(mo, item, PyTuple_GET_ITEM(fields, 0));
+    }
+    PyObject *key = PyTuple_New(n);
+    if (key == NULL) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *value = get_field(mo, item, PyTuple_GET_ITEM(fields, i));
+        if (value == NULL) {
+            Py_DECREF(key);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(key, i, value);
+    }
+    return key;
+}
+
+/* The key of item, from keyfunc. */
+static inline PyObject *
+call_keyfunc(mergeobject *mo, PyObject *item)
+{
+    STAT_ADD(mo, key_calls, 1);
+    if (mo->fields != NULL) {
+        return fields_key(mo, item);
+    }
+    return PyObject_CallOneArg(mo->keyfunc, item);
+}
+
+/* Get item number index from its source (and the key from keys_it, if
+   that is not NULL), as new references. Return 1 on success, 0 if it is
+   exhausted, or -1 on error. */
+static int
+next_item(mergeobject *mo, PyObject *it, PyObject *keys_it,
+          Py_ssize_t index, PyObject **pitem, PyObject **pkey)
+{
+    PyObject *keyfunc = needs_keys(mo) ? mo->keyfunc : NULL;
+    PyObject *item, *key;
+    if (keys_it == NULL && shares_keys(mo, it)) {
+        /* Cascaded merges compute each key only once. */
+        int res = take_with_key((mergeobject *)it, &item, &key);
+        if (res <= 0) {
+            return res;
+        }
+        note_key_type(mo, key);
+        *pitem = item;
+        *pkey = key;
+        return 1;
+    }
+    item = source_next(it, index);
+    if (keys_it != NULL) {
+        if (item == NULL && PyErr_Occurred()) {
+            return -1;
+        }
+        key = source_next(keys_it, index);
+        if (key == NULL && PyErr_Occurred()) {
+            Py_XDECREF(item);
+            return -1;
+        }
+        if ((item == NULL) != (key == NULL)) {
+            Py_XDECREF(item);
+            Py_XDECREF(key);
+            PyErr_SetString(PyExc_ValueError,
+                            "an iterable and its keys have different lengths");
+            return -1;
+        }
+        if (item == NULL) {
+            return 0;
+        }
+    }
+    else {
+        if (item == NULL) {
+            if (PyErr_Occurred()) {
+                return -1;
+            }
+            return 0;
+        }
+        if (keyfunc == NULL) {
+            key = item;
+            Py_INCREF(key);
+        }
+        else {
+            key = call_keyfunc(mo, item);
+            if (key == NULL) {
+                Py_DECREF(item);
+                return -1;
+            }
+        }
+    }
+    note_key_type(mo, key);
+    *pitem = item;
+    *pkey = key;
+    return 1;
+}
+
+/* Get a new reference to a source for source_next(). */
+static PyObject *
+open_source(mergeobject *mo, PyObject *iterable)
+{
+    if (PyList_CheckExact(iterable) || PyTuple_CheckExact(iterable)) {
+        Py_INCREF(iterable);
+        return iterable;
+    }
+    PyObject *it = PyObject_GetIter(iterable);
+    if (it == NULL || mo->prefetch == 0 || Py_IS_TYPE(it, Py_TYPE(mo))) {
+        /* A merge is read directly, maybe with its keys. */
+        return it;
+    }
+    Py_SETREF(it, prefetcher_new(mo->module_state, it, mo->prefetch));
+    return it;
+}
+
+/* Count one more open input, if max_open allows it. */
+static int
+count_open(mergeobject *mo)
+{
+    if (mo->max_open >= 0 && mo->nopen >= mo->max_open) {
+        PyErr_Format(PyExc_RuntimeError,
+                     "merge() would need more than %zd open iterables",
+                     mo->max_open);
+        return -1;
+    }
+    mo->nopen++;
+    return 0;
+}
+
+/* Open an iterable (and the iterable of its keys, if not NULL) and get
+   the first item and key. Return 1 on success, 0 if it is empty, or -1
+   on error.
+
+   If bound is not NULL, the input is deferred instead: the iterables
+   themselves are returned in place of sources, the item is NULL, and
+   the key is the bound. */
+static int
+open_input(mergeobject *mo, PyObject *iterable, PyObject *keys_iterable,
+           PyObject *bound, PyObject **pit, PyObject **pkeys_it,
+           PyObject **pitem, PyObject **pkey)
+{
+    if (bound != NULL) {
+        Py_INCREF(iterable);
+        Py_XINCREF(keys_iterable);
+        Py_INCREF(bound);
+        *pit = iterable;
+        *pkeys_it = keys_iterable;
+        *pitem = NULL;
+        *pkey = bound;
+        mo->ndeferred++;
+        return 1;
+    }
+
+    if (count_open(mo) < 0) {
+        return -1;
+    }
+    PyObject *keys_it = NULL;
+    PyObject *it = open_source(mo, iterable);
+    if (it == NULL) {
+        return -1;
+    }
+    if (keys_iterable != NULL) {
+        keys_it = open_source(mo, keys_iterable);
+        if (keys_it == NULL) {
+            Py_DECREF(it);
+            return -1;
+        }
+    }
+    int result = next_item(mo, it, keys_it, 0, pitem, pkey);
+    if (result <= 0) {
+        if (result == 0) {
+            STAT_ADD(mo, exhausted, 1);
+        }
+        mo->nopen--;
+        Py_DECREF(it);
+        Py_XDECREF(keys_it);
+        return result;
+    }
+    *pit = it;
+    *pkeys_it = keys_it;
+    return 1;
+}
+
+/* Borrow iterables[i], and key_iterables[i] and lower_bounds[i] if they
+   were given (otherwise NULL). */
+static void
+get_input(mergeobject *mo, Py_ssize_t i, PyObject **piterable,
+          PyObject **pkeys_iterable, PyObject **pbound)
+{
+    *piterable = PyTuple_GET_ITEM(mo->iterables, i);
+    *pkeys_iterable = NULL;
+    *pbound = NULL;
+    if (mo->key_iterables != NULL) {
+        *pkeys_iterable = PyTuple_GET_ITEM(mo->key_iterables, i);
+    }
+    if (mo->lower_bounds != NULL) {
+        PyObject *bound = PyTuple_GET_ITEM(mo->lower_bounds, i);
+        if (bound != Py_None) {
+            *pbound = bound;
+        }
+    }
+}
+
+static int
+open_iterable(mergeobject *mo, Py_ssize_t i, PyObject **pit,
+              PyObject **pkeys_it, PyObject **pitem, PyObject **pkey)
+{
+    PyObject *iterable, *keys_iterable, *bound;
+    get_input(mo, i, &iterable, &keys_iterable, &bound);
+    return open_input(mo, iterable, keys_iterable, bound,
+                      pit, pkeys_it, pitem, pkey);
+}
+
+/* Replace a deferred input's iterables by sources to read from, now
+   that its lower bound has reached the top of the tree. */
+static int
+open_deferred(mergeobject *mo, PyObject **psrc, PyObject **pkeys_src)
+{
+    if (count_open(mo) < 0) {
+        return -1;
+    }
+    mo->ndeferred--;
+    PyObject *src = open_source(mo, *psrc);
+    if (src == NULL) {
+        return -1;
+    }
+    Py_SETREF(*psrc, src);
+    if (*pkeys_src != NULL) {
+        src = open_source(mo, *pkeys_src);
+        if (src == NULL) {
+            return -1;
+        }
+        Py_SETREF(*pkeys_src, src);
+    }
+    return 0;
+}
+
+static int
+construct_leaf(mergeobject *mo, Py_ssize_t source, PyObject *iterable,
+               PyObject *keys_iterable, PyObject *bound, merge_node **node)
+{
+    PyObject *it, *keys_it, *item, *key;
+    int result = open_input(mo, iterable, keys_iterable, bound,
+                            &it, &keys_it, &item, &key);
+    if (result <= 0) {
+        return result;
+    }
+
+    *node = new_merge_node(mo->module_state);
+    if (*node == NULL) {
+        Py_DECREF(it);
+        Py_XDECREF(keys_it);
+        Py_XDECREF(item);
+        Py_DECREF(key);
+        return -1;
+    }
+
+    (*node)->key = key;
+    (*node)->left = item;
+    (*node)->right = it;
+    (*node)->keys_it = keys_it;
+    (*node)->parent = NULL;
+    (*node)->leaf = (*node);
+    (*node)->source = source;
+    (*node)->ordinal = item == NULL ? -1 : 0;
+    (*node)->nleaves = 1;
+    (*node)->height = 0;
+    return 1;
+}
+
+static merge_node *
+construct_parent(mergeobject *mo, merge_node *left, merge_node *right)
+{
+    assert(left != NULL);
+    assert(right != NULL);
+
+    int cmp;
+    STAT_ADD(mo, comparisons, 1);
+    if (mo->reverse) {
+        cmp = mo->lt(left->key, right->key);
+    }
+    else {
+        cmp = mo->lt(right->key, left->key);
+    }
+    if (cmp < 0) {
+        return NULL;
+    }
+    merge_node *winner = cmp ? right : left;
+    merge_node *parent = new_merge_node(mo->module_state);
+    if (parent == NULL) {
+        return NULL;
+    }
+    parent->key = winner->key;
+    parent->leaf = winner->leaf;
+    parent->left = (PyObject *)left;
+    parent->right = (PyObject *)right;
+    parent->keys_it = NULL;
+    parent->parent = NULL;
+    parent->nleaves = left->nleaves + right->nleaves;
+    parent->height = 1 + Py_MAX(left->height, right->height);
+    Py_INCREF(left);
+    Py_INCREF(right);
+    left->parent = right->parent = parent;
+    return parent;
+}
+
+/* Repeatedly unite pairs of adjacent nodes by adding a common parent,
+   in place, and return the root of the one binary tree that is left.
+   The references in nodes[:n] are used up either way. */
+static merge_node *
+unite_nodes(mergeobject *mo, merge_node **nodes, Py_ssize_t n)
+{
+    assert(n > 0);
+    while (n > 1) {
+        /* If n is odd, nodes[0] is left alone until the next level. */
+        Py_ssize_t i = n & 1, j = n & 1;
+        for (; i < n - 1; (i += 2), (j++)) {
+            merge_node *parent = construct_parent(mo, nodes[i], nodes[i + 1]);
+            if (parent == NULL) {
+                while (j > 0) {
+                    Py_DECREF(nodes[--j]);
+                }
+                while (i < n) {
+                    Py_DECREF(nodes[i++]);
+                }
+                return NULL;
+            }
+            Py_DECREF(nodes[i]);
+            Py_DECREF(nodes[i + 1]);
+            nodes[j] = parent;
+        }
+        assert(j == (n + 1) / 2);
+        n = j;
+    }
+    return nodes[0];
+}
+
+static int
+build_tree(mergeobject *mo)
+{
+    assert(mo->state == 0);
+    assert(PyTuple_CheckExact(mo->iterables));
+
+    Py_ssize_t n0 = PyTuple_GET_SIZE(mo->iterables);
+    /* Strong references to the roots of the subtrees built so far. */
+    Py_ssize_t n = 0;
+    merge_node **nodes = PyMem_New(merge_node *, n0);
+    assert(mo->leaf_of == NULL);
+    mo->leaf_of = PyMem_New(merge_node *, n0);
+    if (nodes == NULL || mo->leaf_of == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    mo->leaf_of_size = mo->nsources = n0;
+    STAT_INPUTS(mo, n0);
+
+    /* first put each nonempty iterator into a leaf. */
+    for (Py_ssize_t i=0; i < n0; i++) {
+        merge_node *leaf = NULL;
+        PyObject *iterable, *keys_iterable, *bound;
+        get_input(mo, i, &iterable, &keys_iterable, &bound);
+        int result = construct_leaf(mo, i, iterable, keys_iterable, bound,
+                                    &leaf);
+        if (result < 0) {
+            goto error;
+        }
+        if (result) {
+            nodes[n++] = leaf;
+        }
+        mo->leaf_of[i] = leaf;
+    }
+    Py_CLEAR(mo->iterables);
+    Py_CLEAR(mo->key_iterables);
+    Py_CLEAR(mo->lower_bounds);
+
+    if (n == 0) {
+        /* All iterators were empty. */
+        goto error;
+    }
+    if (n == 1) {
+        /* Only one node, so don't compute keys. */
+        mo->single = 1;
+    }
+
+    /* Pick a specialized comparison if all keys share an exact type. */
+    PyTypeObject *key_type = Py_TYPE(nodes[0]->key);
+    for (Py_ssize_t i = 1; i < n; i++) {
+        if (Py_TYPE(nodes[i]->key) != key_type) {
+            key_type = NULL;
+            break;
+        }
+    }
+    mo->key_type = key_type;
+    mo->lt = key_type ? lt_for_type(key_type) : safe_object_lt;
+
+    mo->root = unite_nodes(mo, nodes, n);
+    PyMem_Free(nodes);
+    STAT_DEPTH(mo);
+    return mo->root == NULL ? -1 : 0;
+
+error:
+    Py_CLEAR(mo->iterables);
+    Py_CLEAR(mo->key_iterables);
+    Py_CLEAR(mo->lower_bounds);
+    while (n > 0) {
+        Py_DECREF(nodes[--n]);
+    }
+    PyMem_Free(nodes);
+    return -1;
+}
+
+static int
+refill_leaf(mergeobject *mo, merge_node *leaf)
+{
+    assert(leaf->left == NULL);
+    assert(leaf->key == NULL);
+    if (leaf->ordinal < 0
+        && open_deferred(mo, &leaf->right, &leaf->keys_it) < 0)
+    {
+        return -1;
+    }
+    leaf->ordinal++;
+    STAT_REFILL(mo, leaf->source);
+    return next_item(mo, leaf_source(leaf), leaf->keys_it, leaf->ordinal,
+                     &leaf->left, &leaf->key);
+}
+
+/* Recompute the shapes of node and its ancestors. */
+static void
+update_shapes(merge_node *node)
+{
+    for (; node != NULL; node = node->parent) {
+        merge_node *left = left_child(node), *right = right_child(node);
+        node->nleaves = left->nleaves + right->nleaves;
+        node->height = 1 + Py_MAX(left->height, right->height);
+    }
+}
+
+/* Remove leaf from the tree by moving its sibling into their parent,
+   and return the parent. The games above it are not replayed. */
+static merge_node *
+promote_sibling_of(mergeobject *mo, merge_node *leaf)
+{
+    merge_node *parent = leaf->parent;
+    mo->leaf_of[leaf->source] = NULL;
+    if (parent == NULL) {
+        /* End the iteration now. */
+        return NULL;
+    }
+    merge_node *left = left_child(parent);
+    merge_node *right = right_child(parent);
+    merge_node *sibling = (leaf == left) ? right : left;
+
+    parent->key = sibling->key;
+    parent->leaf = sibling->leaf;
+    parent->left = sibling->left;
+    parent->right = sibling->right;
+    parent->nleaves = sibling->nleaves;
+    parent->height = sibling->height;
+
+    if (is_leaf(sibling)) {
+        /* sibling was a leaf, so parent is now a leaf. */
+        parent->leaf = parent;
+        parent->keys_it = sibling->keys_it;
+        parent->source = sibling->source;
+        parent->ordinal = sibling->ordinal;
+        sibling->keys_it = NULL;
+        mo->leaf_of[parent->source] = parent;
+    }
+    else {
+        left_child(sibling)->parent = parent;
+        right_child(sibling)->parent = parent;
+    }
+
+    /* Clear these so we don't decref them; 
+       they were just moved into the parent. */
+    sibling->left = NULL;
+    sibling->right = NULL;
+    sibling->key = NULL;
+    
+    Py_DECREF(leaf);
+    Py_DECREF(sibling);
+
+    update_shapes(parent->parent);
+    assert(is_leaf(parent->leaf));
+    return parent;
+}
+
+/* Rebuild the tree from its leaves once it is this many levels deeper
+   than a balanced tree with the same leaves. */
+#define REBALANCE_SLACK 2
+
+static int
+needs_rebalance(merge_node *root)
+{
+    int balanced = 0;
+    while (((Py_ssize_t)1 << balanced) < root->nleaves) {
+        balanced++;
+    }
+    return root->height > balanced + REBALANCE_SLACK;
+}
+
+/* Replace the tree with a balanced one over the same leaves, in the same
+   order, and play all of its games. */
+static int
+rebalance(mergeobject *mo)
+{
+    assert(!mo->galloping);
+    merge_node *root = mo->root;
+    Py_ssize_t n = root->nleaves;
+    merge_node **nodes = PyMem_New(merge_node *, n);
+    if (nodes == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    /* Visit the leaves from left to right. */
+    merge_node *node = root;
+    for (Py_ssize_t i = 0; i < n; i++) {
+        while (!is_leaf(node)) {
+            node = left_child(node);
+        }
+        Py_INCREF(node);
+        nodes[i] = node;
+        while (node != root && node == right_child(node->parent)) {
+            node = node->parent;
+        }
+        if (node != root) {
+            node = right_child(node->parent);
+        }
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        nodes[i]->parent = NULL;
+    }
+    /* This frees only the internal nodes. */
+    mo->root = NULL;
+    Py_DECREF(root);
+    mo->root = unite_nodes(mo, nodes, n);
+    PyMem_Free(nodes);
+    return mo->root == NULL ? -1 : 0;
+}
+
+/* Remove leaf from the tree and return the node above which the games
+   must be replayed, or NULL without an exception set if leaf was the
+   last one. Since iterables can run out in any order, this rebuilds
+   the tree whenever it gets too deep. */
+static merge_node *
+remove_leaf(mergeobject *mo, merge_node *leaf)
+{
+    merge_node *node = promote_sibling_of(mo, leaf);
+    if (node == NULL) {
+        return NULL;
+    }
+    if (is_leaf(mo->root)) {
+        /* Only one iterator is left, so use values as keys. */
+        mo->single = 1;
+    }
+    else if (needs_rebalance(mo->root)) {
+        if (rebalance(mo) < 0) {
+            return NULL;
+        }
+        node = mo->root;
+    }
+    return node;
+}
+
+/* Find the best key among the siblings of the ancestors of root->leaf.
+   Siblings further up the tree are further from the leaf in order,
+   which decides ties between them. */
+static int
+start_galloping(mergeobject *mo)
+{
+    merge_node *node = mo->root->leaf;
+    PyObject *best = NULL;
+    int best_later = 0;
+    while (node != mo->root) {
+        merge_node *parent = node->parent;
+        int later = (node == left_child(parent));
+        merge_node *sibling = later ? right_child(parent)
+                                    : left_child(parent);
+        int cmp;
+        if (best == NULL) {
+            cmp = 1;
+        }
+        else if (later) {
+            /* sibling comes after every candidate so far. */
+            cmp = key_precedes(mo, sibling->key, best);
+        }
+        else {
+            /* sibling comes before every candidate so far. */
+            cmp = key_precedes(mo, best, sibling->key);
+            cmp = cmp < 0 ? -1 : !cmp;
+        }
+        if (cmp < 0) {
+            return -1;
+        }
+        if (cmp) {
+            best = sibling->key;
+            best_later = later;
+        }
+        node = parent;
+    }
+    mo->runner_up = best;
+    mo->runner_up_later = best_later;
+    mo->galloping = 1;
+    return 0;
+}
+
+/* Play the games on the path from node up to the root, given that the
+   subtree at node is up to date. */
+static int
+replay_path(mergeobject *mo, merge_node *node)
+{
+    merge_node *root = mo->root;
+    lt_func lt = mo->lt;
+
+    #define DO_GAMES(LT, OP1, OP2) do {                          \
+        while (node != root) {                                   \
+            node = node->parent;                                 \
+            merge_node *left = left_child(node);                 \
+            merge_node *right = right_child(node);               \
+            STAT_ADD(mo, comparisons, 1);                        \
+            int cmp = LT(OP1, OP2);                              \
+            if (cmp < 0) {                                       \
+                return -1;                                       \
+            }                                                    \
+            merge_node *winner = cmp ? right : left;             \
+            node->key = winner->key;                             \
+            node->leaf = winner->leaf;                           \
+        }                                                        \
+    } while (0)
+
+    /* One copy of the loop per direction, and per comparison that is
+       cheap enough to be worth inlining. */
+    #define DO_GAMES_WITH(LT) do {                               \
+        if (mo->reverse) {                                       \
+            /* winner = right if left < right else left */       \
+            DO_GAMES(LT, left->key, right->key);                 \
+        }                                                        \
+        else {                                                   \
+            /* winner = right if right < left else left */       \
+            DO_GAMES(LT, right->key, left->key);                 \
+        }                                                        \
+    } while (0)
+
+    if (lt == unsafe_float_lt) {
+        DO_GAMES_WITH(unsafe_float_lt);
+    }
+    else if (lt == unsafe_long_lt) {
+        DO_GAMES_WITH(unsafe_long_lt);
+    }
+    else {
+        DO_GAMES_WITH(lt);
+    }
+
+    #undef DO_GAMES_WITH
+    #undef DO_GAMES
+    return 0;
+}
+
+static int
+replay_games(mergeobject *mo)
+{
+    assert(mo->state == 1);
+    merge_node *root = mo->root;
+    merge_node *node = root->leaf;
+    merge_node *last_winner = node;
+
+    switch (refill_leaf(mo, node)) {
+    case -1:
+        /* error */
+        return -1;
+    case 0:
+        /* iterator empty */
+        last_winner = NULL;
+        mo->nopen--;
+        STAT_ADD(mo, exhausted, 1);
+        stop_galloping(mo);
+        node = remove_leaf(mo, node);
+        if (node == NULL) {
+            return -1;
+        }
+        root = mo->root;
+        break;
+    case 1:
+        /* got a value */
+        if (mo->galloping) {
+            int cmp = gallop_continues(mo, node->key);
+            if (cmp < 0) {
+                return -1;
+            }
+            if (cmp) {
+                return 0;
+            }
+            stop_galloping(mo);
+        }
+        break;
+    }
+
+    if (replay_path(mo, node) < 0) {
+        return -1;
+    }
+
+    if (root->leaf != last_winner) {
+        mo->streak = 0;
+    }
+    else if (++mo->streak >= MIN_GALLOP) {
+        return start_galloping(mo);
+    }
+    return 0;
+}
+
+/* Skipping ahead ***********************************************************/
+
+static inline int
+is_sequence(PyObject *src)
+{
+    return PyList_CheckExact(src) || PyTuple_CheckExact(src);
+}
+
+/* Find the first item of leaf's sequence, after the current one, whose
+   key does not come before target, by galloping and then bisecting, and
+   make it the current one. Return as refill_leaf does. */
+static int
+seek_in_sequence(mergeobject *mo, merge_node *leaf, PyObject *target)
+{
+    PyObject *src = leaf_source(leaf);
+    /* The key at lo comes before target; hi is past it or the end. */
+    Py_ssize_t lo = leaf->ordinal, hi = PY_SSIZE_T_MAX, step = 1;
+    for (;;) {
+        Py_ssize_t mid;
+        if (step > 0) {
+            mid = lo + step;
+        }
+        else if (hi - lo > 1) {
+            mid = lo + (hi - lo) / 2;
+        }
+        else {
+            break;
+        }
+        PyObject *item, *key;
+        int cmp = next_item(mo, src, leaf->keys_it, mid, &item, &key);
+        if (cmp > 0) {
+            cmp = any_key_precedes(mo, key, target);
+            Py_DECREF(item);
+            Py_DECREF(key);
+        }
+        if (cmp < 0) {
+            return -1;
+        }
+        if (cmp) {
+            lo = mid;
+            if (step > 0) {
+                step = step > PY_SSIZE_T_MAX / 4 ? 0 : step * 2;
+            }
+        }
+        else {
+            hi = mid;
+            step = 0;
+        }
+    }
+    Py_CLEAR(leaf->left);
+    Py_CLEAR(leaf->key);
+    leaf->ordinal = hi - 1;
+    return refill_leaf(mo, leaf);
+}
+
+static PyObject *merge_skip_to(mergeobject *mo, PyObject *key);
+
+/* Let an iterator with a seek() method skip ahead to target, if it has
+   one. An inner merge with the same keys is skipped with skip_to().
+   Return 1 if it was called, 0 if there is none, or -1 on error. */
+static int
+call_seek(mergeobject *mo, PyObject *src, PyObject *target)
+{
+    if (is_sequence(src) || is_prefetcher(src)) {
+        return 0;
+    }
+    if (shares_keys(mo, src) && !((mergeobject *)src)->flat) {
+        PyObject *res = merge_skip_to((mergeobject *)src, target);
+        Py_XDECREF(res);
+        return res == NULL ? -1 : 1;
+    }
+    PyObject *seek = PyObject_GetAttrString(src, "seek");
+    if (seek == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError)) {
+            return -1;
+        }
+        PyErr_Clear();
+        return 0;
+    }
+    PyObject *res = PyObject_CallOneArg(seek, target);
+    Py_DECREF(seek);
+    if (res == NULL) {
+        return -1;
+    }
+    Py_DECREF(res);
+    return 1;
+}
+
+/* Drop items from leaf until its key does not come before target. Return
+   1 if it did not need to move, 2 if it moved, 0 if it is exhausted, or
+   -1 on error. */
+static int
+leaf_seek(mergeobject *mo, merge_node *leaf, PyObject *target)
+{
+    int moved = 0, sought = 0;
+    for (;;) {
+        int cmp = any_key_precedes(mo, leaf->key, target);
+        if (cmp <= 0) {
+            return cmp < 0 ? -1 : 1 + moved;
+        }
+        moved = 1;
+        if (leaf->ordinal >= 0 && is_sequence(leaf_source(leaf))
+            && (leaf->keys_it == NULL || is_sequence(leaf->keys_it)))
+        {
+            int res = seek_in_sequence(mo, leaf, target);
+            return res > 0 ? 2 : res;
+        }
+        Py_CLEAR(leaf->left);
+        Py_CLEAR(leaf->key);
+        if (!sought && leaf->ordinal >= 0 && leaf->keys_it == NULL) {
+            /* The item just dropped was read already, so only the
+               iterator's own seek() can skip the rest. */
+            sought = 1;
+            if (call_seek(mo, leaf_source(leaf), target) < 0) {
+                return -1;
+            }
+        }
+        int res = refill_leaf(mo, leaf);
+        if (res <= 0) {
+            return res;
+        }
+    }
+}
+
+/* Mark the games at node (if it is not a leaf) and its ancestors as out
+   of date by clearing their borrowed keys, for replay_subtree. */
+static void
+invalidate_path(merge_node *node)
+{
+    if (is_leaf(node)) {
+        node = node->parent;
+    }
+    for (; node != NULL && node->key != NULL; node = node->parent) {
+        node->key = NULL;
+    }
+}
+
+static void merge_finish(mergeobject *mo);
+
+/* Play the games below node that invalidate_path marked, bottom-up. */
+static int
+replay_subtree(mergeobject *mo, merge_node *node)
+{
+    if (is_leaf(node) || node->key != NULL) {
+        return 0;
+    }
+    merge_node *left = left_child(node), *right = right_child(node);
+    if (replay_subtree(mo, left) < 0 || replay_subtree(mo, right) < 0) {
+        return -1;
+    }
+    int cmp = key_precedes(mo, right->key, left->key);
+    if (cmp < 0) {
+        return -1;
+    }
+    merge_node *winner = cmp ? right : left;
+    node->key = winner->key;
+    node->leaf = winner->leaf;
+    return 0;
+}
+
+/* Starting from state 3, drop every item whose key comes before target,
+   using binary search for inputs that are lists or tuples, and replay
+   the games above the leaves that changed. The merge may end up
+   exhausted (state 2). */
+static int
+skip_to(mergeobject *mo, PyObject *target)
+{
+    assert(mo->state == 3);
+    if (mo->galloping) {
+        /* The games above the galloping leaf are out of date. */
+        invalidate_path(mo->root->leaf);
+        stop_galloping(mo);
+    }
+    /* target may be the key of an item about to be dropped. */
+    Py_INCREF(target);
+    for (Py_ssize_t i = 0; i < mo->nsources; i++) {
+        merge_node *leaf = mo->leaf_of[i];
+        if (leaf == NULL) {
+            continue;
+        }
+        int res = leaf_seek(mo, leaf, target);
+        if (res < 0) {
+            goto error;
+        }
+        if (res == 2) {
+            invalidate_path(leaf);
+        }
+        else if (res == 0) {
+            mo->nopen--;
+            STAT_ADD(mo, exhausted, 1);
+            if (leaf == mo->root) {
+                mo->leaf_of[i] = NULL;
+                Py_CLEAR(mo->root);
+                mo->state = 2;
+                Py_DECREF(target);
+                return 0;
+            }
+            merge_node *node = remove_leaf(mo, leaf);
+            if (node == NULL) {
+                goto error;
+            }
+            invalidate_path(node);
+            /* The remaining leaves still need real keys to seek. */
+            mo->single = 0;
+        }
+    }
+    Py_DECREF(target);
+    if (replay_subtree(mo, mo->root) < 0) {
+        merge_finish(mo);
+        return -1;
+    }
+    if (is_leaf(mo->root)) {
+        mo->single = 1;
+    }
+    return 0;
+
+error:
+    Py_DECREF(target);
+    merge_finish(mo);
+    return -1;
+}
+
+/* flat layout ***************************************************************/
+
+static void
+flat_free_arrays(mergeobject *mo)
+{
+    for (Py_ssize_t i = 0; i < mo->nleaves; i++) {
+        Py_CLEAR(mo->items[i]);
+        Py_CLEAR(mo->keys[i]);
+        Py_CLEAR(mo->iters[i]);
+        Py_CLEAR(mo->keys_iters[i]);
+    }
+    PyMem_Free(mo->items);
+    PyMem_Free(mo->sources);
+    PyMem_Free(mo->losers);
+    mo->items = mo->keys = mo->iters = mo->keys_iters = NULL;
+    mo->sources = mo->ordinals = NULL;
+    mo->losers = NULL;
+    mo->nleaves = mo->nlive = 0;
+}
+
+/* Whether leaf i (with key ki) should be yielded before leaf j (with key
+   kj), or -1 on error. Exhausted leaves have NULL keys and lose every game.
+   The leaf with the lower index wins ties. */
+static inline int
+flat_beats(mergeobject *mo, Py_ssize_t i, PyObject *ki,
+           Py_ssize_t j, PyObject *kj)
+{
+    if (kj == NULL) {
+        return 1;
+    }
+    if (ki == NULL) {
+        return 0;
+    }
+    if (i < j) {
+        int cmp = key_precedes(mo, kj, ki);
+        return cmp < 0 ? -1 : !cmp;
+    }
+    return key_precedes(mo, ki, kj);
+}
+
+static int flat_play_games(mergeobject *mo);
+
+static int
+build_flat(mergeobject *mo)
+{
+    assert(mo->state == 0);
+    assert(PyTuple_CheckExact(mo->iterables));
+
+    Py_ssize_t n0 = PyTuple_GET_SIZE(mo->iterables);
+    STAT_INPUTS(mo, n0);
+    mo->items = PyMem_New(PyObject *, 4 * n0);
+    mo->sources = PyMem_New(Py_ssize_t, 2 * n0);
+    mo->losers = PyMem_New(flat_game, n0);
+    if (mo->items == NULL || mo->sources == NULL || mo->losers == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    mo->keys = mo->items + n0;
+    mo->iters = mo->keys + n0;
+    mo->keys_iters = mo->iters + n0;
+    mo->ordinals = mo->sources + n0;
+
+    /* first put each nonempty iterator into a leaf. */
+    Py_ssize_t k = 0;
+    for (Py_ssize_t i = 0; i < n0; i++) {
+        PyObject *it, *keys_it, *item, *key;
+        int result = open_iterable(mo, i, &it, &keys_it, &item, &key);
+        if (result < 0) {
+            goto error;
+        }
+        if (result == 0) {
+            continue;
+        }
+        mo->items[k] = item;
+        mo->keys[k] = key;
+        mo->iters[k] = it;
+        mo->keys_iters[k] = keys_it;
+        mo->sources[k] = i;
+        mo->ordinals[k] = item == NULL ? -1 : 0;
+        mo->nleaves = ++k;
+    }
+    Py_CLEAR(mo->iterables);
+    Py_CLEAR(mo->key_iterables);
+    Py_CLEAR(mo->lower_bounds);
+    mo->nlive = k;
+
+    if (k == 0) {
+        /* All iterators were empty. */
+        goto error;
+    }
+    if (flat_play_games(mo) < 0) {
+        goto error;
+    }
+    STAT_DEPTH(mo);
+    return 0;
+
+error:
+    Py_CLEAR(mo->iterables);
+    Py_CLEAR(mo->key_iterables);
+    Py_CLEAR(mo->lower_bounds);
+    flat_free_arrays(mo);
+    return -1;
+}
+
+/* Play the initial games of the nleaves > 0 leaves bottom-up, remembering
+   the loser at each internal node and passing the winner up to its
+   parent. */
+static int
+flat_play_games(mergeobject *mo)
+{
+    Py_ssize_t k = mo->nleaves;
+    if (k == 1) {
+        /* Only one leaf, so don't compute keys. */
+        mo->single = 1;
+    }
+
+    /* Pick a specialized comparison if all keys share an exact type. */
+    PyTypeObject *key_type = Py_TYPE(mo->keys[0]);
+    for (Py_ssize_t i = 1; i < k; i++) {
+        if (Py_TYPE(mo->keys[i]) != key_type) {
+            key_type = NULL;
+            break;
+        }
+    }
+    mo->key_type = key_type;
+    mo->lt = key_type ? lt_for_type(key_type) : safe_object_lt;
+
+    flat_game *winners = PyMem_New(flat_game, k);
+    if (winners == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (Py_ssize_t n = k - 1; n > 0; n--) {
+        flat_game a, b;
+        if (2*n < k) {
+            a = winners[2*n];
+        }
+        else {
+            a.leaf = 2*n - k;
+            a.key = mo->keys[a.leaf];
+        }
+        if (2*n + 1 < k) {
+            b = winners[2*n + 1];
+        }
+        else {
+            b.leaf = 2*n + 1 - k;
+            b.key = mo->keys[b.leaf];
+        }
+        int cmp = flat_beats(mo, a.leaf, a.key, b.leaf, b.key);
+        if (cmp < 0) {
+            PyMem_Free(winners);
+            return -1;
+        }
+        winners[n] = cmp ? a : b;
+        mo->losers[n] = cmp ? b : a;
+    }
+    if (k > 1) {
+        mo->losers[0] = winners[1];
+    }
+    else {
+        mo->losers[0].leaf = 0;
+        mo->losers[0].key = mo->keys[0];
+    }
+    PyMem_Free(winners);
+    return 0;
+}
+
+/* The runner-up is the best of the leaves that lost to the winner on its
+   way up, since each of them won everywhere below the game it lost. */
+static int
+flat_start_galloping(mergeobject *mo)
+{
+    Py_ssize_t w = mo->losers[0].leaf;
+    flat_game best = {-1, NULL};
+    for (Py_ssize_t n = (mo->nleaves + w) >> 1; n > 0; n >>= 1) {
+        flat_game *g = &mo->losers[n];
+        int cmp = flat_beats(mo, g->leaf, g->key, best.leaf, best.key);
+        if (cmp < 0) {
+            return -1;
+        }
+        if (cmp) {
+            best = *g;
+        }
+    }
+    mo->runner_up = best.key;
+    mo->runner_up_later = best.leaf > w;
+    mo->galloping = 1;
+    return 0;
+}
+
+static int
+flat_replay(mergeobject *mo)
+{
+    assert(mo->state == 1);
+    Py_ssize_t w = mo->losers[0].leaf;
+    Py_ssize_t last_winner = w;
+    assert(mo->items[w] == NULL && mo->keys[w] == NULL);
+
+    if (mo->ordinals[w] < 0
+        && open_deferred(mo, &mo->iters[w], &mo->keys_iters[w]) < 0)
+    {
+        return -1;
+    }
+    mo->ordinals[w]++;
+    STAT_REFILL(mo, mo->sources[w]);
+    switch (next_item(mo, mo->iters[w], mo->keys_iters[w], mo->ordinals[w],
+                      &mo->items[w], &mo->keys[w])) {
+    case -1:
+        /* error */
+        return -1;
+    case 0:
+        /* iterator empty: keys[w] stays NULL and loses every game. */
+        last_winner = -1;
+        mo->nopen--;
+        STAT_ADD(mo, exhausted, 1);
+        stop_galloping(mo);
+        Py_CLEAR(mo->iters[w]);
+        Py_CLEAR(mo->keys_iters[w]);
+        if (--mo->nlive == 0) {
+            return -1;
+        }
+        if (mo->nlive == 1) {
+            /* Only one iterator is left, so use values as keys. */
+            mo->single = 1;
+        }
+        break;
+    case 1:
+        /* got a value */
+        if (mo->galloping) {
+            int cmp = gallop_continues(mo, mo->keys[w]);
+            if (cmp < 0) {
+                return -1;
+            }
+            if (cmp) {
+                /* Every stored loser still loses to w. */
+                mo->losers[0].key = mo->keys[w];
+                return 0;
+            }
+            stop_galloping(mo);
+        }
+        break;
+    }
+
+    flat_game *losers = mo->losers;
+    PyObject *wkey = mo->keys[w];
+    lt_func lt = mo->lt;
+
+    /* Play one game per level against the loser stored there. When the
+       loser l has the lower index, it wins ties: l beats w unless
+       wkey < lkey. Otherwise, l beats w only if lkey < wkey. */
+    #define DO_GAMES(LT, A, B) do {                              \
+        for (Py_ssize_t n = (mo->nleaves + w) >> 1; n > 0; n >>= 1) { \
+            flat_game *g = &losers[n];                           \
+            PyObject *lkey = g->key;                             \
+            int cmp;                                             \
+            if (lkey == NULL) {                                  \
+                continue;                                        \
+            }                                                    \
+            else if (wkey == NULL) {                             \
+                cmp = 1;                                         \
+            }                                                    \
+            else if (g->leaf < w) {                              \
+                STAT_ADD(mo, comparisons, 1);                    \
+                cmp = LT(A, B);                                  \
+                if (cmp < 0) {                                   \
+                    return -1;                                   \
+                }                                                \
+                cmp = !cmp;                                      \
+            }                                                    \
+            else {                                               \
+                STAT_ADD(mo, comparisons, 1);                    \
+                cmp = LT(B, A);                                  \
+                if (cmp < 0) {                                   \
+                    return -1;                                   \
+                }                                                \
+            }                                                    \
+            if (cmp) {                                           \
+                Py_ssize_t l = g->leaf;                          \
+                g->leaf = w;                                     \
+                g->key = wkey;                                   \
+                w = l;                                           \
+                wkey = lkey;                                     \
+            }                                                    \
+        }                                                        \
+    } while (0)
+
+    /* As in replay_path, one copy per direction and comparison. */
+    #define DO_GAMES_WITH(LT) do {                               \
+        if (mo->reverse) {                                       \
+            DO_GAMES(LT, lkey, wkey);                            \
+        }                                                        \
+        else {                                                   \
+            DO_GAMES(LT, wkey, lkey);                            \
+        }                                                        \
+    } while (0)
+
+    if (lt == unsafe_float_lt) {
+        DO_GAMES_WITH(unsafe_float_lt);
+    }
+    else if (lt == unsafe_long_lt) {
+        DO_GAMES_WITH(unsafe_long_lt);
+    }
+    else {
+        DO_GAMES_WITH(lt);
+    }
+
+    #undef DO_GAMES_WITH
+    #undef DO_GAMES
+    losers[0].leaf = w;
+    losers[0].key = wkey;
+
+    if (w != last_winner) {
+        mo->streak = 0;
+    }
+    else if (++mo->streak >= MIN_GALLOP) {
+        return flat_start_galloping(mo);
+    }
+    return 0;
+}
+
+static inline PyObject *
+flat_pop_item(mergeobject *mo)
+{
+    Py_ssize_t w = mo->losers[0].leaf;
+    PyObject *res = mo->items[w];
+    mo->items[w] = NULL;
+    Py_CLEAR(mo->keys[w]);
+    mo->losers[0].key = NULL;
+    return res;
+}
+
+/* Wrap item as (source, ordinal, item), stealing the reference. */
+static PyObject *
+pack_with_source(PyObject *item, Py_ssize_t source, Py_ssize_t ordinal)
+{
+    PyObject *res = PyTuple_New(3);
+    PyObject *s = PyLong_FromSsize_t(source);
+    PyObject *o = PyLong_FromSsize_t(ordinal);
+    if (res == NULL || s == NULL || o == NULL) {
+        Py_XDECREF(res);
+        Py_XDECREF(s);
+        Py_XDECREF(o);
+        Py_DECREF(item);
+        return NULL;
+    }
+    PyTuple_SET_ITEM(res, 0, s);
+    PyTuple_SET_ITEM(res, 1, o);
+    PyTuple_SET_ITEM(res, 2, item);
+    return res;
+}
+
+/* While the winner is a deferred input, open it and replay its games.
+   Its bound is then replaced by its real first key, which can only be
+   later, so the games are replayed just as after a refill. */
+static int
+open_deferred_winners(mergeobject *mo)
+{
+    while (mo->ndeferred > 0) {
+        if (mo->flat) {
+            Py_ssize_t w = mo->losers[0].leaf;
+            if (mo->items[w] != NULL) {
+                return 0;
+            }
+            Py_CLEAR(mo->keys[w]);
+            mo->losers[0].key = NULL;
+            if (flat_replay(mo) < 0) {
+                return -1;
+            }
+        }
+        else {
+            merge_node *leaf = mo->root->leaf;
+            if (leaf->left != NULL) {
+                return 0;
+            }
+            Py_CLEAR(leaf->key);
+            if (replay_games(mo) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* End the merge for good, releasing the tree and with it the iterators,
+   rather than waiting for the merge object to be freed. */
+static void
+merge_finish(mergeobject *mo)
+{
+    mo->state = 2;
+    Py_CLEAR(mo->root);
+    for (Py_ssize_t i = 0; mo->leaf_of != NULL && i < mo->nsources; i++) {
+        mo->leaf_of[i] = NULL;
+    }
+    Py_CLEAR(mo->iterables);
+    Py_CLEAR(mo->key_iterables);
+    Py_CLEAR(mo->lower_bounds);
+    flat_free_arrays(mo);
+    stop_galloping(mo);
+}
+
+static inline PyObject *winner_key(mergeobject *mo);
+
+/* Whether the key at the root does not come before stop_key, or -1 on
+   error. */
+static int
+reached_stop(mergeobject *mo)
+{
+    if (mo->stop_key == NULL) {
+        return 0;
+    }
+    int cmp = any_key_precedes(mo, winner_key(mo), mo->stop_key);
+    return cmp < 0 ? -1 : !cmp;
+}
+
+/* Bring the next item to the root of the tournament, without taking it,
+   and leave state 3. Return -1 if the merge is exhausted or on error. */
+static int
+merge_ready(mergeobject *mo)
+{
+    int err = 0;
+    switch (mo->state) {
+    case 0:
+        err = mo->flat ? build_flat(mo) : build_tree(mo);
+        mo->state = 1;
+        break;
+    case 1:
+        err = mo->flat ? flat_replay(mo) : replay_games(mo);
+        break;
+    case 2:
+        return -1;
+    case 3:
+        mo->state = 1;
+        break;
+    }
+    if (err < 0
+        /* A deferred input whose bound is past stop_key is never opened. */
+        || (mo->ndeferred > 0 && reached_stop(mo) != 0)
+        || open_deferred_winners(mo) < 0
+        || reached_stop(mo) != 0)
+    {
+        merge_finish(mo);
+        return -1;
+    }
+    mo->state = 3;
+    return 0;
+}
+
+/* The key of the item at the root, after merge_ready(). */
+static inline PyObject *
+winner_key(mergeobject *mo)
+{
+    if (mo->flat) {
+        return mo->keys[mo->losers[0].leaf];
+    }
+    /* Not mo->root->key, which is stale while galloping. */
+    return mo->root->leaf->key;
+}
+
+/* Take the item at the root, after merge_ready(). */
+static PyObject *
+pop_winner(mergeobject *mo)
+{
+    assert(mo->state == 3);
+    mo->state = 1;
+    Py_ssize_t source, ordinal;
+    PyObject *item;
+    if (mo->flat) {
+        Py_ssize_t w = mo->losers[0].leaf;
+        source = mo->sources[w];
+        ordinal = mo->ordinals[w];
+        item = flat_pop_item(mo);
+    }
+    else {
+        merge_node *leaf = mo->root->leaf;
+        source = leaf->source;
+        ordinal = leaf->ordinal;
+        item = leaf_pop_item(leaf);
+    }
+    if (mo->with_source) {
+        return pack_with_source(item, source, ordinal);
+    }
+    return item;
+}
+
+/* Whether key, which does not come before last, is equal to it. Since
+   the keys are produced in order, one comparison decides this. Return
+   -1 on error. */
+static int
+same_key(mergeobject *mo, PyObject *last, PyObject *key)
+{
+    int cmp = any_key_precedes(mo, last, key);
+    return cmp < 0 ? -1 : !cmp;
+}
+
+static PyObject *
+unique_next(mergeobject *mo)
+{
+    for (;;) {
+        if (merge_ready(mo) < 0) {
+            return NULL;
+        }
+        PyObject *key = winner_key(mo);
+        if (mo->last_key != NULL) {
+            int cmp = same_key(mo, mo->last_key, key);
+            if (cmp < 0) {
+                merge_finish(mo);
+                return NULL;
+            }
+            if (cmp) {
+                PyObject *item = pop_winner(mo);
+                if (item == NULL) {
+                    return NULL;
+                }
+                Py_DECREF(item);
+                continue;
+            }
+        }
+        Py_INCREF(key);
+        Py_XSETREF(mo->last_key, key);
+        return pop_winner(mo);
+    }
+}
+
+static PyObject *
+groupby_next(mergeobject *mo)
+{
+    if (merge_ready(mo) < 0) {
+        return NULL;
+    }
+    PyObject *key = winner_key(mo);
+    Py_INCREF(key);
+    PyObject *group = PyList_New(0);
+    if (group == NULL) {
+        goto error;
+    }
+    int cmp;
+    do {
+        PyObject *item = pop_winner(mo);
+        if (item == NULL) {
+            goto error;
+        }
+        int err = PyList_Append(group, item);
+        Py_DECREF(item);
+        if (err < 0) {
+            goto error;
+        }
+        if (merge_ready(mo) < 0) {
+            if (PyErr_Occurred()) {
+                goto error;
+            }
+            break;
+        }
+        cmp = same_key(mo, key, winner_key(mo));
+        if (cmp < 0) {
+            merge_finish(mo);
+            goto error;
+        }
+    } while (cmp);
+    PyObject *res = PyTuple_Pack(2, key, group);
+    Py_DECREF(key);
+    Py_DECREF(group);
+    return res;
+
+error:
+    Py_DECREF(key);
+    Py_XDECREF(group);
+    return NULL;
+}
+
+/* Whether the set operation can still produce anything. */
+static int
+setop_alive(mergeobject *mo)
+{
+    if (mo->mode == MODE_DIFFERENCE) {
+        return mo->nsources > 0 && mo->leaf_of[0] != NULL;
+    }
+    return mo->root->nleaves >= mo->threshold;
+}
+
+/* A key not before which the next key found in enough inputs must be,
+   after a key that was not; borrowed, or NULL if there is none. */
+static PyObject *
+setop_target(mergeobject *mo)
+{
+    if (mo->mode == MODE_DIFFERENCE) {
+        /* Any key before that of the first input is in no output. */
+        return mo->leaf_of[0]->key;
+    }
+    if (mo->mode == MODE_INTERSECT) {
+        /* Every input must reach the largest of their keys. */
+        PyObject *target = NULL;
+        for (Py_ssize_t i = 0; i < mo->nsources; i++) {
+            merge_node *leaf = mo->leaf_of[i];
+            if (leaf == NULL) {
+                continue;
+            }
+            int cmp = target == NULL ? 1
+                      : key_precedes(mo, target, leaf->key);
+            if (cmp < 0) {
+                return NULL;
+            }
+            if (cmp) {
+                target = leaf->key;
+            }
+        }
+        return target;
+    }
+    return NULL;
+}
+
+static PyObject *
+setop_next(mergeobject *mo)
+{
+    PyObject *key, *item;
+    for (;;) {
+        if (merge_ready(mo) < 0) {
+            return NULL;
+        }
+        if (!setop_alive(mo)) {
+            merge_finish(mo);
+            return NULL;
+        }
+        /* Count the inputs with this key. Ties are broken by source, so
+           the items of each input with this key are consecutive. */
+        key = winner_key(mo);
+        Py_INCREF(key);
+        Py_ssize_t first = mo->root->leaf->source, last = first;
+        Py_ssize_t count = 1;
+        item = pop_winner(mo);
+        if (item == NULL) {
+            goto error;
+        }
+        for (;;) {
+            if (merge_ready(mo) < 0) {
+                if (PyErr_Occurred()) {
+                    goto error;
+                }
+                break;
+            }
+            int cmp = same_key(mo, key, winner_key(mo));
+            if (cmp < 0) {
+                merge_finish(mo);
+                goto error;
+            }
+            if (!cmp) {
+                break;
+            }
+            Py_ssize_t source = mo->root->leaf->source;
+            if (source != last) {
+                count++;
+                last = source;
+            }
+            PyObject *dup = pop_winner(mo);
+            if (dup == NULL) {
+                goto error;
+            }
+            Py_DECREF(dup);
+        }
+        int found = (mo->mode == MODE_DIFFERENCE)
+                    ? (first == 0 && count == 1)
+                    : (count >= mo->threshold);
+        Py_DECREF(key);
+        if (found) {
+            return item;
+        }
+        Py_DECREF(item);
+        if (mo->state == 3 && setop_alive(mo)) {
+            PyObject *target = setop_target(mo);
+            if (target == NULL) {
+                if (PyErr_Occurred()) {
+                    merge_finish(mo);
+                    return NULL;
+                }
+            }
+            else if (skip_to(mo, target) < 0) {
+                return NULL;
+            }
+        }
+    }
+
+error:
+    Py_DECREF(key);
+    Py_XDECREF(item);
+    return NULL;
+}
+
+static PyObject *
+merge_produce(mergeobject *mo)
+{
+    switch (mo->mode) {
+    case MODE_UNIQUE:
+        return unique_next(mo);
+    case MODE_GROUPBY:
+        return groupby_next(mo);
+    case MODE_INTERSECT:
+    case MODE_THRESHOLD:
+    case MODE_DIFFERENCE:
+        return setop_next(mo);
+    }
+    if (merge_ready(mo) < 0) {
+        return NULL;
+    }
+    return pop_winner(mo);
+}
+
+/* Count one output against limit=. */
+static inline void
+count_output(mergeobject *mo)
+{
+    if (mo->limit > 0 && --mo->limit == 0) {
+        /* Let go of the iterators now, not at the next call. */
+        merge_finish(mo);
+    }
+}
+
+static PyObject *
+merge_next_lock_held(mergeobject *mo)
+{
+    if (mo->limit == 0) {
+        merge_finish(mo);
+        return NULL;
+    }
+    PyObject *res = merge_produce(mo);
+    if (res != NULL) {
+        count_output(mo);
+    }
+    return res;
+}
+
+/* Get the next item of a merge that shares_keys() with another, along
+   with its key, as new references. Return as next_item() does. */
+static int
+take_with_key(mergeobject *inner, PyObject **pitem, PyObject **pkey)
+{
+    int res = 1;
+    Py_BEGIN_CRITICAL_SECTION(inner);
+    if (inner->limit == 0) {
+        merge_finish(inner);
+        res = 0;
+    }
+    else if (merge_ready(inner) < 0) {
+        res = PyErr_Occurred() ? -1 : 0;
+    }
+    else {
+        *pkey = winner_key(inner);
+        Py_INCREF(*pkey);
+        *pitem = pop_winner(inner);
+        count_output(inner);
+    }
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PyObject *
+merge_next(mergeobject *mo)
+{
+    PyObject *item;
+    Py_BEGIN_CRITICAL_SECTION(mo);
+    item = merge_next_lock_held(mo);
+    Py_END_CRITICAL_SECTION();
+    return item;
+}
+
+static PyObject *
+merge_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *key = NULL;
+    PyObject *keys = NULL;
+    int reverse = 0;
+    int flat = 0;
+    int with_source = 0;
+    Py_ssize_t prefetch = 0;
+    PyObject *lower_bounds = NULL;
+    PyObject *max_open_obj = NULL;
+    Py_ssize_t max_open = -1;
+    int unique = 0;
+    int groupby = 0;
+    PyObject *limit_obj = NULL;
+    Py_ssize_t limit = -1;
+    PyObject *stop_key = NULL;
+
+    if (kwds != NULL) {
+        char *kwlist[] = {"key", "reverse", "flat", "with_source", "keys",
+                          "prefetch", "lower_bounds", "max_open", "unique",
+                          "groupby", "limit", "stop_key", NULL};
+        PyObject *tmpargs = PyTuple_New(0);
+        if (tmpargs == NULL) {
+            return NULL;
+        }
+        if (!PyArg_ParseTupleAndKeywords(tmpargs, kwds, "|OpppOnOOppOO:merge",
+                                         kwlist, &key, &reverse, &flat,
+                                         &with_source, &keys, &prefetch,
+                                         &lower_bounds, &max_open_obj,
+                                         &unique, &groupby, &limit_obj,
+                                         &stop_key)) {
+            Py_DECREF(tmpargs);
+            return NULL;
+        }
+        Py_DECREF(tmpargs);
+    }
+    if (prefetch < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "prefetch must be non-negative");
+        return NULL;
+    }
+    if (unique && groupby) {
+        PyErr_SetString(PyExc_ValueError,
+                        "unique and groupby cannot both be true");
+        return NULL;
+    }
+    if (limit_obj != NULL && limit_obj != Py_None) {
+        limit = PyNumber_AsSsize_t(limit_obj, PyExc_OverflowError);
+        if (limit == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (limit < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "limit must be non-negative");
+            return NULL;
+        }
+    }
+    if (stop_key == Py_None) {
+        stop_key = NULL;
+    }
+    if (max_open_obj != NULL && max_open_obj != Py_None) {
+        max_open = PyNumber_AsSsize_t(max_open_obj, PyExc_OverflowError);
+        if (max_open == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (max_open < 1) {
+            PyErr_SetString(PyExc_ValueError,
+                            "max_open must be at least 1");
+            return NULL;
+        }
+    }
+
+    int state;
+
+    if (key == Py_None) {
+        key = NULL;
+    }
+    if (keys == Py_None) {
+        keys = NULL;
+    }
+    if (keys != NULL) {
+        if (key != NULL) {
+            PyErr_SetString(PyExc_TypeError,
+                            "merge() cannot take both key and keys");
+            return NULL;
+        }
+        keys = PySequence_Tuple(keys);
+        if (keys == NULL) {
+            return NULL;
+        }
+        if (PyTuple_GET_SIZE(keys) != PyTuple_GET_SIZE(args)) {
+            PyErr_Format(PyExc_ValueError,
+                         "merge() got %zd iterables but %zd keys",
+                         PyTuple_GET_SIZE(args), PyTuple_GET_SIZE(keys));
+            Py_DECREF(keys);
+            return NULL;
+        }
+    }
+    if (lower_bounds == Py_None) {
+        lower_bounds = NULL;
+    }
+    if (lower_bounds != NULL) {
+        lower_bounds = PySequence_Tuple(lower_bounds);
+        if (lower_bounds == NULL) {
+            Py_XDECREF(keys);
+            return NULL;
+        }
+        if (PyTuple_GET_SIZE(lower_bounds) != PyTuple_GET_SIZE(args)) {
+            PyErr_Format(PyExc_ValueError,
+                         "merge() got %zd iterables but %zd lower bounds",
+                         PyTuple_GET_SIZE(args),
+                         PyTuple_GET_SIZE(lower_bounds));
+            Py_XDECREF(keys);
+            Py_DECREF(lower_bounds);
+            return NULL;
+        }
+    }
+
+    assert(PyTuple_CheckExact(args));
+    int has_keys = keys != NULL;
+    if (PyTuple_GET_SIZE(args) == 0) {
+        /* Keep key, in case iterables are added later. */
+        state = 2;
+        args = NULL;
+        Py_CLEAR(keys);
+        Py_CLEAR(lower_bounds);
+    }
+    else {
+        state = 0;
+    }
+
+    mergeobject *mo = (mergeobject *)type->tp_alloc(type, 0);
+    if (mo) {
+        Py_XINCREF(args);
+        Py_XINCREF(key);
+        mo->module_state = PyType_GetModuleState(type);
+        mo->root = NULL;
+        mo->iterables = args;
+        mo->key_iterables = keys;
+        mo->keyfunc = key;
+        mo->fields = NULL;
+        read_getter(mo);
+        mo->key_type = NULL;
+        mo->lt = safe_object_lt;
+        mo->prefetch = prefetch;
+        mo->lower_bounds = lower_bounds;
+        mo->ndeferred = 0;
+        mo->nopen = 0;
+        mo->max_open = max_open;
+        mo->last_key = NULL;
+        mo->nleaves = mo->nlive = 0;
+        mo->items = mo->keys = mo->iters = mo->keys_iters = NULL;
+        mo->sources = mo->ordinals = NULL;
+        mo->losers = NULL;
+        mo->streak = 0;
+        mo->runner_up = NULL;
+        mo->runner_up_later = 0;
+        mo->galloping = 0;
+        mo->single = 0;
+        mo->mode = unique ? MODE_UNIQUE : groupby ? MODE_GROUPBY : MODE_ALL;
+        mo->donor = 0;
+        mo->threshold = 0;
+        Py_XINCREF(stop_key);
+        mo->limit = limit;
+        mo->stop_key = stop_key;
+        mo->has_keys = has_keys;
+        mo->leaf_of = NULL;
+        mo->nsources = mo->leaf_of_size = 0;
+        mo->flat = flat;
+        mo->with_source = with_source;
+        mo->reverse = reverse;
+        mo->state = state;
+#ifdef MULTIMERGE_STATS
+        memset(&mo->stats, 0, sizeof(mo->stats));
+#endif
+        return (PyObject *)mo;
+    }
+    Py_XDECREF(keys);
+    Py_XDECREF(lower_bounds);
+    return NULL;
+}
+
+static int
+merge_clear(mergeobject *mo)
+{
+    Py_CLEAR(mo->root);
+    Py_CLEAR(mo->iterables);
+    Py_CLEAR(mo->key_iterables);
+    Py_CLEAR(mo->lower_bounds);
+    Py_CLEAR(mo->keyfunc);
+    Py_CLEAR(mo->fields);
+    Py_CLEAR(mo->last_key);
+    Py_CLEAR(mo->stop_key);
+    flat_free_arrays(mo);
+    PyMem_Free(mo->leaf_of);
+    mo->leaf_of = NULL;
+    mo->nsources = mo->leaf_of_size = 0;
+#ifdef MULTIMERGE_STATS
+    PyMem_Free(mo->stats.refills);
+    mo->stats.refills = NULL;
+    mo->stats.nrefills = 0;
+#endif
+    return 0;
+}
+
+static void
+merge_dealloc(mergeobject *mo)
+{
+    PyObject_GC_UnTrack(mo);
+    merge_clear(mo);
+    Py_TYPE(mo)->tp_free(mo);
+}
+
+static int
+merge_traverse(mergeobject *mo, visitproc visit, void *arg)
+{
+    Py_VISIT(mo->root);
+    Py_VISIT(mo->iterables);
+    Py_VISIT(mo->key_iterables);
+    Py_VISIT(mo->lower_bounds);
+    Py_VISIT(mo->keyfunc);
+    Py_VISIT(mo->fields);
+    Py_VISIT(mo->last_key);
+    Py_VISIT(mo->stop_key);
+    for (Py_ssize_t i = 0; i < mo->nleaves; i++) {
+        Py_VISIT(mo->items[i]);
+        Py_VISIT(mo->keys[i]);
+        Py_VISIT(mo->iters[i]);
+        Py_VISIT(mo->keys_iters[i]);
+    }
+    return 0;
+}
+
+/* How many of the items after the winner that was just popped would win
+   too, found straight from its list or tuple. That is only done while it
+   is galloping, so that the only key to beat is the runner-up, and only
+   if its items are their own keys and nothing else looks at each one.
+   Return up to max of them, setting *psrc (a new reference, since the
+   run may use up limit= and free the tree) and *pstart to where they
+   are and counting them as taken, or return -1 on error. */
+static Py_ssize_t
+winner_run(mergeobject *mo, Py_ssize_t max, PyObject **psrc,
+           Py_ssize_t *pstart)
+{
+    if (mo->state != 1 || !mo->galloping || mo->mode != MODE_ALL
+        || mo->with_source || mo->stop_key != NULL
+        || (mo->keyfunc != NULL
+            && (mo->runner_up != NULL || needs_keys(mo))))
+    {
+        return 0;
+    }
+    PyObject *src, *keys_it;
+    Py_ssize_t *pordinal, source;
+    if (mo->flat) {
+        Py_ssize_t w = mo->losers[0].leaf;
+        src = mo->iters[w];
+        keys_it = mo->keys_iters[w];
+        pordinal = &mo->ordinals[w];
+        source = mo->sources[w];
+    }
+    else {
+        merge_node *leaf = mo->root->leaf;
+        src = leaf_source(leaf);
+        keys_it = leaf->keys_it;
+        pordinal = &leaf->ordinal;
+        source = leaf->source;
+    }
+    if (keys_it != NULL || !is_sequence(src)) {
+        return 0;
+    }
+    if (mo->limit >= 0) {
+        max = Py_MIN(max, mo->limit);
+    }
+    /* The item at lo wins; hi loses or is past the end. */
+    Py_ssize_t lo = *pordinal;
+    Py_ssize_t hi = lo + 1 + Py_MIN(max, Py_SIZE(src) - lo - 1);
+    if (mo->runner_up != NULL) {
+        Py_ssize_t step = 1;
+        for (;;) {
+            Py_ssize_t mid;
+            if (step > 0 && step < hi - lo) {
+                mid = lo + step;
+            }
+            else if (hi - lo > 1) {
+                mid = lo + (hi - lo) / 2;
+            }
+            else {
+                break;
+            }
+            PyObject *item = source_next(src, mid);
+            int cmp = 0;
+            if (item != NULL) {
+                note_key_type(mo, item);
+                cmp = gallop_continues(mo, item);
+                Py_DECREF(item);
+            }
+            else if (PyErr_Occurred()) {
+                return -1;
+            }
+            if (cmp < 0) {
+                return -1;
+            }
+            if (cmp) {
+                lo = mid;
+                step *= 2;
+            }
+            else {
+                hi = mid;
+                step = 0;
+            }
+        }
+    }
+    Py_ssize_t count = hi - *pordinal - 1;
+    if (count == 0) {
+        return 0;
+    }
+    Py_INCREF(src);
+    *psrc = src;
+    *pstart = *pordinal + 1;
+    *pordinal += count;
+    STAT_REFILLS(mo, source, count);
+    if (mo->limit > 0) {
+        mo->limit -= count;
+        if (mo->limit == 0) {
+            merge_finish(mo);
+        }
+    }
+    return count;
+}
+
+/* Copy the run that winner_run() finds to dest, which has room for max
+   items. Return how many, or -1 on error. */
+static Py_ssize_t
+take_run(mergeobject *mo, PyObject **dest, Py_ssize_t max)
+{
+    PyObject *src;
+    Py_ssize_t start;
+    Py_ssize_t count = winner_run(mo, max, &src, &start);
+    if (count <= 0) {
+        return count;
+    }
+    Py_BEGIN_CRITICAL_SECTION(src);
+    /* Another thread may have shrunk the list. */
+    count = Py_MAX(0, Py_MIN(count, Py_SIZE(src) - start));
+    memcpy(dest, PySequence_Fast_ITEMS(src) + start,
+           count * sizeof(PyObject *));
+    Py_END_CRITICAL_SECTION();
+    for (Py_ssize_t i = 0; i < count; i++) {
+        Py_INCREF(dest[i]);
+    }
+    Py_DECREF(src);
+    return count;
+}
+
+/* take(n) starts with room for at most this many items, and doubles it
+   as needed, so that a large n costs nothing if the merge is short. */
+#define TAKE_MIN_ALLOC 1024
+
+/* A list with room for size items, holding the first used items of list,
+   which is freed. NULL on error, with list still freed. */
+static PyObject *
+grow_take_result(PyObject *list, Py_ssize_t used, Py_ssize_t size)
+{
+    PyObject *res = PyList_New(size);
+    if (res != NULL) {
+        memcpy(((PyListObject *)res)->ob_item,
+               ((PyListObject *)list)->ob_item, used * sizeof(PyObject *));
+        Py_SET_SIZE(list, 0);
+    }
+    else {
+        Py_SET_SIZE(list, used);
+    }
+    Py_DECREF(list);
+    return res;
+}
+
+PyDoc_STRVAR(merge_take_doc,
+"take($self, n, /)\n\
+--\n\
+\n\
+Return a list of the next n items, or fewer if the merge runs out.");
+
+static PyObject *
+merge_take(mergeobject *mo, PyObject *arg)
+{
+    Py_ssize_t n = PyNumber_AsSsize_t(arg, PyExc_OverflowError);
+    if (n == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError, "n must be non-negative");
+        return NULL;
+    }
+    Py_ssize_t size = Py_MIN(n, TAKE_MIN_ALLOC);
+    PyObject *result = PyList_New(size);
+    if (result == NULL) {
+        return NULL;
+    }
+    Py_ssize_t i;
+    int err = 0;
+    /* Take all n items at once, so they are consecutive even if other
+       threads are using this merge too. */
+    Py_BEGIN_CRITICAL_SECTION(mo);
+    for (i = 0; i < n; i++) {
+        if (i == size) {
+            size = n - size > size ? 2 * size : n;
+            result = grow_take_result(result, i, size);
+            if (result == NULL) {
+                break;
+            }
+        }
+        PyObject *item = merge_next_lock_held(mo);
+        if (item == NULL) {
+            err = PyErr_Occurred() != NULL;
+            break;
+        }
+        PyList_SET_ITEM(result, i, item);
+        Py_ssize_t run = take_run(
+            mo, ((PyListObject *)result)->ob_item + i + 1, size - i - 1);
+        if (run < 0) {
+            i++;
+            err = 1;
+            break;
+        }
+        i += run;
+    }
+    Py_END_CRITICAL_SECTION();
+    if (result == NULL) {
+        return NULL;
+    }
+    /* The remaining slots are still NULL, so just forget about them. */
+    Py_SET_SIZE(result, i);
+    if (err) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+PyDoc_STRVAR(merge_into_doc,
+"into($self, container, /)\n\
+--\n\
+\n\
+Append all of the remaining items to container, which must be a list\n\
+or have an append() method, such as a collections.deque.");
+
+static PyObject *
+merge_into(mergeobject *mo, PyObject *container)
+{
+    PyObject *append = NULL;
+    int is_list = PyList_CheckExact(container);
+    if (!is_list) {
+        append = PyObject_GetAttrString(container, "append");
+        if (append == NULL) {
+            return NULL;
+        }
+    }
+    for (;;) {
+        PyObject *item, *run = NULL;
+        Py_ssize_t count = 0;
+        Py_BEGIN_CRITICAL_SECTION(mo);
+        item = merge_next_lock_held(mo);
+        if (item != NULL) {
+            /* Take the items that would win next as one slice. */
+            PyObject *src;
+            Py_ssize_t start;
+            count = winner_run(mo, PY_SSIZE_T_MAX, &src, &start);
+            if (count > 0) {
+                run = PySequence_GetSlice(src, start, start + count);
+                Py_DECREF(src);
+            }
+        }
+        Py_END_CRITICAL_SECTION();
+        if (item == NULL) {
+            break;
+        }
+        if (count < 0 || (count > 0 && run == NULL)) {
+            /* The item was popped, but it is dropped along with the
+               error, as take() drops everything it took. */
+            Py_DECREF(item);
+            Py_XDECREF(append);
+            return NULL;
+        }
+        int err;
+        if (is_list) {
+            err = PyList_Append(container, item);
+        }
+        else {
+            PyObject *res = PyObject_CallOneArg(append, item);
+            err = res == NULL ? -1 : 0;
+            Py_XDECREF(res);
+        }
+        Py_DECREF(item);
+        if (err == 0 && run != NULL) {
+            if (is_list) {
+                err = PyList_SetSlice(container, PY_SSIZE_T_MAX,
+                                      PY_SSIZE_T_MAX, run);
+            }
+            else {
+                for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(run);
+                     i++)
+                {
+                    PyObject *res = PyObject_CallOneArg(
+                        append, PySequence_Fast_GET_ITEM(run, i));
+                    if (res == NULL) {
+                        err = -1;
+                        break;
+                    }
+                    Py_DECREF(res);
+                }
+            }
+        }
+        Py_XDECREF(run);
+        if (err < 0) {
+            Py_XDECREF(append);
+            return NULL;
+        }
+    }
+    Py_XDECREF(append);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* Bring a merge of merge_nodes to state 3 (or 2, if it is exhausted),
+   with each leaf holding its next item and every game up to date, so
+   that the shape of the tree can be changed. */
+static int
+settle(mergeobject *mo)
+{
+    assert(!mo->flat);
+    int err = 0;
+    switch (mo->state) {
+    case 0:
+        err = build_tree(mo);
+        break;
+    case 1:
+        err = replay_games(mo);
+        break;
+    }
+    if (err < 0) {
+        merge_finish(mo);
+        return PyErr_Occurred() ? -1 : 0;
+    }
+    if (mo->state == 2) {
+        return 0;
+    }
+    mo->state = 3;
+    if (mo->galloping) {
+        /* The games above the galloping leaf are out of date. */
+        stop_galloping(mo);
+        if (replay_path(mo, mo->root->leaf) < 0) {
+            merge_finish(mo);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* If only one leaf was left, compute the key of its item, in case that
+   was skipped, since keys now matter again. */
+static int
+end_single(mergeobject *mo)
+{
+    if (!mo->single) {
+        return 0;
+    }
+    merge_node *leaf = mo->root->leaf;
+    if (mo->keyfunc != NULL && leaf->left != NULL && !needs_keys(mo)) {
+        PyObject *key = call_keyfunc(mo, leaf->left);
+        if (key == NULL) {
+            return -1;
+        }
+        Py_SETREF(leaf->key, key);
+        note_key_type(mo, key);
+    }
+    mo->single = 0;
+    return 0;
+}
+
+static int
+check_linked(mergeobject *mo, const char *name)
+{
+    if (mo->flat) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s() is not supported with flat=True", name);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+check_dynamic(mergeobject *mo, const char *name)
+{
+    if (check_linked(mo, name) < 0) {
+        return -1;
+    }
+    if (mo->mode >= MODE_INTERSECT) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s() is not supported for set operations", name);
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(merge_add_iterable_doc,
+"add_iterable($self, iterable, /, keys=None, lower_bound=None)\n\
+--\n\
+\n\
+Add another sorted iterable to the merge and return its index, which\n\
+comes after all others for breaking ties. keys and lower_bound are\n\
+as for merge(); keys must be given if and only if merge() got keys.\n\
+Adding to an exhausted merge starts it again.");
+
+static PyObject *
+merge_add_iterable_lock_held(mergeobject *mo, PyObject *iterable,
+                             PyObject *keys, PyObject *bound)
+{
+    if (settle(mo) < 0) {
+        return NULL;
+    }
+    if (mo->nsources == mo->leaf_of_size) {
+        Py_ssize_t size = mo->leaf_of_size * 2 + 4;
+        merge_node **leaf_of = mo->leaf_of;
+        PyMem_Resize(leaf_of, merge_node *, size);
+        if (leaf_of == NULL) {
+            return PyErr_NoMemory();
+        }
+        mo->leaf_of = leaf_of;
+        mo->leaf_of_size = size;
+    }
+    if (mo->state == 2) {
+        /* Start over with an empty tree. */
+        stop_galloping(mo);
+        Py_CLEAR(mo->root);
+        Py_CLEAR(mo->last_key);
+        for (Py_ssize_t i = 0; i < mo->nsources; i++) {
+            mo->leaf_of[i] = NULL;
+        }
+        mo->single = 1;
+    }
+    else if (end_single(mo) < 0) {
+        return NULL;
+    }
+
+    Py_ssize_t source = mo->nsources;
+    merge_node *leaf = NULL;
+    int result = construct_leaf(mo, source, iterable, keys, bound, &leaf);
+    if (result < 0) {
+        return NULL;
+    }
+    mo->nsources++;
+    mo->leaf_of[source] = leaf;
+    if (result == 0) {
+        /* Nothing to add. */
+    }
+    else if (mo->state == 2) {
+        mo->root = leaf;
+        mo->key_type = Py_TYPE(leaf->key);
+        mo->lt = lt_for_type(mo->key_type);
+        mo->state = 3;
+    }
+    else {
+        /* Pair the new leaf with the highest perfect subtree on the right
+           edge, like carrying in a binary counter. This keeps the leaves
+           in order of their sources, and the depth logarithmic. */
+        merge_node *node = mo->root;
+        while (node->nleaves != ((Py_ssize_t)1 << node->height)) {
+            node = right_child(node);
+        }
+        note_key_type(mo, leaf->key);
+        merge_node *up = node->parent;
+        merge_node *parent = construct_parent(mo, node, leaf);
+        Py_DECREF(leaf);
+        if (parent == NULL) {
+            mo->leaf_of[source] = NULL;
+            return NULL;
+        }
+        parent->parent = up;
+        if (up == NULL) {
+            Py_SETREF(mo->root, parent);
+        }
+        else {
+            assert(up->right == (PyObject *)node);
+            Py_SETREF(up->right, (PyObject *)parent);
+            update_shapes(up);
+        }
+        if (replay_path(mo, parent) < 0) {
+            merge_finish(mo);
+            return NULL;
+        }
+    }
+    STAT_DEPTH(mo);
+    return PyLong_FromSsize_t(source);
+}
+
+static PyObject *
+merge_add_iterable(mergeobject *mo, PyObject *args, PyObject *kwds)
+{
+    PyObject *iterable, *keys = NULL, *bound = NULL;
+    char *kwlist[] = {"", "keys", "lower_bound", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO:add_iterable",
+                                     kwlist, &iterable, &keys, &bound)) {
+        return NULL;
+    }
+    if (check_dynamic(mo, "add_iterable") < 0) {
+        return NULL;
+    }
+    if (iterable == (PyObject *)mo) {
+        PyErr_SetString(PyExc_ValueError, "cannot add a merge to itself");
+        return NULL;
+    }
+    if (keys == Py_None) {
+        keys = NULL;
+    }
+    if (bound == Py_None) {
+        bound = NULL;
+    }
+    if ((keys != NULL) != mo->has_keys) {
+        PyErr_SetString(PyExc_TypeError, mo->has_keys
+                        ? "add_iterable() needs keys, since merge() had keys"
+                        : "add_iterable() got keys, but merge() had none");
+        return NULL;
+    }
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(mo);
+    res = merge_add_iterable_lock_held(mo, iterable, keys, bound);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+PyDoc_STRVAR(merge_remove_doc,
+"remove($self, index, /)\n\
+--\n\
+\n\
+Drop the rest of iterables[index] from the merge, where index is as in\n\
+merge(..., with_source=True). Raise ValueError if it is not present.");
+
+static PyObject *
+merge_remove_lock_held(mergeobject *mo, Py_ssize_t source)
+{
+    if (settle(mo) < 0) {
+        return NULL;
+    }
+    if (mo->state == 2 || source < 0 || source >= mo->nsources
+        || mo->leaf_of[source] == NULL)
+    {
+        PyErr_Format(PyExc_ValueError,
+                     "no iterable with index %zd in the merge", source);
+        return NULL;
+    }
+    merge_node *leaf = mo->leaf_of[source];
+    if (leaf->ordinal < 0) {
+        mo->ndeferred--;
+    }
+    else {
+        mo->nopen--;
+    }
+    if (leaf == mo->root) {
+        mo->leaf_of[source] = NULL;
+        Py_CLEAR(mo->root);
+        mo->state = 2;
+        Py_RETURN_NONE;
+    }
+    merge_node *node = remove_leaf(mo, leaf);
+    if (node == NULL || replay_path(mo, node) < 0) {
+        merge_finish(mo);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+merge_remove(mergeobject *mo, PyObject *arg)
+{
+    Py_ssize_t source = PyNumber_AsSsize_t(arg, PyExc_OverflowError);
+    if (source == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (check_dynamic(mo, "remove") < 0) {
+        return NULL;
+    }
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(mo);
+    res = merge_remove_lock_held(mo, source);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+PyDoc_STRVAR(merge_skip_to_doc,
+"skip_to($self, key, /)\n\
+--\n\
+\n\
+Drop every remaining item whose key comes before key, so that the next\n\
+item is the first one whose key does not. Lists and tuples are skipped\n\
+by binary search. Other iterators are advanced with their seek(key)\n\
+method, if they have one, and then one item at a time; after a seek(),\n\
+the positions given by with_source=True count only the items read.");
+
+static PyObject *
+merge_skip_to_lock_held(mergeobject *mo, PyObject *key)
+{
+    if (settle(mo) < 0) {
+        return NULL;
+    }
+    if (mo->state == 2) {
+        Py_RETURN_NONE;
+    }
+    if (end_single(mo) < 0 || skip_to(mo, key) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+merge_skip_to(mergeobject *mo, PyObject *key)
+{
+    if (check_linked(mo, "skip_to") < 0) {
+        return NULL;
+    }
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(mo);
+    res = merge_skip_to_lock_held(mo, key);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+#ifdef MULTIMERGE_STATS
+PyDoc_STRVAR(merge_stats_doc,
+"stats($self, /)\n\
+--\n\
+\n\
+Return a dict of counters kept since the merge was made: comparisons\n\
+of keys, key_calls to the key function, refills (a list of how many\n\
+times each input was read after the tree was built), inputs exhausted,\n\
+and the current and max_depth of the tree.\n\
+\n\
+Only available if multimerge was built with MULTIMERGE_STATS set.");
+
+static PyObject *
+merge_stats_lock_held(mergeobject *mo)
+{
+    merge_stats *st = &mo->stats;
+    Py_ssize_t n = st->nrefills;
+    PyObject *refills = PyList_New(n);
+    if (refills == NULL) {
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *count = PyLong_FromSsize_t(st->refills[i]);
+        if (count == NULL) {
+            Py_DECREF(refills);
+            return NULL;
+        }
+        PyList_SET_ITEM(refills, i, count);
+    }
+    return Py_BuildValue("{s:n,s:n,s:N,s:n,s:i,s:i}",
+                         "comparisons", st->comparisons,
+                         "key_calls", st->key_calls,
+                         "refills", refills,
+                         "exhausted", st->exhausted,
+                         "depth", tree_depth(mo),
+                         "max_depth", st->max_depth);
+}
+
+static PyObject *
+merge_stats_method(mergeobject *mo, PyObject *Py_UNUSED(ignored))
+{
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(mo);
+    res = merge_stats_lock_held(mo);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+#endif
+
+/* pickling *****************************************************************/
+
+/*
+A merge pickles the state of its tournament rather than its games: the
+item and key waiting at each leaf, how far the leaf has read, and its
+source objects, which pickle themselves however they do (a list
+iterator pickles the items it has left, for example). Exact lists and
+tuples read in place are pickled whole, along with the position reached.
+A prefetch buffer is pickled as the list of items in it, followed by the
+iterator it wraps.
+
+Before pickling, the next item is brought to the root, so that every
+leaf holds an item. Restoring builds the tree again from the pickled
+leaves with one game per internal node, without reading any source.
+A merge that has not started yet pickles its inputs instead.
+*/
+
+#define MERGE_STATE_VERSION 1
+
+/* Append (src, buffered) to list, where buffered is None, or the items
+   in src's buffer if src is a prefetcher, and then src is the iterator
+   behind it, or None if that is exhausted. */
+static int
+append_source_state(PyObject *list, PyObject *src)
+{
+    PyObject *buffered = Py_None;
+    Py_INCREF(buffered);
+    if (src == NULL) {
+        src = Py_None;
+    }
+    else if (is_prefetcher(src)) {
+        prefetcher *pf = (prefetcher *)src;
+        Py_SETREF(buffered, PyList_New(pf->len - pf->pos));
+        if (buffered == NULL) {
+            return -1;
+        }
+        for (Py_ssize_t i = pf->pos; i < pf->len; i++) {
+            Py_INCREF(pf->buf[i]);
+            PyList_SET_ITEM(buffered, i - pf->pos, pf->buf[i]);
+        }
+        src = pf->it != NULL ? pf->it : Py_None;
+    }
+    int err = PyList_Append(list, src);
+    if (err == 0) {
+        err = PyList_Append(list, buffered);
+    }
+    Py_DECREF(buffered);
+    return err;
+}
+
+/* Append one tuple describing a leaf to leaves. */
+static int
+append_leaf_state(PyObject *leaves, Py_ssize_t source, Py_ssize_t ordinal,
+                  PyObject *item, PyObject *key, PyObject *src,
+                  PyObject *keys_src)
+{
+    PyObject *list = Py_BuildValue("[nnOO]", source, ordinal,
+                                   item != NULL ? item : Py_None, key);
+    if (list == NULL) {
+        return -1;
+    }
+    PyObject *leaf = NULL;
+    if (append_source_state(list, src) == 0
+        && append_source_state(list, keys_src) == 0)
+    {
+        leaf = PyList_AsTuple(list);
+    }
+    Py_DECREF(list);
+    if (leaf == NULL) {
+        return -1;
+    }
+    int err = PyList_Append(leaves, leaf);
+    Py_DECREF(leaf);
+    return err;
+}
+
+static PyObject *
+merge_leaf_states(mergeobject *mo)
+{
+    PyObject *leaves = PyList_New(0);
+    if (leaves == NULL) {
+        return NULL;
+    }
+    if (mo->state == 3 && mo->flat) {
+        for (Py_ssize_t i = 0; i < mo->nleaves; i++) {
+            if (mo->keys[i] != NULL
+                && append_leaf_state(leaves, mo->sources[i],
+                                     mo->ordinals[i], mo->items[i],
+                                     mo->keys[i], mo->iters[i],
+                                     mo->keys_iters[i]) < 0)
+            {
+                goto error;
+            }
+        }
+    }
+    else if (mo->state == 3) {
+        for (Py_ssize_t i = 0; i < mo->nsources; i++) {
+            merge_node *leaf = mo->leaf_of[i];
+            if (leaf != NULL
+                && append_leaf_state(leaves, leaf->source, leaf->ordinal,
+                                     leaf->left, leaf->key, leaf->right,
+                                     leaf->keys_it) < 0)
+            {
+                goto error;
+            }
+        }
+    }
+    Py_SETREF(leaves, PyList_AsTuple(leaves));
+    return leaves;
+
+error:
+    Py_DECREF(leaves);
+    return NULL;
+}
+
+static PyObject *
+merge_reduce_lock_held(mergeobject *mo)
+{
+    PyObject *inputs, *leaves;
+    if (mo->state == 0) {
+        inputs = Py_BuildValue(
+            "(OOO)", mo->iterables,
+            mo->key_iterables ? mo->key_iterables : Py_None,
+            mo->lower_bounds ? mo->lower_bounds : Py_None);
+        leaves = PyTuple_New(0);
+    }
+    else {
+        if (mo->state == 1 && merge_ready(mo) < 0 && PyErr_Occurred()) {
+            return NULL;
+        }
+        inputs = Py_None;
+        Py_INCREF(inputs);
+        leaves = merge_leaf_states(mo);
+    }
+    if (inputs == NULL || leaves == NULL) {
+        Py_XDECREF(inputs);
+        Py_XDECREF(leaves);
+        return NULL;
+    }
+    return Py_BuildValue(
+        "O()(iOiiiinniinnOOnNN)", Py_TYPE(mo), MERGE_STATE_VERSION,
+        mo->keyfunc ? mo->keyfunc : Py_None, mo->reverse, mo->flat,
+        mo->with_source, mo->has_keys, mo->prefetch, mo->max_open,
+        mo->mode, mo->donor, mo->threshold, mo->limit,
+        mo->stop_key ? mo->stop_key : Py_None,
+        mo->last_key ? mo->last_key : Py_None,
+        mo->nsources, inputs, leaves);
+}
+
+PyDoc_STRVAR(merge_reduce_doc,
+"__reduce__($self, /)\n\
+--\n\
+\n\
+Return state information for pickling. The item that would be produced\n\
+next is read first, if it has not been already.");
+
+static PyObject *
+merge_reduce(mergeobject *mo, PyObject *Py_UNUSED(ignored))
+{
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(mo);
+    res = merge_reduce_lock_held(mo);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+/* A source restored from the (src, buffered) pair of its state. */
+static PyObject *
+restore_source(mergeobject *mo, PyObject *src, PyObject *buffered,
+               int deferred)
+{
+    if (buffered == Py_None) {
+        if (!deferred && src != Py_None && !is_sequence(src)
+            && !PyIter_Check(src))
+        {
+            PyErr_Format(PyExc_TypeError,
+                         "merge state has a non-iterator %.200s source",
+                         Py_TYPE(src)->tp_name);
+            return NULL;
+        }
+        Py_INCREF(src);
+        return src;
+    }
+    if (deferred || !PyList_CheckExact(buffered)
+        || PyList_GET_SIZE(buffered) > mo->prefetch
+        || (src != Py_None && !PyIter_Check(src)))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid merge state");
+        return NULL;
+    }
+    prefetcher *pf = (prefetcher *)prefetcher_new(mo->module_state, src,
+                                                  mo->prefetch);
+    if (pf == NULL) {
+        return NULL;
+    }
+    if (src == Py_None) {
+        Py_CLEAR(pf->it);
+    }
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(buffered); i++) {
+        PyObject *item = PyList_GET_ITEM(buffered, i);
+        Py_INCREF(item);
+        pf->buf[pf->len++] = item;
+    }
+    return (PyObject *)pf;
+}
+
+/* Unpack the state of a leaf into new references. A deferred leaf has
+   no item, and its sources are the iterables not yet opened. */
+static int
+restore_leaf(mergeobject *mo, PyObject *state, Py_ssize_t *psource,
+             Py_ssize_t *pordinal, PyObject **pitem, PyObject **pkey,
+             PyObject **psrc, PyObject **pkeys_src)
+{
+    PyObject *item, *key, *src, *buffered, *keys_src, *keys_buffered;
+    if (!PyTuple_Check(state)
+        || !PyArg_ParseTuple(state, "nnOOOOOO;invalid merge state",
+                             psource, pordinal, &item, &key, &src,
+                             &buffered, &keys_src, &keys_buffered))
+    {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "invalid merge state");
+        }
+        return -1;
+    }
+    int deferred = *pordinal < 0;
+    int no_keys = keys_src == Py_None && keys_buffered == Py_None;
+    if (*pordinal < -1 || (src == Py_None && buffered == Py_None)
+        || no_keys == mo->has_keys)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid merge state");
+        return -1;
+    }
+    *psrc = restore_source(mo, src, buffered, deferred);
+    if (*psrc == NULL) {
+        return -1;
+    }
+    *pkeys_src = NULL;
+    if (mo->has_keys) {
+        *pkeys_src = restore_source(mo, keys_src, keys_buffered, deferred);
+        if (*pkeys_src == NULL) {
+            Py_CLEAR(*psrc);
+            return -1;
+        }
+    }
+    *pitem = deferred ? NULL : item;
+    Py_XINCREF(*pitem);
+    *pkey = key;
+    Py_INCREF(key);
+    return 0;
+}
+
+/* Choose mo->lt for the keys of the restored leaves. */
+static void
+restore_lt(mergeobject *mo, PyObject **keys, Py_ssize_t n)
+{
+    PyTypeObject *key_type = Py_TYPE(keys[0]);
+    for (Py_ssize_t i = 1; i < n; i++) {
+        if (Py_TYPE(keys[i]) != key_type) {
+            key_type = NULL;
+            break;
+        }
+    }
+    mo->key_type = key_type;
+    mo->lt = key_type ? lt_for_type(key_type) : safe_object_lt;
+}
+
+static int
+restore_tree(mergeobject *mo, PyObject *leaves)
+{
+    Py_ssize_t n = PyTuple_GET_SIZE(leaves);
+    merge_node **nodes = PyMem_New(merge_node *, n);
+    PyObject **keys = PyMem_New(PyObject *, n);
+    if (nodes == NULL || keys == NULL) {
+        PyMem_Free(nodes);
+        PyMem_Free(keys);
+        PyErr_NoMemory();
+        return -1;
+    }
+    Py_ssize_t k = 0;
+    for (; k < n; k++) {
+        Py_ssize_t source, ordinal;
+        PyObject *item, *key, *src, *keys_src;
+        if (restore_leaf(mo, PyTuple_GET_ITEM(leaves, k), &source, &ordinal,
+                         &item, &key, &src, &keys_src) < 0)
+        {
+            goto error;
+        }
+        merge_node *leaf = NULL;
+        if (source < 0 || source >= mo->nsources
+            || (k > 0 && source <= nodes[k - 1]->source)
+            || (leaf = new_merge_node(mo->module_state)) == NULL)
+        {
+            if (leaf == NULL && !PyErr_Occurred()) {
+                PyErr_SetString(PyExc_ValueError, "invalid merge state");
+            }
+            Py_XDECREF(item);
+            Py_DECREF(key);
+            Py_DECREF(src);
+            Py_XDECREF(keys_src);
+            goto error;
+        }
+        leaf->key = keys[k] = key;
+        leaf->left = item;
+        leaf->right = src;
+        leaf->keys_it = keys_src;
+        leaf->parent = NULL;
+        leaf->leaf = leaf;
+        leaf->source = source;
+        leaf->ordinal = ordinal;
+        leaf->nleaves = 1;
+        leaf->height = 0;
+        nodes[k] = leaf;
+        mo->leaf_of[source] = leaf;
+        if (ordinal < 0) {
+            mo->ndeferred++;
+        }
+        else {
+            mo->nopen++;
+        }
+    }
+    mo->single = n == 1;
+    restore_lt(mo, keys, n);
+    PyMem_Free(keys);
+    mo->root = unite_nodes(mo, nodes, n);
+    PyMem_Free(nodes);
+    return mo->root == NULL ? -1 : 0;
+
+error:
+    while (k > 0) {
+        merge_node *leaf = nodes[--k];
+        mo->leaf_of[leaf->source] = NULL;
+        Py_DECREF(leaf);
+    }
+    PyMem_Free(nodes);
+    PyMem_Free(keys);
+    return -1;
+}
+
+static int
+restore_flat(mergeobject *mo, PyObject *leaves)
+{
+    Py_ssize_t n = PyTuple_GET_SIZE(leaves);
+    mo->items = PyMem_New(PyObject *, 4 * n);
+    mo->sources = PyMem_New(Py_ssize_t, 2 * n);
+    mo->losers = PyMem_New(flat_game, n);
+    if (mo->items == NULL || mo->sources == NULL || mo->losers == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    mo->keys = mo->items + n;
+    mo->iters = mo->keys + n;
+    mo->keys_iters = mo->iters + n;
+    mo->ordinals = mo->sources + n;
+    for (Py_ssize_t k = 0; k < n; k++) {
+        Py_ssize_t source, ordinal;
+        if (restore_leaf(mo, PyTuple_GET_ITEM(leaves, k), &source, &ordinal,
+                         &mo->items[k], &mo->keys[k], &mo->iters[k],
+                         &mo->keys_iters[k]) < 0)
+        {
+            goto error;
+        }
+        mo->sources[k] = source;
+        mo->ordinals[k] = ordinal;
+        mo->nleaves = mo->nlive = k + 1;
+        if (source < 0 || (k > 0 && source <= mo->sources[k - 1])) {
+            PyErr_SetString(PyExc_ValueError, "invalid merge state");
+            goto error;
+        }
+        if (ordinal < 0) {
+            mo->ndeferred++;
+        }
+        else {
+            mo->nopen++;
+        }
+    }
+    if (flat_play_games(mo) < 0) {
+        goto error;
+    }
+    return 0;
+
+error:
+    flat_free_arrays(mo);
+    return -1;
+}
+
+static PyObject *
+merge_setstate_lock_held(mergeobject *mo, PyObject *state)
+{
+    int version, reverse, flat, with_source, has_keys, mode, donor;
+    Py_ssize_t prefetch, max_open, threshold, limit, nsources;
+    PyObject *keyfunc, *stop_key, *last_key, *inputs, *leaves;
+    if (!PyTuple_Check(state)
+        || !PyArg_ParseTuple(state, "iOppppnnipnnOOnOO;invalid merge state",
+                             &version, &keyfunc, &reverse, &flat,
+                             &with_source, &has_keys, &prefetch, &max_open,
+                             &mode, &donor, &threshold, &limit, &stop_key,
+                             &last_key, &nsources, &inputs, &leaves))
+    {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "merge state must be a tuple");
+        }
+        return NULL;
+    }
+    if (version != MERGE_STATE_VERSION) {
+        PyErr_Format(PyExc_ValueError,
+                     "unsupported merge state version %d", version);
+        return NULL;
+    }
+    if (mo->state != 2 || mo->nsources != 0 || mo->root != NULL
+        || mo->keyfunc != NULL)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "merge state can only be set on a new, empty merge");
+        return NULL;
+    }
+    if (mode < MODE_ALL || mode > MODE_DIFFERENCE || prefetch < 0
+        || (flat && (mode >= MODE_INTERSECT || nsources != 0))
+        || (mode == MODE_THRESHOLD && threshold < 1) || limit < -1
+        || nsources < 0 || !PyTuple_Check(leaves)
+        || (!flat && PyTuple_GET_SIZE(leaves) > nsources)
+        || (inputs != Py_None && (PyTuple_GET_SIZE(leaves) != 0
+                                  || !PyTuple_Check(inputs))))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid merge state");
+        return NULL;
+    }
+    PyObject *iterables = NULL, *key_iterables = NULL, *lower_bounds = NULL;
+    if (inputs != Py_None
+        && !PyArg_ParseTuple(inputs, "O!OO;invalid merge state",
+                             &PyTuple_Type, &iterables, &key_iterables,
+                             &lower_bounds))
+    {
+        return NULL;
+    }
+    /* get_input() reads these with PyTuple_GET_ITEM. */
+    if (iterables != NULL
+        && ((key_iterables != Py_None
+             && (!PyTuple_CheckExact(key_iterables)
+                 || PyTuple_GET_SIZE(key_iterables)
+                    != PyTuple_GET_SIZE(iterables)))
+            || (lower_bounds != Py_None
+                && (!PyTuple_CheckExact(lower_bounds)
+                    || PyTuple_GET_SIZE(lower_bounds)
+                       != PyTuple_GET_SIZE(iterables)))))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid merge state");
+        return NULL;
+    }
+
+    mo->keyfunc = keyfunc != Py_None ? keyfunc : NULL;
+    Py_XINCREF(mo->keyfunc);
+    read_getter(mo);
+    mo->reverse = reverse;
+    mo->flat = flat;
+    mo->with_source = with_source;
+    mo->has_keys = has_keys;
+    mo->prefetch = prefetch;
+    mo->max_open = max_open;
+    mo->mode = mode;
+    mo->donor = donor;
+    mo->threshold = threshold;
+    mo->limit = limit;
+    if (stop_key != Py_None) {
+        Py_INCREF(stop_key);
+        Py_XSETREF(mo->stop_key, stop_key);
+    }
+    if (last_key != Py_None) {
+        Py_INCREF(last_key);
+        Py_XSETREF(mo->last_key, last_key);
+    }
+
+    if (iterables != NULL) {
+        /* Not started yet. */
+        Py_INCREF(iterables);
+        mo->iterables = iterables;
+        if (key_iterables != Py_None) {
+            Py_INCREF(key_iterables);
+            mo->key_iterables = key_iterables;
+        }
+        if (lower_bounds != Py_None) {
+            Py_INCREF(lower_bounds);
+            mo->lower_bounds = lower_bounds;
+        }
+        mo->state = 0;
+        Py_RETURN_NONE;
+    }
+
+    if (!flat) {
+        mo->leaf_of = PyMem_New(merge_node *, Py_MAX(nsources, 1));
+        if (mo->leaf_of == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        for (Py_ssize_t i = 0; i < nsources; i++) {
+            mo->leaf_of[i] = NULL;
+        }
+        mo->leaf_of_size = Py_MAX(nsources, 1);
+    }
+    mo->nsources = nsources;
+    STAT_INPUTS(mo, nsources);
+    if (PyTuple_GET_SIZE(leaves) == 0) {
+        /* Already exhausted. */
+        Py_RETURN_NONE;
+    }
+    if ((flat ? restore_flat(mo, leaves) : restore_tree(mo, leaves)) < 0) {
+        merge_finish(mo);
+        return NULL;
+    }
+    STAT_DEPTH(mo);
+    mo->state = 3;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(merge_setstate_doc,
+"__setstate__($self, state, /)\n\
+--\n\
+\n\
+Restore a merge from state returned by __reduce__(). The merge must be\n\
+new and empty, as made by merge() with no arguments.");
+
+static PyObject *
+merge_setstate(mergeobject *mo, PyObject *state)
+{
+    PyObject *res;
+    Py_BEGIN_CRITICAL_SECTION(mo);
+    res = merge_setstate_lock_held(mo, state);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PyMethodDef merge_methods[] = {
+    {"take", (PyCFunction)merge_take, METH_O, merge_take_doc},
+    {"into", (PyCFunction)merge_into, METH_O, merge_into_doc},
+    {"add_iterable", (PyCFunction)(void(*)(void))merge_add_iterable,
+     METH_VARARGS | METH_KEYWORDS, merge_add_iterable_doc},
+    {"remove", (PyCFunction)merge_remove, METH_O, merge_remove_doc},
+    {"skip_to", (PyCFunction)merge_skip_to, METH_O, merge_skip_to_doc},
+#ifdef MULTIMERGE_STATS
+    {"stats", (PyCFunction)merge_stats_method, METH_NOARGS,
+     merge_stats_doc},
+#endif
+    {"__reduce__", (PyCFunction)merge_reduce, METH_NOARGS,
+     merge_reduce_doc},
+    {"__setstate__", (PyCFunction)merge_setstate, METH_O,
+     merge_setstate_doc},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(merge_doc,
+"merge(*iterables, key=None, reverse=False, flat=False, with_source=False,\n\
+      keys=None, prefetch=0, lower_bounds=None, max_open=None,\n\
+      unique=False, groupby=False, limit=None, stop_key=None)\n\
+--> merge object\n\
+\n\
+Merge multiple sorted inputs into a single sorted output.\n\
+\n\
+Similar to sorted(itertools.chain(*iterables)) but returns a generator,\n\
+does not pull the data into memory all at once, and assumes that each of\n\
+the input streams is already sorted (smallest to largest).\n\
+\n\
+>>> list(merge([1,3,5,7], [0,2,4,8], [5,10,15,20], [], [25]))\n\
+[0, 1, 2, 3, 4, 5, 5, 7, 8, 10, 15, 20, 25]\n\
+\n\
+If *key* is not None, applies a key function to each element to determine\n\
+its sort order.\n\
+\n\
+>>> list(merge(['dog', 'horse'], ['cat', 'fish', 'kangaroo'], key=len))\n\
+['dog', 'cat', 'fish', 'horse', 'kangaroo']\n\
+\n\
+If the keys are already available, *keys* can instead be a sequence of\n\
+iterables, one per input, yielding the key of each item of that input.\n\
+\n\
+>>> list(merge(['dog', 'horse'], ['cat', 'fish'], keys=[[3, 5], [3, 4]]))\n\
+['dog', 'cat', 'fish', 'horse']\n\
+\n\
+If *with_source* is true, yields (index, position, item) triples instead,\n\
+where item was the position-th item of iterables[index].\n\
+\n\
+>>> list(merge('ad', 'bc', with_source=True))\n\
+[(0, 0, 'a'), (1, 0, 'b'), (1, 1, 'c'), (0, 1, 'd')]\n\
+\n\
+If *unique* is true, an item is skipped if its key equals that of the\n\
+item before it, so only the first item with each key is produced. If\n\
+*groupby* is true, yields (key, items) pairs instead, where items is a\n\
+list of all of the items with that key, in order. Keys are only tested\n\
+for equality by whether one comes before the other.\n\
+\n\
+>>> list(merge([1, 2, 2], [2, 3], unique=True))\n\
+[1, 2, 3]\n\
+>>> list(merge(['a', 'bb'], ['c', 'dd', 'eee'], key=len, groupby=True))\n\
+[(1, ['a', 'c']), (2, ['bb', 'dd']), (3, ['eee'])]\n\
+\n\
+If *limit* is given, the merge stops after producing that many outputs.\n\
+If *stop_key* is given, it stops before the first item whose key does\n\
+not come before stop_key. Either way, and whenever the merge runs out,\n\
+the iterators are released right away.\n\
+\n\
+If *flat* is true, the tournament is kept as a tree of losers in flat\n\
+arrays rather than as linked nodes, which is friendlier to the cache\n\
+when merging very many iterables. The output is the same either way.\n\
+\n\
+Exact lists and tuples are read in place. Other iterators are advanced\n\
+one item at a time unless *prefetch* is positive, in which case up to\n\
+that many items are read ahead from each of them at once.\n\
+\n\
+If *lower_bounds* is given, it has one entry per iterable: either None,\n\
+or a key that no key of that iterable comes before. Such an iterable is\n\
+not opened until the merge reaches its bound. If *max_open* is given,\n\
+RuntimeError is raised rather than having more than that many of the\n\
+iterables open at once.\n\
+\n\
+Iterables can be added to and removed from the merge while it runs with\n\
+add_iterable() and remove(), unless *flat* is true.");
+
+static PyType_Slot merge_type_slots[] = {
+    {Py_tp_dealloc, merge_dealloc},
+    {Py_tp_doc, (void *)merge_doc},
+    {Py_tp_traverse, merge_traverse},
+    {Py_tp_clear, merge_clear},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, merge_next},
+    {Py_tp_methods, merge_methods},
+    {Py_tp_new, merge_new},
+    {0, NULL},
+};
+
+static PyType_Spec merge_type_spec = {
+    .name = "multimerge.merge",
+    .basicsize = sizeof(mergeobject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = merge_type_slots,
+};
+
+/* async merging ************************************************************/
+
+/*
+amerge() merges asynchronous iterators with an ordinary merge object,
+whose inputs are slots that each hold at most one item. Before the merge
+reads from a slot, the item is awaited from the matching async iterator.
+Only two kinds of reads happen: building the tree reads every input, and
+afterwards producing an item reads only the input of the last winner
+(mo->root->leaf). So each __anext__() awaits the inputs that the merge
+is about to read, then lets it replay its games in C.
+
+With prefetch=True, each read is started as an asyncio task as soon as
+it is known to be needed: all of them at first, and then the one for the
+last winner right after its item is produced, while the caller uses it.
+*/
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *item;            /* strong; NULL unless awaited and unread */
+    PyObject *pending;         /* strong; the task reading ahead, or NULL */
+    char done;                 /* the async iterator is exhausted */
+} amerge_slot;
+
+static PyObject *
+amerge_slot_next(amerge_slot *slot)
+{
+    PyObject *item = slot->item;
+    if (item != NULL) {
+        slot->item = NULL;
+        return item;
+    }
+    if (!slot->done) {
+        PyErr_SetString(PyExc_SystemError,
+                        "amerge() read an input before awaiting it");
+    }
+    return NULL;
+}
+
+static int
+amerge_slot_clear(amerge_slot *slot)
+{
+    Py_CLEAR(slot->item);
+    Py_CLEAR(slot->pending);
+    return 0;
+}
+
+static int
+amerge_slot_traverse(amerge_slot *slot, visitproc visit, void *arg)
+{
+    Py_VISIT(slot->item);
+    Py_VISIT(slot->pending);
+    Py_VISIT(Py_TYPE(slot));
+    return 0;
+}
+
+static void
+amerge_slot_dealloc(amerge_slot *slot)
+{
+    PyTypeObject *tp = Py_TYPE(slot);
+    PyObject_GC_UnTrack(slot);
+    amerge_slot_clear(slot);
+    tp->tp_free(slot);
+    Py_DECREF(tp);
+}
+
+static PyType_Slot amerge_slot_type_slots[] = {
+    {Py_tp_dealloc, amerge_slot_dealloc},
+    {Py_tp_clear, amerge_slot_clear},
+    {Py_tp_traverse, amerge_slot_traverse},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, amerge_slot_next},
+    {0, NULL},
+};
+
+static PyType_Spec amerge_slot_type_spec = {
+    .name = "multimerge.amerge_slot",
+    .basicsize = sizeof(amerge_slot),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+             | Py_TPFLAGS_DISALLOW_INSTANTIATION
+#endif
+             ,
+    .slots = amerge_slot_type_slots,
+};
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *merge;           /* strong; a merge of the slots, or NULL */
+    PyObject *aiters;          /* strong; a tuple of async iterators */
+    PyObject *slots;           /* strong; a tuple of amerge_slots */
+    PyObject *ensure_future;   /* strong; NULL unless prefetch=True */
+    PyTypeObject *anext_type;  /* strong */
+    char running;              /* an __anext__() is being awaited */
+} amergeobject;
+
+/* What __anext__() returns: an awaitable that is its own iterator. */
+typedef struct {
+    PyObject_HEAD
+    amergeobject *am;          /* strong */
+    PyObject *inner;           /* strong; what is being awaited, or NULL */
+    Py_ssize_t waiting;        /* the slot for the result of inner */
+    char started;
+    char finished;
+} amerge_anext;
+
+/* Start reading the next item of input i as an asyncio task. */
+static int
+amerge_schedule(amergeobject *am, Py_ssize_t i)
+{
+    amerge_slot *slot = (amerge_slot *)PyTuple_GET_ITEM(am->slots, i);
+    PyObject *aiter = PyTuple_GET_ITEM(am->aiters, i);
+    PyObject *aw = Py_TYPE(aiter)->tp_as_async->am_anext(aiter);
+    if (aw == NULL) {
+        return -1;
+    }
+    slot->pending = PyObject_CallOneArg(am->ensure_future, aw);
+    Py_DECREF(aw);
+    return slot->pending == NULL ? -1 : 0;
+}
+
+/* The input the merge reads next, if it needs awaiting, or -1. */
+static Py_ssize_t
+amerge_needed(amergeobject *am)
+{
+    mergeobject *mo = (mergeobject *)am->merge;
+    Py_ssize_t i = -1;
+    Py_BEGIN_CRITICAL_SECTION(mo);
+    if (mo->state == 0) {
+        Py_ssize_t n = PyTuple_GET_SIZE(am->slots);
+        for (Py_ssize_t j = 0; j < n; j++) {
+            amerge_slot *slot =
+                (amerge_slot *)PyTuple_GET_ITEM(am->slots, j);
+            if (slot->item == NULL && !slot->done) {
+                i = j;
+                break;
+            }
+        }
+    }
+    else if (mo->state == 1) {
+        Py_ssize_t j = mo->root->leaf->source;
+        amerge_slot *slot = (amerge_slot *)PyTuple_GET_ITEM(am->slots, j);
+        if (slot->item == NULL && !slot->done) {
+            i = j;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    return i;
+}
+
+/* Drop the merge and cancel any reads in progress, keeping any exception
+   that is already set. */
+static void
+amerge_finish(amergeobject *am)
+{
+    if (am->merge == NULL) {
+        return;
+    }
+    Py_CLEAR(am->merge);
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+    Py_ssize_t n = PyTuple_GET_SIZE(am->slots);
+    for (Py_ssize_t i = 0; i < n; i++) {
+        amerge_slot *slot = (amerge_slot *)PyTuple_GET_ITEM(am->slots, i);
+        if (slot->pending != NULL) {
+            PyObject *res = PyObject_CallMethod(slot->pending, "cancel",
+                                                NULL);
+            if (res == NULL) {
+                PyErr_WriteUnraisable(slot->pending);
+            }
+            Py_XDECREF(res);
+        }
+        amerge_slot_clear(slot);
+        slot->done = 1;
+    }
+    PyErr_Restore(type, value, tb);
+}
+
+/* Get the iterator that awaiting aw delegates to. */
+static PyObject *
+await_iter(PyObject *aw)
+{
+    PyAsyncMethods *am = Py_TYPE(aw)->tp_as_async;
+    if (am == NULL || am->am_await == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "__anext__() returned a non-awaitable %.200s",
+                     Py_TYPE(aw)->tp_name);
+        return NULL;
+    }
+    PyObject *it = am->am_await(aw);
+    if (it != NULL && !PyIter_Check(it)) {
+        PyErr_Format(PyExc_TypeError,
+                     "__await__() returned a non-iterator %.200s",
+                     Py_TYPE(it)->tp_name);
+        Py_CLEAR(it);
+    }
+    return it;
+}
+
+/* Get the value from a StopIteration that is set, or None if no
+   exception is set. */
+static int
+stop_iteration_value(PyObject **pvalue)
+{
+    if (!PyErr_Occurred()) {
+        Py_INCREF(Py_None);
+        *pvalue = Py_None;
+        return 0;
+    }
+    if (!PyErr_ExceptionMatches(PyExc_StopIteration)) {
+        return -1;
+    }
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+    PyErr_NormalizeException(&type, &value, &tb);
+    *pvalue = PyObject_GetAttrString(value, "value");
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(tb);
+    return *pvalue == NULL ? -1 : 0;
+}
+
+/* Send value into the awaitable iterator it. Return 1 if it yielded,
+   0 if it returned, with either result in *pres, or -1 on error. */
+static int
+await_send(PyObject *it, PyObject *value, PyObject **pres)
+{
+#if PY_VERSION_HEX >= 0x030A0000
+    /* Returned values come back without raising StopIteration. */
+    switch (PyIter_Send(it, value, pres)) {
+    case PYGEN_NEXT:
+        return 1;
+    case PYGEN_RETURN:
+        return 0;
+    default:
+        return -1;
+    }
+#else
+    if (value == Py_None) {
+        *pres = Py_TYPE(it)->tp_iternext(it);
+    }
+    else {
+        *pres = PyObject_CallMethod(it, "send", "O", value);
+    }
+    return *pres != NULL ? 1 : stop_iteration_value(pres);
+#endif
+}
+
+static void
+amerge_anext_end(amerge_anext *an)
+{
+    an->finished = 1;
+    an->am->running = 0;
+    Py_CLEAR(an->inner);
+}
+
+/* Keep going until something must be awaited, or the next item of the
+   merge is known. got and res are what the last await_send() into
+   an->inner gave, if it is not NULL. Return 1 to suspend and yield
+   *presult, 0 to return *presult as the result of the __anext__(), or
+   -1 with an exception set, which is StopAsyncIteration at the end. */
+static int
+amerge_anext_run(amerge_anext *an, int got, PyObject *res,
+                 PyObject **presult)
+{
+    amergeobject *am = an->am;
+    for (;;) {
+        if (an->inner != NULL) {
+            if (got > 0) {
+                /* Pass on what the awaitable yielded. */
+                *presult = res;
+                return 1;
+            }
+            Py_CLEAR(an->inner);
+            amerge_slot *slot =
+                (amerge_slot *)PyTuple_GET_ITEM(am->slots, an->waiting);
+            Py_CLEAR(slot->pending);
+            if (got == 0) {
+                slot->item = res;
+            }
+            else if (PyErr_ExceptionMatches(PyExc_StopAsyncIteration)) {
+                PyErr_Clear();
+                slot->done = 1;
+            }
+            else {
+                goto error;
+            }
+        }
+        if (am->merge == NULL) {
+            amerge_anext_end(an);
+            PyErr_SetNone(PyExc_StopAsyncIteration);
+            return -1;
+        }
+        Py_ssize_t i = amerge_needed(am);
+        if (i < 0) {
+            break;
+        }
+        amerge_slot *slot = (amerge_slot *)PyTuple_GET_ITEM(am->slots, i);
+        PyObject *aw;
+        if (am->ensure_future != NULL) {
+            if (((mergeobject *)am->merge)->state == 0) {
+                /* Start all of the first reads at once. */
+                Py_ssize_t n = PyTuple_GET_SIZE(am->slots);
+                for (Py_ssize_t j = i; j < n; j++) {
+                    amerge_slot *s =
+                        (amerge_slot *)PyTuple_GET_ITEM(am->slots, j);
+                    if (s->item == NULL && !s->done && s->pending == NULL
+                        && amerge_schedule(am, j) < 0)
+                    {
+                        goto error;
+                    }
+                }
+            }
+            else if (slot->pending == NULL && amerge_schedule(am, i) < 0) {
+                goto error;
+            }
+            aw = slot->pending;
+            Py_INCREF(aw);
+        }
+        else {
+            PyObject *aiter = PyTuple_GET_ITEM(am->aiters, i);
+            aw = Py_TYPE(aiter)->tp_as_async->am_anext(aiter);
+            if (aw == NULL) {
+                goto error;
+            }
+        }
+        an->inner = await_iter(aw);
+        Py_DECREF(aw);
+        if (an->inner == NULL) {
+            goto error;
+        }
+        an->waiting = i;
+        got = await_send(an->inner, Py_None, &res);
+    }
+
+    /* Every input the merge reads next is ready. */
+    PyObject *merge = am->merge;
+    PyObject *item = Py_TYPE(merge)->tp_iternext(merge);
+    if (item == NULL) {
+        if (PyErr_Occurred()) {
+            goto error;
+        }
+        amerge_finish(am);
+        amerge_anext_end(an);
+        PyErr_SetNone(PyExc_StopAsyncIteration);
+        return -1;
+    }
+    if (am->ensure_future != NULL) {
+        /* Start reading the winner's next item while the caller works. */
+        Py_ssize_t i = amerge_needed(am);
+        if (i >= 0 && amerge_schedule(am, i) < 0) {
+            Py_DECREF(item);
+            goto error;
+        }
+    }
+    amerge_anext_end(an);
+    *presult = item;
+    return 0;
+
+error:
+    amerge_finish(am);
+    amerge_anext_end(an);
+    return -1;
+}
+
+/* Send value into the __anext__(), with results as for amerge_anext_run(). */
+static int
+amerge_anext_send_ex(amerge_anext *an, PyObject *value, PyObject **presult)
+{
+    if (an->finished) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot reuse already awaited __anext__()");
+        return -1;
+    }
+    if (!an->started) {
+        if (value != Py_None) {
+            PyErr_SetString(PyExc_TypeError,
+                            "can't send non-None value to a just-started "
+                            "__anext__()");
+            return -1;
+        }
+        if (an->am->running) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "anext(): amerge is already running");
+            return -1;
+        }
+        an->started = 1;
+        an->am->running = 1;
+        return amerge_anext_run(an, 0, NULL, presult);
+    }
+    PyObject *res;
+    int got = await_send(an->inner, value, &res);
+    return amerge_anext_run(an, got, res, presult);
+}
+
+/* Turn a result of amerge_anext_run() into one for the iterator
+   protocol, raising StopIteration to return a value. */
+static PyObject *
+anext_result(int got, PyObject *result)
+{
+    if (got > 0) {
+        return result;
+    }
+    if (got == 0) {
+        PyObject *stop = PyObject_CallOneArg(PyExc_StopIteration, result);
+        Py_DECREF(result);
+        if (stop != NULL) {
+            PyErr_SetObject(PyExc_StopIteration, stop);
+            Py_DECREF(stop);
+        }
+    }
+    return NULL;
+}
+
+static PyObject *
+amerge_anext_send(amerge_anext *an, PyObject *value)
+{
+    PyObject *result = NULL;
+    int got = amerge_anext_send_ex(an, value, &result);
+    return anext_result(got, result);
+}
+
+#if PY_VERSION_HEX >= 0x030A0000
+static PySendResult
+amerge_anext_am_send(amerge_anext *an, PyObject *value, PyObject **presult)
+{
+    switch (amerge_anext_send_ex(an, value, presult)) {
+    case 1:
+        return PYGEN_NEXT;
+    case 0:
+        return PYGEN_RETURN;
+    default:
+        *presult = NULL;
+        return PYGEN_ERROR;
+    }
+}
+#endif
+
+static PyObject *
+amerge_anext_iternext(amerge_anext *an)
+{
+    return amerge_anext_send(an, Py_None);
+}
+
+/* Raise the exception described by the arguments of throw(). */
+static void
+set_thrown(PyObject *type, PyObject *value)
+{
+    if (PyExceptionInstance_Check(type)) {
+        PyErr_SetObject((PyObject *)Py_TYPE(type), type);
+    }
+    else if (PyExceptionClass_Check(type)) {
+        PyErr_SetObject(type, value ? value : Py_None);
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError,
+                        "exceptions must be classes or instances deriving "
+                        "from BaseException");
+    }
+}
+
+static PyObject *
+amerge_anext_throw(amerge_anext *an, PyObject *args)
+{
+    PyObject *type, *value = NULL, *tb = NULL;
+    if (!PyArg_UnpackTuple(args, "throw", 1, 3, &type, &value, &tb)) {
+        return NULL;
+    }
+    if (an->inner == NULL) {
+        /* Not waiting for anything to be thrown into. */
+        set_thrown(type, value);
+        if (an->started && !an->finished) {
+            amerge_finish(an->am);
+            amerge_anext_end(an);
+        }
+        return NULL;
+    }
+    PyObject *res = NULL;
+    PyObject *throw = PyObject_GetAttrString(an->inner, "throw");
+    if (throw != NULL) {
+        res = PyObject_Call(throw, args, NULL);
+        Py_DECREF(throw);
+    }
+    else if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        PyErr_Clear();
+        set_thrown(type, value);
+    }
+    int got = res != NULL ? 1 : stop_iteration_value(&res);
+    PyObject *result = NULL;
+    got = amerge_anext_run(an, got, res, &result);
+    return anext_result(got, result);
+}
+
+static PyObject *
+amerge_anext_close(amerge_anext *an, PyObject *Py_UNUSED(ignored))
+{
+    if (an->inner != NULL) {
+        /* A read was abandoned, so the merge cannot go on. */
+        PyObject *res = PyObject_CallMethod(an->inner, "close", NULL);
+        if (res == NULL && PyErr_ExceptionMatches(PyExc_AttributeError)) {
+            PyErr_Clear();
+            res = Py_None;
+            Py_INCREF(res);
+        }
+        amerge_finish(an->am);
+        amerge_anext_end(an);
+        if (res == NULL) {
+            return NULL;
+        }
+        Py_DECREF(res);
+    }
+    an->finished = 1;
+    Py_RETURN_NONE;
+}
+
+static int
+amerge_anext_traverse(amerge_anext *an, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(an));
+    Py_VISIT(an->am);
+    Py_VISIT(an->inner);
+    return 0;
+}
+
+static int
+amerge_anext_clear(amerge_anext *an)
+{
+    Py_CLEAR(an->am);
+    Py_CLEAR(an->inner);
+    return 0;
+}
+
+static void
+amerge_anext_dealloc(amerge_anext *an)
+{
+    PyTypeObject *tp = Py_TYPE(an);
+    PyObject_GC_UnTrack(an);
+    if (an->am != NULL && an->started && !an->finished) {
+        /* Abandoned partway: the next __anext__() awaits afresh. */
+        an->am->running = 0;
+    }
+    amerge_anext_clear(an);
+    tp->tp_free(an);
+    Py_DECREF(tp);
+}
+
+static PyMethodDef amerge_anext_methods[] = {
+    {"send", (PyCFunction)amerge_anext_send, METH_O, NULL},
+    {"throw", (PyCFunction)amerge_anext_throw, METH_VARARGS, NULL},
+    {"close", (PyCFunction)amerge_anext_close, METH_NOARGS, NULL},
+    {NULL, NULL}
+};
+
+static PyType_Slot amerge_anext_type_slots[] = {
+    {Py_tp_dealloc, amerge_anext_dealloc},
+    {Py_tp_traverse, amerge_anext_traverse},
+    {Py_tp_clear, amerge_anext_clear},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, amerge_anext_iternext},
+    {Py_tp_methods, amerge_anext_methods},
+    {Py_am_await, PyObject_SelfIter},
+#if PY_VERSION_HEX >= 0x030A0000
+    {Py_am_send, amerge_anext_am_send},
+#endif
+    {0, NULL},
+};
+
+static PyType_Spec amerge_anext_type_spec = {
+    .name = "multimerge.amerge_anext",
+    .basicsize = sizeof(amerge_anext),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+             | Py_TPFLAGS_DISALLOW_INSTANTIATION
+#endif
+             ,
+    .slots = amerge_anext_type_slots,
+};
+
+static PyObject *
+amerge_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *keyfunc = Py_None;
+    int reverse = 0, prefetch = 0;
+    static char *kwlist[] = {"key", "reverse", "prefetch", NULL};
+    PyObject *empty = PyTuple_New(0);
+    if (empty == NULL) {
+        return NULL;
+    }
+    int ok = PyArg_ParseTupleAndKeywords(empty, kwds, "|Opp:amerge", kwlist,
+                                         &keyfunc, &reverse, &prefetch);
+    Py_DECREF(empty);
+    if (!ok) {
+        return NULL;
+    }
+
+    merge_state *state = get_merge_state(PyType_GetModule(type));
+    Py_ssize_t n = PyTuple_GET_SIZE(args);
+    amergeobject *am = (amergeobject *)type->tp_alloc(type, 0);
+    if (am == NULL) {
+        return NULL;
+    }
+    am->anext_type = (PyTypeObject *)state->amerge_anext_type;
+    Py_INCREF(am->anext_type);
+    am->aiters = PyTuple_New(n);
+    am->slots = PyTuple_New(n);
+    if (am->aiters == NULL || am->slots == NULL) {
+        goto error;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *aiterable = PyTuple_GET_ITEM(args, i);
+        PyAsyncMethods *methods = Py_TYPE(aiterable)->tp_as_async;
+        if (methods == NULL || methods->am_aiter == NULL) {
+            PyErr_Format(PyExc_TypeError,
+                         "'%.200s' object is not an async iterable",
+                         Py_TYPE(aiterable)->tp_name);
+            goto error;
+        }
+        PyObject *aiter = methods->am_aiter(aiterable);
+        if (aiter == NULL) {
+            goto error;
+        }
+        PyTuple_SET_ITEM(am->aiters, i, aiter);
+        methods = Py_TYPE(aiter)->tp_as_async;
+        if (methods == NULL || methods->am_anext == NULL) {
+            PyErr_Format(PyExc_TypeError,
+                         "'%.200s' object is not an async iterator",
+                         Py_TYPE(aiter)->tp_name);
+            goto error;
+        }
+        amerge_slot *slot = PyObject_GC_New(
+            amerge_slot, (PyTypeObject *)state->amerge_slot_type);
+        if (slot == NULL) {
+            goto error;
+        }
+        slot->item = slot->pending = NULL;
+        slot->done = 0;
+        PyObject_GC_Track(slot);
+        PyTuple_SET_ITEM(am->slots, i, (PyObject *)slot);
+    }
+    if (prefetch) {
+        PyObject *asyncio = PyImport_ImportModule("asyncio");
+        if (asyncio == NULL) {
+            goto error;
+        }
+        am->ensure_future = PyObject_GetAttrString(asyncio, "ensure_future");
+        Py_DECREF(asyncio);
+        if (am->ensure_future == NULL) {
+            goto error;
+        }
+    }
+    PyObject *merge_kwds = Py_BuildValue("{s:O,s:O}", "key", keyfunc,
+                                         "reverse", reverse ? Py_True
+                                                            : Py_False);
+    if (merge_kwds == NULL) {
+        goto error;
+    }
+    am->merge = PyObject_Call(state->merge_type, am->slots, merge_kwds);
+    Py_DECREF(merge_kwds);
+    if (am->merge == NULL) {
+        goto error;
+    }
+    return (PyObject *)am;
+
+error:
+    Py_DECREF(am);
+    return NULL;
+}
+
+static PyObject *
+amerge_anext_new(amergeobject *am)
+{
+    amerge_anext *an = PyObject_GC_New(amerge_anext, am->anext_type);
+    if (an == NULL) {
+        return NULL;
+    }
+    Py_INCREF(am);
+    an->am = am;
+    an->inner = NULL;
+    an->waiting = -1;
+    an->started = an->finished = 0;
+    PyObject_GC_Track(an);
+    return (PyObject *)an;
+}
+
+static int
+amerge_traverse(amergeobject *am, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(am));
+    Py_VISIT(am->merge);
+    Py_VISIT(am->aiters);
+    Py_VISIT(am->slots);
+    Py_VISIT(am->ensure_future);
+    Py_VISIT(am->anext_type);
+    return 0;
+}
+
+static int
+amerge_clear(amergeobject *am)
+{
+    Py_CLEAR(am->merge);
+    Py_CLEAR(am->aiters);
+    Py_CLEAR(am->slots);
+    Py_CLEAR(am->ensure_future);
+    Py_CLEAR(am->anext_type);
+    return 0;
+}
+
+static void
+amerge_dealloc(amergeobject *am)
+{
+    PyTypeObject *tp = Py_TYPE(am);
+    PyObject_GC_UnTrack(am);
+    if (am->slots != NULL) {
+        amerge_finish(am);
+    }
+    amerge_clear(am);
+    tp->tp_free(am);
+    Py_DECREF(tp);
+}
+
+PyDoc_STRVAR(amerge_doc,
+"amerge(*aiterables, key=None, reverse=False, prefetch=False)\n\
+--\n\
+\n\
+Merge sorted asynchronous iterables into a single sorted asynchronous\n\
+iterator, like merge() does for ordinary iterables.\n\
+\n\
+    async for item in amerge(stream1, stream2, stream3):\n\
+        ...\n\
+\n\
+Each step awaits only the input that the merge reads next, and the\n\
+games of the tournament are played in C as for merge(). The key\n\
+function is an ordinary function, not a coroutine.\n\
+\n\
+If prefetch is true, each read is started as an asyncio task as soon as\n\
+it is known to be needed: every input's first item at once, and then the\n\
+next item of the input just produced from, while the caller uses it.");
+
+static PyType_Slot amerge_type_slots[] = {
+    {Py_tp_dealloc, amerge_dealloc},
+    {Py_tp_doc, (void *)amerge_doc},
+    {Py_tp_traverse, amerge_traverse},
+    {Py_tp_clear, amerge_clear},
+    {Py_am_aiter, PyObject_SelfIter},
+    {Py_am_anext, amerge_anext_new},
+    {Py_tp_new, amerge_new},
+    {0, NULL},
+};
+
+static PyType_Spec amerge_type_spec = {
+    .name = "multimerge.amerge",
+    .basicsize = sizeof(amergeobject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .slots = amerge_type_slots,
+};
+
+/* merging raw buffers ******************************************************/
+
+/*
+merge_arrays() plays the same tournament as merge(flat=True), but on C
+values read straight out of buffers such as array.array or NumPy arrays:
+
+- Each game holds a value and the index of the input it came from.
+  A negative index marks an exhausted input, which loses every game.
+- The input with the lower index wins ties, as in merge().
+- The kernels below are stamped out for each supported element type and
+  for each direction. They touch no Python objects, so they run without
+  holding the GIL.
+
+- With threads=P, the output is cut into P chunks of about equal size.
+  For the chunk starting at output position r, its thread finds how
+  many values of each input come before position r (the "co-ranks"),
+  and likewise for the end of the chunk, then merges those slices of
+  the inputs into that slice of the output. The slices keep their input
+  indices, so ties are broken exactly as in the sequential merge.
+
+- The co-ranks are found by a quickselect over the union of the inputs.
+  Keep an interval [lo[j], hi[j]) of possible co-ranks for each input
+  and pick a random pivot among the values in those intervals. Count
+  the values before it in each input by bisecting within the intervals.
+  If fewer than r values come before it, the pivot and everything
+  before it are in the first r, so each lo[j] rises. Otherwise the
+  pivot and everything after it are not, so each hi[j] falls. Either
+  way, the pivot's side of the candidates is discarded, so this takes
+  O(log(total)) rounds of k bisections on average.
+*/
+
+typedef struct {
+    const char *data;
+    Py_ssize_t len;
+    Py_ssize_t start;          /* position of data[0] in the whole input */
+} raw_input;
+
+/* Merge the inputs into out. If sources is not NULL, also record the
+   input index and position of each value in sources and positions.
+   Return 0, or -1 if out of memory. */
+typedef int (*raw_merge_func)(raw_input *inputs, Py_ssize_t k, char *out,
+                              int64_t *sources, int64_t *positions);
+
+/* Store in split[j] how many values of inputs[j] come before output
+   position r. scratch must have room for 2*k values. */
+typedef void (*raw_split_func)(const raw_input *inputs, Py_ssize_t k,
+                               Py_ssize_t r, Py_ssize_t *split,
+                               Py_ssize_t *scratch);
+
+#define RAW_BEATS(BEFORE, a, b)                                          \
+    ((a).leaf < 0 ? 0 :                                                  \
+     (b).leaf < 0 ? 1 :                                                  \
+     (a).leaf < (b).leaf ? !BEFORE((b).value, (a).value)                 \
+                         : BEFORE((a).value, (b).value))
+
+#define RAW_LEAF(T, g, i) do {                                           \
+        if (inputs[(i)].len > 0) {                                       \
+            (g).leaf = (i);                                              \
+            (g).value = ((const T *)inputs[(i)].data)[0];                \
+        }                                                                \
+        else {                                                           \
+            (g).leaf = -1;                                               \
+        }                                                                \
+    } while (0)
+
+#define DEFINE_RAW_MERGE(NAME, T, BEFORE)                                \
+static int                                                               \
+NAME(raw_input *inputs, Py_ssize_t k, char *out_,                        \
+     int64_t *sources, int64_t *positions)                               \
+{                                                                        \
+    typedef struct { T value; Py_ssize_t leaf; } game;                   \
+    T *out = (T *)out_;                                                  \
+    game *losers = PyMem_RawMalloc(2 * k * sizeof(game));                \
+    Py_ssize_t *pos = PyMem_RawCalloc(k, sizeof(Py_ssize_t));            \
+    if (losers == NULL || pos == NULL) {                                 \
+        PyMem_RawFree(losers);                                           \
+        PyMem_RawFree(pos);                                              \
+        return -1;                                                       \
+    }                                                                    \
+    game *winners = losers + k;                                          \
+    Py_ssize_t total = 0;                                                \
+    for (Py_ssize_t i = 0; i < k; i++) {                                 \
+        total += inputs[i].len;                                          \
+    }                                                                    \
+    for (Py_ssize_t n = k - 1; n > 0; n--) {                             \
+        game a, b;                                                       \
+        if (2*n < k) {                                                   \
+            a = winners[2*n];                                            \
+        }                                                                \
+        else {                                                           \
+            RAW_LEAF(T, a, 2*n - k);                                     \
+        }                                                                \
+        if (2*n + 1 < k) {                                               \
+            b = winners[2*n + 1];                                        \
+        }                                                                \
+        else {                                                           \
+            RAW_LEAF(T, b, 2*n + 1 - k);                                 \
+        }                                                                \
+        int a_wins = RAW_BEATS(BEFORE, a, b);                            \
+        winners[n] = a_wins ? a : b;                                     \
+        losers[n] = a_wins ? b : a;                                      \
+    }                                                                    \
+    game top;                                                            \
+    if (k > 1) {                                                         \
+        top = winners[1];                                                \
+    }                                                                    \
+    else {                                                               \
+        RAW_LEAF(T, top, 0);                                             \
+    }                                                                    \
+    for (Py_ssize_t j = 0; j < total; j++) {                             \
+        Py_ssize_t w = top.leaf;                                         \
+        assert(w >= 0);                                                  \
+        out[j] = top.value;                                              \
+        if (sources != NULL) {                                           \
+            sources[j] = w;                                              \
+            positions[j] = inputs[w].start + pos[w];                     \
+        }                                                                \
+        if (++pos[w] < inputs[w].len) {                                  \
+            top.value = ((const T *)inputs[w].data)[pos[w]];             \
+        }                                                                \
+        else {                                                           \
+            top.leaf = -1;                                               \
+        }                                                                \
+        for (Py_ssize_t n = (k + w) >> 1; n > 0; n >>= 1) {              \
+            if (RAW_BEATS(BEFORE, losers[n], top)) {                     \
+                game tmp = losers[n];                                    \
+                losers[n] = top;                                         \
+                top = tmp;                                               \
+            }                                                            \
+        }                                                                \
+    }                                                                    \
+    PyMem_RawFree(losers);                                               \
+    PyMem_RawFree(pos);                                                  \
+    return 0;                                                            \
+}
+
+#define DEFINE_RAW_SPLIT(NAME, T, BEFORE)                                \
+static void                                                              \
+NAME(const raw_input *inputs, Py_ssize_t k, Py_ssize_t r,                \
+     Py_ssize_t *lo, Py_ssize_t *scratch)                                \
+{                                                                        \
+    Py_ssize_t *hi = scratch, *c = scratch + k;                          \
+    Py_ssize_t width = 0;                                                \
+    for (Py_ssize_t j = 0; j < k; j++) {                                 \
+        lo[j] = 0;                                                       \
+        hi[j] = inputs[j].len;                                           \
+        width += hi[j];                                                  \
+    }                                                                    \
+    uint64_t seed = (uint64_t)r * 0x9E3779B97F4A7C15u + 1;               \
+    while (width > 0) {                                                  \
+        /* xorshift64 */                                                 \
+        seed ^= seed << 13;                                              \
+        seed ^= seed >> 7;                                               \
+        seed ^= seed << 17;                                              \
+        Py_ssize_t u = (Py_ssize_t)(seed % (uint64_t)width);             \
+        Py_ssize_t i = 0;                                                \
+        while (u >= hi[i] - lo[i]) {                                     \
+            u -= hi[i] - lo[i];                                          \
+            i++;                                                         \
+        }                                                                \
+        Py_ssize_t m = lo[i] + u;                                        \
+        const T x = ((const T *)inputs[i].data)[m];                      \
+        Py_ssize_t rank = m;                                             \
+        for (Py_ssize_t j = 0; j < k; j++) {                             \
+            if (j == i) {                                                \
+                continue;                                                \
+            }                                                            \
+            /* Equal values in earlier inputs come first. */             \
+            const T *v = (const T *)inputs[j].data;                      \
+            Py_ssize_t a = lo[j], b = hi[j];                             \
+            while (a < b) {                                              \
+                Py_ssize_t mid = a + (b - a) / 2;                        \
+                if (j < i ? !BEFORE(x, v[mid]) : BEFORE(v[mid], x)) {    \
+                    a = mid + 1;                                         \
+                }                                                        \
+                else {                                                   \
+                    b = mid;                                             \
+                }                                                        \
+            }                                                            \
+            c[j] = a;                                                    \
+            rank += a;                                                   \
+        }                                                                \
+        if (rank < r) {                                                  \
+            c[i] = m + 1;                                                \
+            for (Py_ssize_t j = 0; j < k; j++) {                         \
+                width -= c[j] - lo[j];                                   \
+                lo[j] = c[j];                                            \
+            }                                                            \
+        }                                                                \
+        else {                                                           \
+            c[i] = m;                                                    \
+            for (Py_ssize_t j = 0; j < k; j++) {                         \
+                width -= hi[j] - c[j];                                   \
+                hi[j] = c[j];                                            \
+            }                                                            \
+        }                                                                \
+    }                                                                    \
+}
+
+#define RAW_LT(a, b) ((a) < (b))
+#define RAW_GT(a, b) ((b) < (a))
+
+#define DEFINE_RAW_MERGES(SUFFIX, T)                                     \
+    DEFINE_RAW_MERGE(raw_merge_##SUFFIX, T, RAW_LT)                     \
+    DEFINE_RAW_MERGE(raw_merge_##SUFFIX##_reverse, T, RAW_GT)           \
+    DEFINE_RAW_SPLIT(raw_split_##SUFFIX, T, RAW_LT)                     \
+    DEFINE_RAW_SPLIT(raw_split_##SUFFIX##_reverse, T, RAW_GT)
+
+DEFINE_RAW_MERGES(i8, int8_t)
+DEFINE_RAW_MERGES(i16, int16_t)
+DEFINE_RAW_MERGES(i32, int32_t)
+DEFINE_RAW_MERGES(i64, int64_t)
+DEFINE_RAW_MERGES(u8, uint8_t)
+DEFINE_RAW_MERGES(u16, uint16_t)
+DEFINE_RAW_MERGES(u32, uint32_t)
+DEFINE_RAW_MERGES(u64, uint64_t)
+DEFINE_RAW_MERGES(f32, float)
+DEFINE_RAW_MERGES(f64, double)
+
+#undef DEFINE_RAW_MERGES
+#undef DEFINE_RAW_SPLIT
+#undef DEFINE_RAW_MERGE
+#undef RAW_LEAF
+
+typedef struct {
+    char kind;                 /* 'i', 'u' or 'f' */
+    Py_ssize_t itemsize;
+    raw_merge_func merge;
+    raw_merge_func merge_reverse;
+    raw_split_func split;
+    raw_split_func split_reverse;
+} raw_type;
+
+#define RAW_TYPE(KIND, T, SUFFIX)                                        \
+    {KIND, sizeof(T), raw_merge_##SUFFIX, raw_merge_##SUFFIX##_reverse,  \
+     raw_split_##SUFFIX, raw_split_##SUFFIX##_reverse}
+
+static const raw_type raw_types[] = {
+    RAW_TYPE('i', int8_t, i8),
+    RAW_TYPE('i', int16_t, i16),
+    RAW_TYPE('i', int32_t, i32),
+    RAW_TYPE('i', int64_t, i64),
+    RAW_TYPE('u', uint8_t, u8),
+    RAW_TYPE('u', uint16_t, u16),
+    RAW_TYPE('u', uint32_t, u32),
+    RAW_TYPE('u', uint64_t, u64),
+    RAW_TYPE('f', float, f32),
+    RAW_TYPE('f', double, f64),
+};
+
+#undef RAW_TYPE
+
+#define RAW_INT64 (&raw_types[3])
+
+static const raw_type *
+raw_type_of(Py_buffer *view)
+{
+    const char *fmt = view->format ? view->format : "B";
+    switch (*fmt) {
+    case '@':
+    case '=':
+        fmt++;
+        break;
+    case '<':
+        if (!PY_LITTLE_ENDIAN) {
+            goto unsupported;
+        }
+        fmt++;
+        break;
+    case '>':
+    case '!':
+        if (PY_LITTLE_ENDIAN) {
+            goto unsupported;
+        }
+        fmt++;
+        break;
+    }
+    char kind;
+    if (fmt[0] == '\0' || fmt[1] != '\0') {
+        goto unsupported;
+    }
+    else if (strchr("bhilqn", fmt[0])) {
+        kind = 'i';
+    }
+    else if (strchr("BHILQN", fmt[0])) {
+        kind = 'u';
+    }
+    else if (strchr("fd", fmt[0])) {
+        kind = 'f';
+    }
+    else {
+        goto unsupported;
+    }
+    for (size_t i = 0; i < Py_ARRAY_LENGTH(raw_types); i++) {
+        if (raw_types[i].kind == kind
+            && raw_types[i].itemsize == view->itemsize)
+        {
+            return &raw_types[i];
+        }
+    }
+unsupported:
+    PyErr_Format(PyExc_TypeError,
+                 "unsupported buffer format '%s'",
+                 view->format ? view->format : "B");
+    return NULL;
+}
+
+/* A new array.array of n zeros with element type tp, using the typecode
+   of the buffer format fmt if it has one. */
+static PyObject *
+new_raw_array(const raw_type *tp, const char *fmt, Py_ssize_t n)
+{
+    static const struct {
+        char code;
+        char kind;
+        Py_ssize_t itemsize;
+    } codes[] = {
+        {'b', 'i', sizeof(signed char)},
+        {'h', 'i', sizeof(short)},
+        {'i', 'i', sizeof(int)},
+        {'l', 'i', sizeof(long)},
+        {'q', 'i', sizeof(long long)},
+        {'B', 'u', sizeof(unsigned char)},
+        {'H', 'u', sizeof(unsigned short)},
+        {'I', 'u', sizeof(unsigned int)},
+        {'L', 'u', sizeof(unsigned long)},
+        {'Q', 'u', sizeof(unsigned long long)},
+        {'f', 'f', sizeof(float)},
+        {'d', 'f', sizeof(double)},
+    };
+    if (fmt != NULL && *fmt == '@') {
+        fmt++;
+    }
+    int code = 0;
+    for (size_t i = 0; i < Py_ARRAY_LENGTH(codes); i++) {
+        if (codes[i].kind == tp->kind && codes[i].itemsize == tp->itemsize) {
+            if (fmt != NULL && fmt[0] == codes[i].code && fmt[1] == '\0') {
+                code = fmt[0];
+                break;
+            }
+            if (code == 0) {
+                code = codes[i].code;
+            }
+        }
+    }
+    if (code == 0) {
+        PyErr_SetString(PyExc_TypeError,
+                        "no array.array typecode for this buffer format");
+        return NULL;
+    }
+    PyObject *array_module = PyImport_ImportModule("array");
+    if (array_module == NULL) {
+        return NULL;
+    }
+    PyObject *one = PyObject_CallMethod(array_module, "array", "C(i)",
+                                        code, 0);
+    Py_DECREF(array_module);
+    if (one == NULL) {
+        return NULL;
+    }
+    PyObject *res = PySequence_Repeat(one, n);
+    Py_DECREF(one);
+    return res;
+}
+
+static int
+get_raw_buffer(PyObject *obj, Py_buffer *view, int flags)
+{
+    if (PyObject_GetBuffer(obj, view, flags | PyBUF_FORMAT
+                                      | PyBUF_C_CONTIGUOUS) < 0) {
+        return -1;
+    }
+    if (view->ndim != 1) {
+        PyErr_Format(PyExc_ValueError,
+                     "expected a 1-dimensional buffer, got %d dimensions",
+                     view->ndim);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+buffers_overlap(Py_buffer *a, Py_buffer *b)
+{
+    const char *a0 = a->buf, *b0 = b->buf;
+    return a->len > 0 && b->len > 0 && a0 < b0 + b->len && b0 < a0 + a->len;
+}
+
+/* Don't start a thread for fewer values than this. */
+#define RAW_MIN_CHUNK 16384
+
+/* One thread's share of a parallel merge_arrays(). */
+typedef struct {
+    raw_merge_func merge;
+    raw_split_func split;
+    const raw_input *inputs;
+    Py_ssize_t k;
+    Py_ssize_t itemsize;
+    Py_ssize_t start;          /* the output positions of this chunk */
+    Py_ssize_t stop;
+    char *out;
+    int64_t *sources;
+    int64_t *positions;
+    PyThread_type_lock done;   /* held until the chunk is merged */
+    int err;
+} raw_chunk;
+
+static int
+raw_merge_chunk(raw_chunk *c)
+{
+    Py_ssize_t k = c->k;
+    Py_ssize_t *split = PyMem_RawMalloc(4 * k * sizeof(Py_ssize_t));
+    raw_input *slices = PyMem_RawMalloc(k * sizeof(raw_input));
+    if (split == NULL || slices == NULL) {
+        PyMem_RawFree(split);
+        PyMem_RawFree(slices);
+        return -1;
+    }
+    Py_ssize_t *begin = split, *end = split + k, *scratch = split + 2*k;
+    c->split(c->inputs, k, c->start, begin, scratch);
+    c->split(c->inputs, k, c->stop, end, scratch);
+    for (Py_ssize_t j = 0; j < k; j++) {
+        slices[j].data = c->inputs[j].data + begin[j] * c->itemsize;
+        slices[j].len = end[j] - begin[j];
+        slices[j].start = c->inputs[j].start + begin[j];
+    }
+    int err = c->merge(slices, k, c->out + c->start * c->itemsize,
+                       c->sources ? c->sources + c->start : NULL,
+                       c->positions ? c->positions + c->start : NULL);
+    PyMem_RawFree(split);
+    PyMem_RawFree(slices);
+    return err;
+}
+
+static void
+raw_chunk_thread(void *arg)
+{
+    raw_chunk *c = (raw_chunk *)arg;
+    c->err = raw_merge_chunk(c);
+    PyThread_release_lock(c->done);
+}
+
+/* Run the merge described by proto split into nthreads chunks, using
+   the calling thread for the first. Call this without the GIL. Return
+   0, or -1 if out of memory. */
+static int
+raw_merge_parallel(const raw_chunk *proto, Py_ssize_t total,
+                   Py_ssize_t nthreads)
+{
+    raw_chunk *chunks = PyMem_RawMalloc(nthreads * sizeof(raw_chunk));
+    if (chunks == NULL) {
+        return -1;
+    }
+    Py_ssize_t q = total / nthreads, extra = total % nthreads;
+    for (Py_ssize_t t = 0; t < nthreads; t++) {
+        chunks[t] = *proto;
+        chunks[t].start = t * q + Py_MIN(t, extra);
+        chunks[t].stop = (t + 1) * q + Py_MIN(t + 1, extra);
+        chunks[t].done = NULL;
+        chunks[t].err = 0;
+    }
+    for (Py_ssize_t t = 1; t < nthreads; t++) {
+        raw_chunk *c = &chunks[t];
+        c->done = PyThread_allocate_lock();
+        if (c->done == NULL) {
+            continue;
+        }
+        PyThread_acquire_lock(c->done, WAIT_LOCK);
+        if (PyThread_start_new_thread(raw_chunk_thread, c)
+            == PYTHREAD_INVALID_THREAD_ID)
+        {
+            PyThread_release_lock(c->done);
+            PyThread_free_lock(c->done);
+            c->done = NULL;
+        }
+    }
+    int err = raw_merge_chunk(&chunks[0]);
+    for (Py_ssize_t t = 1; t < nthreads; t++) {
+        raw_chunk *c = &chunks[t];
+        if (c->done == NULL) {
+            /* Couldn't start a thread, so do it here. */
+            c->err = raw_merge_chunk(c);
+        }
+        else {
+            PyThread_acquire_lock(c->done, WAIT_LOCK);
+            PyThread_release_lock(c->done);
+            PyThread_free_lock(c->done);
+        }
+        err |= c->err;
+    }
+    PyMem_RawFree(chunks);
+    return err;
+}
+
+PyDoc_STRVAR(merge_arrays_doc,
+"merge_arrays(*buffers, out=None, reverse=False, with_source=False,\n\
+             threads=1)\n\
+--\n\
+\n\
+Merge sorted 1-dimensional buffers of C numbers into one sorted array.\n\
+\n\
+Every buffer must have the same element type, which may be any signed\n\
+or unsigned integer or float/double, in native byte order. The result\n\
+is the same as that of merge(), but the merge runs on the raw values\n\
+without creating Python objects or holding the GIL.\n\
+\n\
+If *out* is given, it must be a writable buffer of the same element\n\
+type with room for all of the values; the result is written there and\n\
+*out* is returned. Otherwise a new array.array is returned.\n\
+\n\
+If *with_source* is true, returns a tuple (values, sources, positions)\n\
+instead, where sources and positions are array.array('q') objects\n\
+telling which buffer and which position each value came from.\n\
+\n\
+If *threads* is more than 1, the output is split into up to that many\n\
+chunks which are merged in parallel. The result is the same.\n\
+\n\
+>>> from array import array\n\
+>>> merge_arrays(array('q', [1, 3, 5]), array('q', [2, 4]))\n\
+array('q', [1, 2, 3, 4, 5])");
+
+static PyObject *
+merge_arrays(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    PyObject *out = NULL;
+    int reverse = 0;
+    int with_source = 0;
+    Py_ssize_t threads = 1;
+
+    if (kwds != NULL) {
+        char *kwlist[] = {"out", "reverse", "with_source", "threads", NULL};
+        PyObject *tmpargs = PyTuple_New(0);
+        if (tmpargs == NULL) {
+            return NULL;
+        }
+        if (!PyArg_ParseTupleAndKeywords(tmpargs, kwds, "|Oppn:merge_arrays",
+                                         kwlist, &out, &reverse,
+                                         &with_source, &threads)) {
+            Py_DECREF(tmpargs);
+            return NULL;
+        }
+        Py_DECREF(tmpargs);
+    }
+    if (out == Py_None) {
+        out = NULL;
+    }
+    if (threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
+        return NULL;
+    }
+
+    Py_ssize_t k = PyTuple_GET_SIZE(args);
+    if (k == 0) {
+        PyErr_SetString(PyExc_TypeError,
+                        "merge_arrays() expected at least one buffer");
+        return NULL;
+    }
+
+    PyObject *result = NULL, *sources = NULL, *positions = NULL;
+    const raw_type *tp = NULL;
+    Py_ssize_t nviews = 0, total = 0;
+    Py_buffer out_view = {NULL, NULL};
+    Py_buffer sources_view = {NULL, NULL}, positions_view = {NULL, NULL};
+    Py_buffer *views = PyMem_New(Py_buffer, k);
+    raw_input *inputs = PyMem_New(raw_input, k);
+    if (views == NULL || inputs == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < k; i++) {
+        PyObject *obj = PyTuple_GET_ITEM(args, i);
+        if (get_raw_buffer(obj, &views[i], PyBUF_SIMPLE) < 0) {
+            goto done;
+        }
+        nviews++;
+        const raw_type *t = raw_type_of(&views[i]);
+        if (t == NULL) {
+            goto done;
+        }
+        if (tp != NULL && t != tp) {
+            PyErr_SetString(PyExc_TypeError,
+                            "all buffers must have the same element type");
+            goto done;
+        }
+        tp = t;
+        inputs[i].data = views[i].buf;
+        inputs[i].len = views[i].shape[0];
+        inputs[i].start = 0;
+        if (inputs[i].len > PY_SSIZE_T_MAX - total) {
+            PyErr_SetString(PyExc_OverflowError, "too many values to merge");
+            goto done;
+        }
+        total += inputs[i].len;
+    }
+
+    if (out == NULL) {
+        result = new_raw_array(tp, views[0].format, total);
+        if (result == NULL) {
+            goto done;
+        }
+    }
+    else {
+        Py_INCREF(out);
+        result = out;
+    }
+    if (get_raw_buffer(result, &out_view, PyBUF_WRITABLE) < 0) {
+        Py_CLEAR(result);
+        goto done;
+    }
+    const raw_type *out_tp = raw_type_of(&out_view);
+    if (out_tp == NULL) {
+        Py_CLEAR(result);
+        goto done;
+    }
+    if (out_tp != tp) {
+        PyErr_SetString(PyExc_TypeError,
+                        "out must have the same element type as the inputs");
+        Py_CLEAR(result);
+        goto done;
+    }
+    if (out_view.shape[0] < total) {
+        PyErr_Format(PyExc_ValueError,
+                     "out has room for %zd values, but %zd are needed",
+                     out_view.shape[0], total);
+        Py_CLEAR(result);
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < k; i++) {
+        if (buffers_overlap(&out_view, &views[i])) {
+            PyErr_SetString(PyExc_ValueError,
+                            "out must not overlap with the inputs");
+            Py_CLEAR(result);
+            goto done;
+        }
+    }
+
+    if (with_source) {
+        sources = new_raw_array(RAW_INT64, "q", total);
+        if (sources == NULL) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        positions = new_raw_array(RAW_INT64, "q", total);
+        if (positions == NULL) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        if (get_raw_buffer(sources, &sources_view, PyBUF_WRITABLE) < 0
+            || get_raw_buffer(positions, &positions_view, PyBUF_WRITABLE) < 0)
+        {
+            Py_CLEAR(result);
+            goto done;
+        }
+    }
+
+    raw_merge_func merge = reverse ? tp->merge_reverse : tp->merge;
+    threads = Py_MIN(threads, total / RAW_MIN_CHUNK);
+    int err;
+    if (threads > 1) {
+        raw_chunk proto = {
+            .merge = merge,
+            .split = reverse ? tp->split_reverse : tp->split,
+            .inputs = inputs,
+            .k = k,
+            .itemsize = tp->itemsize,
+            .out = out_view.buf,
+            .sources = sources_view.buf,
+            .positions = positions_view.buf,
+        };
+        Py_BEGIN_ALLOW_THREADS
+        err = raw_merge_parallel(&proto, total, threads);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        Py_BEGIN_ALLOW_THREADS
+        err = merge(inputs, k, out_view.buf,
+                    sources_view.buf, positions_view.buf);
+        Py_END_ALLOW_THREADS
+    }
+    if (err < 0) {
+        PyErr_NoMemory();
+        Py_CLEAR(result);
+    }
+    else if (with_source) {
+        Py_SETREF(result, PyTuple_Pack(3, result, sources, positions));
+    }
+
+done:
+    if (out_view.obj != NULL) {
+        PyBuffer_Release(&out_view);
+    }
+    if (sources_view.obj != NULL) {
+        PyBuffer_Release(&sources_view);
+    }
+    if (positions_view.obj != NULL) {
+        PyBuffer_Release(&positions_view);
+    }
+    Py_XDECREF(sources);
+    Py_XDECREF(positions);
+    for (Py_ssize_t i = 0; i < nviews; i++) {
+        PyBuffer_Release(&views[i]);
+    }
+    PyMem_Free(views);
+    PyMem_Free(inputs);
+    return result;
+}
+
+/* set operations ***********************************************************/
+
+/* Make a merge object over args that produces the given mode. Only key
+   and reverse are accepted as keyword arguments. */
+static PyObject *
+new_setop(PyObject *module, const char *name, PyObject *args,
+          PyObject *kwds, int mode, Py_ssize_t threshold)
+{
+    if (kwds != NULL) {
+        char *kwlist[] = {"key", "reverse", NULL};
+        char format[32];
+        PyObject *key;
+        int reverse;
+        PyOS_snprintf(format, sizeof(format), "|Op:%s", name);
+        PyObject *tmpargs = PyTuple_New(0);
+        if (tmpargs == NULL) {
+            return NULL;
+        }
+        int ok = PyArg_ParseTupleAndKeywords(tmpargs, kwds, format, kwlist,
+                                             &key, &reverse);
+        Py_DECREF(tmpargs);
+        if (!ok) {
+            return NULL;
+        }
+    }
+    PyObject *type = get_merge_state(module)->merge_type;
+    mergeobject *mo = (mergeobject *)PyObject_Call(type, args, kwds);
+    if (mo != NULL) {
+        mo->mode = mode;
+        mo->threshold = threshold;
+    }
+    return (PyObject *)mo;
+}
+
+PyDoc_STRVAR(intersect_doc,
+"intersect(*iterables, key=None, reverse=False)\n\
+--\n\
+\n\
+Yield, in order, one item for each key found in every one of the\n\
+sorted iterables: the first of them, by the order of merge(). Lists\n\
+and tuples are searched with binary search to skip ahead.\n\
+\n\
+>>> list(intersect([1, 3, 5, 7], [3, 4, 5], [0, 3, 5, 6]))\n\
+[3, 5]");
+
+static PyObject *
+intersect(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    return new_setop(module, "intersect", args, kwds, MODE_INTERSECT,
+                     PyTuple_GET_SIZE(args));
+}
+
+PyDoc_STRVAR(threshold_doc,
+"threshold(m, *iterables, key=None, reverse=False)\n\
+--\n\
+\n\
+Yield, in order, one item for each key found in at least m of the\n\
+sorted iterables: the first of them, by the order of merge().\n\
+\n\
+>>> list(threshold(2, [1, 3, 5], [2, 3, 4], [4, 5, 6]))\n\
+[3, 4, 5]");
+
+static PyObject *
+threshold(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "threshold() missing m");
+        return NULL;
+    }
+    Py_ssize_t m = PyNumber_AsSsize_t(PyTuple_GET_ITEM(args, 0),
+                                      PyExc_OverflowError);
+    if (m == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (m < 1) {
+        PyErr_SetString(PyExc_ValueError, "m must be at least 1");
+        return NULL;
+    }
+    PyObject *iterables = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (iterables == NULL) {
+        return NULL;
+    }
+    PyObject *res = new_setop(module, "threshold", iterables, kwds,
+                              MODE_THRESHOLD, m);
+    Py_DECREF(iterables);
+    return res;
+}
+
+PyDoc_STRVAR(difference_doc,
+"difference(iterable, *others, key=None, reverse=False)\n\
+--\n\
+\n\
+Yield, in order, the first item of iterable with each key that is\n\
+found in none of the other sorted iterables. Lists and tuples are\n\
+searched with binary search to skip ahead.\n\
+\n\
+>>> list(difference([1, 2, 3, 4, 5], [2, 3], [5, 6]))\n\
+[1, 4]");
+
+static PyObject *
+difference(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "difference() missing iterable");
+        return NULL;
+    }
+    return new_setop(module, "difference", args, kwds, MODE_DIFFERENCE, 0);
+}
+
+/* external sorting *********************************************************/
+
+/* Items per pickled list in a run file, and the buffer size of each run
+   file, so that runs are written and read back in large pieces. */
+#define SPILL_BATCH 4096
+#define SPILL_BUFFER (1 << 18)
+
+typedef struct {
+    PyObject *dumps;           /* pickle.dumps */
+    PyObject *loads;           /* pickle.loads */
+    PyObject *tempfile;        /* tempfile.TemporaryFile */
+    PyObject *tmpdir;
+    merge_state *state;
+} spill_context;
+
+static int
+spill_context_init(spill_context *ctx, PyObject *tmpdir)
+{
+    ctx->dumps = ctx->loads = ctx->tempfile = NULL;
+    ctx->tmpdir = tmpdir;
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    if (pickle == NULL) {
+        return -1;
+    }
+    ctx->dumps = PyObject_GetAttrString(pickle, "dumps");
+    ctx->loads = PyObject_GetAttrString(pickle, "loads");
+    Py_DECREF(pickle);
+    if (ctx->dumps == NULL || ctx->loads == NULL) {
+        return -1;
+    }
+    PyObject *tempfile = PyImport_ImportModule("tempfile");
+    if (tempfile == NULL) {
+        return -1;
+    }
+    ctx->tempfile = PyObject_GetAttrString(tempfile, "TemporaryFile");
+    Py_DECREF(tempfile);
+    return ctx->tempfile == NULL ? -1 : 0;
+}
+
+static void
+spill_context_clear(spill_context *ctx)
+{
+    Py_CLEAR(ctx->dumps);
+    Py_CLEAR(ctx->loads);
+    Py_CLEAR(ctx->tempfile);
+}
+
+/* Pickle batch and append it to file, after its length. */
+static int
+spill_batch(spill_context *ctx, PyObject *file, PyObject *batch)
+{
+    PyObject *data = PyObject_CallFunction(ctx->dumps, "Oi", batch, -1);
+    if (data == NULL) {
+        return -1;
+    }
+    if (!PyBytes_Check(data)) {
+        PyErr_SetString(PyExc_TypeError, "pickle.dumps() did not return "
+                                         "bytes");
+        Py_DECREF(data);
+        return -1;
+    }
+    unsigned char header[RUN_HEADER_SIZE];
+    unsigned long long n = (unsigned long long)PyBytes_GET_SIZE(data);
+    for (int i = 0; i < RUN_HEADER_SIZE; i++) {
+        header[i] = (unsigned char)(n >> (8 * i));
+    }
+    PyObject *res = NULL;
+    PyObject *head = PyBytes_FromStringAndSize((const char *)header,
+                                               RUN_HEADER_SIZE);
+    if (head != NULL) {
+        res = PyObject_CallMethod(file, "write", "O", head);
+        Py_DECREF(head);
+    }
+    if (res != NULL) {
+        Py_SETREF(res, PyObject_CallMethod(file, "write", "O", data));
+    }
+    Py_DECREF(data);
+    Py_XDECREF(res);
+    return res == NULL ? -1 : 0;
+}
+
+/* Write the items of iterable to a new temporary file, and return a
+   run_reader for them. */
+static PyObject *
+spill_run(spill_context *ctx, PyObject *iterable)
+{
+    PyObject *file = NULL, *it = NULL, *batch = NULL, *res = NULL;
+    PyObject *args = PyTuple_New(0);
+    PyObject *kwargs = Py_BuildValue("{s:O,s:i}", "dir", ctx->tmpdir,
+                                     "buffering", SPILL_BUFFER);
+    if (args != NULL && kwargs != NULL) {
+        file = PyObject_Call(ctx->tempfile, args, kwargs);
+    }
+    Py_XDECREF(args);
+    Py_XDECREF(kwargs);
+    if (file == NULL) {
+        goto done;
+    }
+    it = PyObject_GetIter(iterable);
+    if (it == NULL) {
+        goto done;
+    }
+    for (;;) {
+        batch = PyList_New(0);
+        if (batch == NULL) {
+            goto done;
+        }
+        PyObject *item;
+        while (PyList_GET_SIZE(batch) < SPILL_BATCH
+               && (item = PyIter_Next(it)) != NULL)
+        {
+            int err = PyList_Append(batch, item);
+            Py_DECREF(item);
+            if (err < 0) {
+                goto done;
+            }
+        }
+        if (PyErr_Occurred()) {
+            goto done;
+        }
+        if (PyList_GET_SIZE(batch) == 0) {
+            break;
+        }
+        if (spill_batch(ctx, file, batch) < 0) {
+            goto done;
+        }
+        Py_CLEAR(batch);
+    }
+    PyObject *pos = PyObject_CallMethod(file, "seek", "i", 0);
+    if (pos == NULL) {
+        goto done;
+    }
+    Py_DECREF(pos);
+    res = run_reader_new(ctx->state, file, ctx->loads);
+
+done:
+    if (res == NULL && file != NULL) {
+        PyObject *type, *value, *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        PyObject *closed = PyObject_CallMethod(file, "close", NULL);
+        Py_XDECREF(closed);
+        PyErr_Clear();
+        PyErr_Restore(type, value, tb);
+    }
+    Py_XDECREF(file);
+    Py_XDECREF(it);
+    Py_XDECREF(batch);
+    return res;
+}
+
+/* Sort list in place with the given keyword arguments for list.sort(). */
+static int
+sort_list(PyObject *list, PyObject *sort_kwds)
+{
+    PyObject *sort = PyObject_GetAttrString(list, "sort");
+    if (sort == NULL) {
+        return -1;
+    }
+    PyObject *args = PyTuple_New(0);
+    PyObject *res = args ? PyObject_Call(sort, args, sort_kwds) : NULL;
+    Py_XDECREF(args);
+    Py_DECREF(sort);
+    Py_XDECREF(res);
+    return res == NULL ? -1 : 0;
+}
+
+/* Call merge(*sources, **kwds), where sources is a list. */
+static PyObject *
+merge_sources(PyObject *module, PyObject *sources, PyObject *kwds)
+{
+    PyObject *args = PyList_AsTuple(sources);
+    if (args == NULL) {
+        return NULL;
+    }
+    PyObject *res = PyObject_Call(get_merge_state(module)->merge_type,
+                                  args, kwds);
+    Py_DECREF(args);
+    return res;
+}
+
+PyDoc_STRVAR(sort_external_doc,
+"sort_external(iterable, /, *, key=None, reverse=False, run_size=100000,\n\
+              fan_in=64, tmpdir=None)\n\
+--\n\
+\n\
+Return an iterator over the items of iterable in sorted order, using\n\
+temporary files so that only about run_size items are held in memory.\n\
+\n\
+Runs of run_size items are sorted with list.sort() and pickled to\n\
+temporary files in tmpdir (see tempfile.TemporaryFile), in large\n\
+batches. If there are more than fan_in runs, groups of fan_in runs are\n\
+merged into longer runs until there are not. The result is a merge of\n\
+the remaining runs. The sort is stable, and the items must be picklable\n\
+unless they fit in one run.");
+
+static PyObject *
+sort_external(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    PyObject *iterable, *key = Py_None, *tmpdir = Py_None;
+    int reverse = 0;
+    Py_ssize_t run_size = 100000, fan_in = 64;
+    char *kwlist[] = {"", "key", "reverse", "run_size", "fan_in", "tmpdir",
+                      NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds,
+                                     "O|$OpnnO:sort_external", kwlist,
+                                     &iterable, &key, &reverse, &run_size,
+                                     &fan_in, &tmpdir)) {
+        return NULL;
+    }
+    if (run_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "run_size must be at least 1");
+        return NULL;
+    }
+    if (fan_in < 2) {
+        PyErr_SetString(PyExc_ValueError, "fan_in must be at least 2");
+        return NULL;
+    }
+
+    spill_context ctx = {NULL, NULL, NULL, tmpdir, get_merge_state(module)};
+    PyObject *it = NULL, *runs = NULL, *run = NULL, *result = NULL;
+    PyObject *merge_kwds = Py_BuildValue("{s:O,s:O}", "key", key,
+                                         "reverse", reverse ? Py_True
+                                                            : Py_False);
+    if (merge_kwds == NULL) {
+        goto done;
+    }
+    it = PyObject_GetIter(iterable);
+    runs = PyList_New(0);
+    if (it == NULL || runs == NULL) {
+        goto done;
+    }
+
+    /* Form sorted runs. Each is spilled once the next item shows that it
+       is not the last, which stays in memory. */
+    PyObject *item = PyIter_Next(it);
+    while (item != NULL) {
+        run = PyList_New(0);
+        if (run == NULL) {
+            Py_DECREF(item);
+            goto done;
+        }
+        do {
+            int err = PyList_Append(run, item);
+            Py_DECREF(item);
+            if (err < 0) {
+                goto done;
+            }
+        } while (PyList_GET_SIZE(run) < run_size
+                 && (item = PyIter_Next(it)) != NULL);
+        if (PyErr_Occurred() || sort_list(run, merge_kwds) < 0) {
+            goto done;
+        }
+        item = PyIter_Next(it);
+        if (item == NULL) {
+            if (PyErr_Occurred()) {
+                goto done;
+            }
+            break;
+        }
+        if (ctx.dumps == NULL && spill_context_init(&ctx, tmpdir) < 0) {
+            Py_DECREF(item);
+            goto done;
+        }
+        PyObject *reader = spill_run(&ctx, run);
+        Py_CLEAR(run);
+        if (reader == NULL) {
+            Py_DECREF(item);
+            goto done;
+        }
+        int err = PyList_Append(runs, reader);
+        Py_DECREF(reader);
+        if (err < 0) {
+            Py_DECREF(item);
+            goto done;
+        }
+    }
+    if (PyErr_Occurred()) {
+        goto done;
+    }
+    if (run != NULL && PyList_Append(runs, run) < 0) {
+        goto done;
+    }
+    Py_CLEAR(it);
+
+    /* Merge groups of runs until few enough are left. Groups are of
+       consecutive runs, which keeps the sort stable. */
+    while (PyList_GET_SIZE(runs) > fan_in) {
+        PyObject *merged = PyList_New(0);
+        if (merged == NULL) {
+            goto done;
+        }
+        while (PyList_GET_SIZE(runs) > 0) {
+            PyObject *group = PyList_GetSlice(runs, 0, fan_in);
+            PyObject *reader = NULL;
+            if (group != NULL && PyList_GET_SIZE(group) == 1) {
+                reader = PyList_GET_ITEM(group, 0);
+                Py_INCREF(reader);
+            }
+            else if (group != NULL) {
+                PyObject *m = merge_sources(module, group, merge_kwds);
+                if (m != NULL) {
+                    reader = spill_run(&ctx, m);
+                    Py_DECREF(m);
+                }
+            }
+            Py_XDECREF(group);
+            /* Let go of the runs just merged, closing their files. */
+            if (reader == NULL
+                || PyList_SetSlice(runs, 0, fan_in, NULL) < 0
+                || PyList_Append(merged, reader) < 0) {
+                Py_XDECREF(reader);
+                Py_DECREF(merged);
+                goto done;
+            }
+            Py_DECREF(reader);
+        }
+        Py_SETREF(runs, merged);
+    }
+    result = merge_sources(module, runs, merge_kwds);
+
+done:
+    spill_context_clear(&ctx);
+    Py_XDECREF(merge_kwds);
+    Py_XDECREF(it);
+    Py_XDECREF(runs);
+    Py_XDECREF(run);
+    return result;
+}
+
+static PyMethodDef multimerge_methods[] = {
+    {"merge_arrays", (PyCFunction)(void(*)(void))merge_arrays,
+     METH_VARARGS | METH_KEYWORDS, merge_arrays_doc},
+    {"intersect", (PyCFunction)(void(*)(void))intersect,
+     METH_VARARGS | METH_KEYWORDS, intersect_doc},
+    {"threshold", (PyCFunction)(void(*)(void))threshold,
+     METH_VARARGS | METH_KEYWORDS, threshold_doc},
+    {"difference", (PyCFunction)(void(*)(void))difference,
+     METH_VARARGS | METH_KEYWORDS, difference_doc},
+    {"sort_external", (PyCFunction)(void(*)(void))sort_external,
+     METH_VARARGS | METH_KEYWORDS, sort_external_doc},
+    {NULL, NULL}
+};
+
+static int
+multimerge_exec(PyObject *module)
+{
+    merge_state *state = get_merge_state(module);
+#if MERGE_NODE_MAXFREELIST > 0
+    state->node_numfree = 0;
+#endif
+    state->merge_node_type = PyType_FromModuleAndSpec(
+        module, &merge_node_type_spec, NULL);
+    state->prefetcher_type = PyType_FromModuleAndSpec(
+        module, &prefetcher_type_spec, NULL);
+    state->run_reader_type = PyType_FromModuleAndSpec(
+        module, &run_reader_type_spec, NULL);
+    state->amerge_slot_type = PyType_FromModuleAndSpec(
+        module, &amerge_slot_type_spec, NULL);
+    if (state->merge_node_type == NULL || state->prefetcher_type == NULL
+        || state->run_reader_type == NULL || state->amerge_slot_type == NULL)
+    {
+        return -1;
+    }
+    PyObject *operator_module = PyImport_ImportModule("operator");
+    if (operator_module == NULL) {
+        return -1;
+    }
+    state->itemgetter_type = PyObject_GetAttrString(operator_module,
+                                                    "itemgetter");
+    state->attrgetter_type = PyObject_GetAttrString(operator_module,
+                                                    "attrgetter");
+    Py_DECREF(operator_module);
+    if (state->itemgetter_type == NULL || state->attrgetter_type == NULL) {
+        return -1;
+    }
+    state->merge_type = PyType_FromModuleAndSpec(module,
+                                                 &merge_type_spec, NULL);
+    if (state->merge_type == NULL) {
+        return -1;
+    }
+    if (PyModule_AddType(module, state->merge_type) < 0) {
+        return -1;
+    }
+    state->mmap_records_type = PyType_FromModuleAndSpec(
+        module, &mmap_records_type_spec, NULL);
+    if (state->mmap_records_type == NULL) {
+        return -1;
+    }
+    if (PyModule_AddType(module,
+                         (PyTypeObject *)state->mmap_records_type) < 0) {
+        return -1;
+    }
+    state->amerge_anext_type = PyType_FromModuleAndSpec(
+        module, &amerge_anext_type_spec, NULL);
+    if (state->amerge_anext_type == NULL) {
+        return -1;
+    }
+    state->amerge_type = PyType_FromModuleAndSpec(
+        module, &amerge_type_spec, NULL);
+    if (state->amerge_type == NULL) {
         return -1;
     }
-    return PyModule_AddType(module, state->merge_type);
+    return PyModule_AddType(module, (PyTypeObject *)state->amerge_type);
 }
 
 static struct PyModuleDef_Slot multimerge_slots[] = {
     {Py_mod_exec, multimerge_exec},
+#ifdef Py_MOD_PER_INTERPRETER_GIL_SUPPORTED
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_MOD_GIL_NOT_USED
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
     {0, NULL}
 };
 
@@ -649,6 +6873,7 @@ static struct PyModuleDef multimergemodule = {
     .m_size = sizeof(merge_state),
     .m_doc = "implements a k-way merge algorithm as a drop-in\n\
 replacement for heapq.merge in the Python standard library",
+    .m_methods = multimerge_methods,
     .m_slots = multimerge_slots,
     .m_traverse = mergemodule_traverse,
     .m_clear = mergemodule_clear,
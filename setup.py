@@ -1,10 +1,18 @@
+import os
 from setuptools import setup, Extension
 
+# Build with MULTIMERGE_STATS=1 in the environment to count comparisons,
+# key calls and more for merge.stats().
+define_macros = []
+if os.environ.get("MULTIMERGE_STATS"):
+    define_macros.append(("MULTIMERGE_STATS", "1"))
+
 setup(
     name="multimerge",
     version="0.2.0",
     author="Dennis Sweeney",
     author_email="sweeney.427@osu.edu",
     description="a k-way merge algorithm to replace heapq.merge",
-    ext_modules=[Extension("multimerge", ["multimergemodule.c"])],
+    ext_modules=[Extension("multimerge", ["multimergemodule.c"],
+                           define_macros=define_macros)],
 )
@@ -26,11 +26,22 @@ interleaved = [
     for x in range(16)
 ]
 
+uneven = [
+    # 1024 iterables, of which all but 11 run out at once. The survivors,
+    # 0, 1, 2, 4, ..., 512, are each alone in one half of the last
+    # subtree, so without rebalancing they hang on a path of depth 10.
+    list(map(Int, range(i, 16_000, 11) if i in survivors else [i % 11]))
+    for survivors in [{0} | {1 << j for j in range(10)}]
+    for i in range(1024)
+]
+
 def test_merge_func(mergefunc):
     print("No overlap: {:,} lt; {:,} eq".format(
         *comparisons(mergefunc, no_overlap)))
     print("Interleaved: {:,} lt; {:,} eq".format(
         *comparisons(mergefunc, interleaved)))
+    print("Uneven exhaustion: {:,} lt; {:,} eq".format(
+        *comparisons(mergefunc, uneven)))
 
 if __name__ == "__main__":
     import heapq
@@ -0,0 +1,34 @@
+"""Cost of building and tearing down merge trees.
+
+For each k, time merging k short sorted lists, over and over, and time
+building the merge tree and dropping it after the first item. Then time
+how long the first item takes to come out of one very wide merge.
+"""
+
+import time
+from multimerge import merge
+
+ROUNDS = 20_000
+
+def per_merge(func):
+    t0 = time.perf_counter()
+    for _ in range(ROUNDS):
+        func()
+    return (time.perf_counter() - t0) / ROUNDS * 1e6
+
+if __name__ == "__main__":
+    print("    k   first item (us)   full merge of 8 each (us)")
+    for k in [2, 4, 8, 16, 32, 64, 128, 256]:
+        lists = [list(range(i, 8 * k, k)) for i in range(k)]
+        first = per_merge(lambda: next(merge(*lists)))
+        full = per_merge(lambda: merge(*lists).take(8 * k))
+        print(f"{k:5} {first:17.2f} {full:27.2f}")
+
+    k = 100_000
+    for flat in [False, True]:
+        lists = [[i, i + k] for i in range(k)]
+        iters = list(map(iter, lists))
+        t0 = time.perf_counter()
+        next(merge(*iters, flat=flat))
+        ms = (time.perf_counter() - t0) * 1e3
+        print(f"k={k:,}, flat={flat}: first item after {ms:.1f} ms")
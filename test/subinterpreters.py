@@ -0,0 +1,80 @@
+"""Throughput of independent merges run in several subinterpreters.
+
+Each interpreter imports its own copy of the module and repeatedly
+merges its own inputs, driven from a thread of the main interpreter.
+The module supports a GIL per interpreter (PEP 684), so on CPython 3.12
+and later the interpreters run in parallel, and the total throughput
+should grow about linearly with the number of interpreters, up to the
+number of cores. Pass the largest number of interpreters to try; it
+defaults to the number of cores.
+"""
+
+import os
+import sys
+import threading
+import time
+
+try:
+    import _interpreters as interpreters          # 3.13 and later
+except ImportError:
+    try:
+        import _xxsubinterpreters as interpreters  # 3.12
+    except ImportError:
+        interpreters = None
+
+ITEMS = 200_000
+ROUNDS = 5
+
+SCRIPT = f"""
+import sys
+sys.path[:0] = {sys.path!r}
+from multimerge import merge
+data = [list(range(i, {ITEMS}, 16)) for i in range(16)]
+for _ in range({ROUNDS}):
+    for _ in merge(*data):
+        pass
+"""
+
+def work(interp, failures):
+    # Since 3.13, run_string() returns a description of an uncaught
+    # exception instead of raising it.
+    try:
+        failure = interpreters.run_string(interp, SCRIPT)
+    except Exception as e:
+        failure = e
+    if failure is not None:
+        failures.append(failure)
+
+def throughput(ninterps):
+    interps = [interpreters.create() for _ in range(ninterps)]
+    failures = []
+    try:
+        threads = [threading.Thread(target=work, args=(interp, failures))
+                   for interp in interps]
+        t0 = time.perf_counter()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.perf_counter() - t0
+    finally:
+        for interp in interps:
+            interpreters.destroy(interp)
+    if failures:
+        raise RuntimeError(failures[0])
+    return ninterps * ROUNDS * ITEMS / elapsed
+
+if __name__ == "__main__":
+    if interpreters is None:
+        sys.exit(f"Python {sys.version.split()[0]} has no subinterpreters"
+                 " with their own GIL; 3.12 or later is needed")
+    top = int(sys.argv[1]) if len(sys.argv) > 1 else os.cpu_count() or 1
+    print(f"Python {sys.version.split()[0]}, {os.cpu_count()} cores")
+    base = None
+    n = 1
+    while n <= top:
+        rate = throughput(n)
+        base = base or rate
+        print(f"{n:3} interpreters: {rate:14,.0f} items/s"
+              f" ({rate / base:.2f}x)")
+        n *= 2
@@ -1,8 +1,27 @@
 import unittest
 import multimerge
-from itertools import product, chain
-from operator import itemgetter
+from itertools import product, chain, islice
+from operator import itemgetter, attrgetter
 import random
+from functools import partial
+from types import SimpleNamespace
+from collections import deque, namedtuple
+from array import array
+import math
+import threading
+import tempfile
+import os
+import asyncio
+import pickle
+import sys
+
+try:
+    import _interpreters as interpreters
+except ImportError:
+    try:
+        import _xxsubinterpreters as interpreters
+    except ImportError:
+        interpreters = None
 
 class TestMerge(unittest.TestCase):
     """mostly copied from test.test_heapq"""
@@ -29,6 +48,660 @@ class TestMerge(unittest.TestCase):
                 self.assertEqual(list(m), expected)
                 self.assertEqual(list(m), [])
 
+    def test_merge_typed_keys(self):
+        # Homogeneous keys take specialized comparison paths; mixed keys
+        # (including a type change mid-merge) fall back to the generic one.
+        big = 2**100
+        samples = [
+            [random.random() for _ in range(50)],
+            [random.randrange(-10**6, 10**6) for _ in range(50)],
+            [random.randrange(-big, big) for _ in range(50)],
+            [random.choice([-1, 0, 1, big, -big]) for _ in range(50)],
+            [''.join(random.choices('abc', k=random.randrange(4)))
+             for _ in range(50)],
+            [''.join(random.choices('ab€', k=random.randrange(4)))
+             for _ in range(50)],
+            [bytes(random.choices(b'ab\x00', k=random.randrange(4)))
+             for _ in range(50)],
+            [(random.randrange(5), random.choice('xy')) for _ in range(50)],
+            [(random.random(),) * random.randrange(3) for _ in range(50)],
+            [random.choice([0, 0.5, 1, 1.5, True]) for _ in range(50)],
+        ]
+        for data, reverse in product(samples, [False, True]):
+            inputs = [sorted(data[i::4], reverse=reverse) for i in range(4)]
+            expected = sorted(chain(*inputs), reverse=reverse)
+            with self.subTest(inputs=inputs, reverse=reverse):
+                m = self.module.merge(*inputs, reverse=reverse)
+                self.assertEqual(list(m), expected)
+        # Ints at the front of every input; floats show up later.
+        inputs = [[1, 2.5, 3.5], [2, 2.25, 4.0], [0, 1.5]]
+        self.assertEqual(list(self.module.merge(*inputs)),
+                         sorted(chain(*inputs)))
+
+    def test_merge_with_source(self):
+        for n, reverse in product(range(6), [False, True]):
+            inputs = [sorted(random.choices(range(20),
+                                            k=random.randrange(30)),
+                             reverse=reverse)
+                      for _ in range(n)]
+            expected = sorted(
+                ((i, j, x) for i, lst in enumerate(inputs)
+                           for j, x in enumerate(lst)),
+                key=itemgetter(2), reverse=reverse)
+            with self.subTest(inputs=inputs, reverse=reverse):
+                m = self.module.merge(*inputs, reverse=reverse,
+                                      with_source=True)
+                self.assertEqual(list(m), expected)
+        m = self.module.merge('ad', 'bc', key=str.upper, with_source=True)
+        self.assertEqual(m.take(3), [(0, 0, 'a'), (1, 0, 'b'), (1, 1, 'c')])
+
+    def test_merge_parallel_keys(self):
+        for n, reverse in product(range(6), [False, True]):
+            inputs = [sorted(random.choices(range(-20, 20),
+                                            k=random.randrange(30)),
+                             key=abs, reverse=reverse)
+                      for _ in range(n)]
+            keys = [map(abs, lst) for lst in inputs]
+            expected = sorted(chain(*inputs), key=abs, reverse=reverse)
+            with self.subTest(inputs=inputs, reverse=reverse):
+                m = self.module.merge(*inputs, keys=keys, reverse=reverse)
+                self.assertEqual(list(m), expected)
+        m = self.module.merge('ad', 'bc', keys=['ad', 'bc'], with_source=True)
+        self.assertEqual(list(m), [(0, 0, 'a'), (1, 0, 'b'),
+                                   (1, 1, 'c'), (0, 1, 'd')])
+
+    def test_merge_parallel_keys_errors(self):
+        merge = self.module.merge
+        self.assertRaises(TypeError, merge, [1], key=abs, keys=[[1]])
+        self.assertRaises(ValueError, merge, [1], [2], keys=[[1]])
+        self.assertRaises(TypeError, merge, [1], keys=5)
+        self.assertRaises(TypeError, list, merge([1], [2], keys=[[1], 5]))
+        for keys in [[[1], [3]], [[1, 2], [3, 4]], [[1, 2], []]]:
+            with self.subTest(keys=keys):
+                m = merge([1, 2], [3], keys=keys)
+                self.assertRaises(ValueError, list, m)
+
+    def test_merge_sequence_sources(self):
+        merge = self.module.merge
+        # Exact lists and tuples are indexed rather than iterated, so
+        # items appended while merging are seen, like with iter(list).
+        class List(list):
+            pass
+
+        a = [1, 4]
+        m = merge(a, (2, 3), [0, 5])
+        self.assertEqual(next(m), 0)
+        a.append(6)
+        self.assertEqual(list(m), [1, 2, 3, 4, 5, 6])
+        self.assertEqual(list(merge(List([1, 3]), (2,), [], ())), [1, 2, 3])
+        m = merge([3, 4], (1, 2), with_source=True)
+        self.assertEqual(list(m), [(1, 0, 1), (1, 1, 2),
+                                   (0, 0, 3), (0, 1, 4)])
+
+    def test_merge_prefetch(self):
+        merge = self.module.merge
+        for prefetch, n in product([0, 1, 2, 3, 7, 100], range(5)):
+            inputs = [sorted(random.choices(range(50),
+                                            k=random.randrange(20)))
+                      for _ in range(n)]
+            expected = sorted(chain(*inputs))
+            with self.subTest(prefetch=prefetch, inputs=inputs):
+                m = merge(*map(iter, inputs), prefetch=prefetch)
+                self.assertEqual(list(m), expected)
+                m = merge(*map(iter, inputs), prefetch=prefetch,
+                          keys=[iter(x) for x in inputs], with_source=True)
+                self.assertEqual([x for _, _, x in m], expected)
+        m = merge(iter('ace'), iter('bdf'), prefetch=2, with_source=True)
+        self.assertEqual(list(m), [(0, 0, 'a'), (1, 0, 'b'), (0, 1, 'c'),
+                                   (1, 1, 'd'), (0, 2, 'e'), (1, 2, 'f')])
+        self.assertRaises(ValueError, merge, [1], prefetch=-1)
+        self.assertRaises(TypeError, merge, [1], prefetch=1.5)
+
+        def gen():
+            yield 1
+            yield 2
+            raise ZeroDivisionError
+        with self.assertRaises(ZeroDivisionError):
+            list(merge(gen(), prefetch=10))
+
+    def test_merge_lower_bounds(self):
+        merge = self.module.merge
+        for n, reverse in product(range(6), [False, True]):
+            inputs = [sorted(random.choices(range(30),
+                                            k=random.randrange(10)),
+                             reverse=reverse)
+                      for _ in range(n)]
+            pick = max if reverse else min
+            bounds = [random.choice([None, pick(lst, default=0),
+                                     pick(lst, default=0) + (reverse - .5)])
+                      for lst in inputs]
+            expected = list(merge(*inputs, reverse=reverse,
+                                  with_source=True))
+            with self.subTest(inputs=inputs, bounds=bounds):
+                m = merge(*inputs, reverse=reverse, with_source=True,
+                          lower_bounds=bounds)
+                self.assertEqual(list(m), expected)
+                m = merge(*inputs, reverse=reverse, lower_bounds=bounds,
+                          keys=inputs)
+                self.assertEqual(list(m), [x for _, _, x in expected])
+        # Ties with a bound still go to the earlier iterable.
+        m = merge([1, 1], [1, 2], [0, 1], lower_bounds=[1, 1, None],
+                  with_source=True)
+        self.assertEqual(list(m), [(2, 0, 0), (0, 0, 1), (0, 1, 1),
+                                   (1, 0, 1), (2, 1, 1), (1, 1, 2)])
+
+    def test_merge_lower_bounds_laziness(self):
+        opened = []
+
+        class Source:
+            def __init__(self, i, lst):
+                self.i = i
+                self.lst = lst
+
+            def __iter__(self):
+                opened.append(self.i)
+                return iter(self.lst)
+
+        inputs = [Source(i, range(10 * i, 10 * i + 10)) for i in range(10)]
+        bounds = [10 * i for i in range(10)]
+        m = self.module.merge(*inputs, lower_bounds=bounds, max_open=1)
+        self.assertEqual(m.take(15), list(range(15)))
+        self.assertEqual(opened, [0, 1])
+        self.assertEqual(list(m), list(range(15, 100)))
+        self.assertEqual(opened, list(range(10)))
+
+        # Without bounds, everything is opened up front.
+        m = self.module.merge(*inputs, max_open=9)
+        self.assertRaises(RuntimeError, next, m)
+        m = self.module.merge(*inputs, max_open=10)
+        self.assertEqual(list(m), list(range(100)))
+        # Overlapping inputs need to be open at the same time.
+        m = self.module.merge([1, 5], [2, 3], lower_bounds=[1, 2],
+                              max_open=1)
+        self.assertEqual(next(m), 1)
+        self.assertRaises(RuntimeError, next, m)
+
+    def test_merge_lower_bounds_errors(self):
+        merge = self.module.merge
+        self.assertRaises(ValueError, merge, [1], [2], lower_bounds=[1])
+        self.assertRaises(TypeError, merge, [1], lower_bounds=1)
+        self.assertRaises(ValueError, merge, [1], max_open=0)
+        self.assertRaises(TypeError, merge, [1], max_open='1')
+        self.assertEqual(list(merge([1], max_open=None)), [1])
+        self.assertEqual(list(merge([], [], lower_bounds=[0, 0])), [])
+        m = merge([1], [2, 3], lower_bounds=[None, 'x'])
+        self.assertRaises(TypeError, next, m)
+
+    def test_merge_unique_groupby(self):
+        from itertools import groupby
+        for n, key, reverse in product([1, 2, 3, 9], [None, abs],
+                                       [False, True]):
+            inputs = [sorted(random.choices(range(-8, 8), k=20), key=key,
+                             reverse=reverse)
+                      for _ in range(n)]
+            merged = sorted(chain(*inputs), key=key, reverse=reverse)
+            groups = [(k, list(g)) for k, g in groupby(merged, key=key)]
+            with self.subTest(n=n, key=key, reverse=reverse):
+                m = self.module.merge(*inputs, key=key, reverse=reverse,
+                                      unique=True)
+                self.assertEqual(list(m), [g[0] for k, g in groups])
+                m = self.module.merge(*inputs, key=key, reverse=reverse,
+                                      groupby=True)
+                self.assertEqual(list(m), groups)
+
+        merge = self.module.merge
+        m = merge('abc', 'bcd', unique=True, with_source=True)
+        self.assertEqual(list(m), [(0, 0, 'a'), (0, 1, 'b'), (0, 2, 'c'),
+                                   (1, 2, 'd')])
+        m = merge([1, 3], [3], with_source=True, groupby=True)
+        self.assertEqual(m.take(5), [(1, [(0, 0, 1)]),
+                                     (3, [(0, 1, 3), (1, 0, 3)])])
+        m = merge([1], [1], keys=[['x'], ['x']], groupby=True)
+        self.assertEqual(list(m), [('x', [1, 1])])
+        self.assertRaises(ValueError, merge, [1], unique=True, groupby=True)
+
+    def test_merge_unique_comparisons(self):
+        # Equal keys are found with < alone.
+        class Int(int):
+            lt = eq = 0
+            def __lt__(self, other):
+                Int.lt += 1
+                return int.__lt__(self, other)
+            def __eq__(self, other):
+                Int.eq += 1
+                return int.__eq__(self, other)
+            __hash__ = int.__hash__
+        inputs = [list(map(Int, range(i, 100, 3))) * 2 for i in range(3)]
+        for lst in inputs:
+            lst.sort()
+        result = list(self.module.merge(*inputs, unique=True))
+        self.assertGreater(Int.lt, 0)
+        self.assertEqual(Int.eq, 0)
+        self.assertEqual(result, list(range(100)))
+
+    def test_merge_unique_errors(self):
+        def key(x):
+            if x == 3:
+                raise ZeroDivisionError
+            return x
+        for mode in ['unique', 'groupby']:
+            with self.subTest(mode=mode):
+                m = self.module.merge([1, 2, 3], [2], key=key, **{mode: 1})
+                self.assertRaises(ZeroDivisionError, list, m)
+                self.assertEqual(list(m), [])
+        m = self.module.merge([1, 'a'], unique=True)
+        self.assertRaises(TypeError, list, m)
+
+    def test_merge_limit_stop_key(self):
+        merge = self.module.merge
+        inputs = [[1, 4, 7], (2, 5, 8), iter([3, 6, 9])]
+        self.assertEqual(list(merge(*inputs, limit=4)), [1, 2, 3, 4])
+        self.assertEqual(merge([1, 2], [3], limit=5).take(9), [1, 2, 3])
+        self.assertEqual(list(merge([1, 2], limit=0)), [])
+        self.assertEqual(list(merge([1, 2], [1, 5], stop_key=2)), [1, 1])
+        self.assertEqual(list(merge([5, 3], [4, 1], reverse=True,
+                                    stop_key=3)), [5, 4])
+        self.assertEqual(list(merge(['a', 'bb', 'ccc'], key=len,
+                                    stop_key=3)), ['a', 'bb'])
+        self.assertEqual(list(merge([1, 2, 3], [2, 3], stop_key=3,
+                                    limit=2)), [1, 2])
+        m = merge([1, 1, 2, 2, 3], [2], groupby=True, limit=2)
+        self.assertEqual(list(m), [(1, [1, 1]), (2, [2, 2, 2])])
+        m = merge([1, 1, 2, 2, 3], [2], unique=True, stop_key=3)
+        self.assertEqual(list(m), [1, 2])
+
+        # Deferred inputs past the stop key are never opened.
+        opened = []
+        class Lazy:
+            def __init__(self, lst):
+                self.lst = lst
+            def __iter__(self):
+                opened.append(self.lst[0])
+                return iter(self.lst)
+        m = merge(Lazy([0, 5]), Lazy([10, 15]), lower_bounds=[0, 10],
+                  stop_key=8)
+        self.assertEqual(list(m), [0, 5])
+        self.assertEqual(opened, [0])
+
+        self.assertRaises(ValueError, merge, [1], limit=-1)
+        self.assertRaises(TypeError, merge, [1], limit='x')
+        self.assertRaises(TypeError, list, merge([1], [2], stop_key='x'))
+
+    def test_merge_stop_releases_inputs(self):
+        # Reaching a bound lets go of the iterators before the merge
+        # object goes away.
+        closed = []
+        def gen(lst):
+            try:
+                yield from lst
+            finally:
+                closed.append(lst[0])
+        for kw in [dict(limit=3), dict(stop_key=4)]:
+            with self.subTest(**kw):
+                closed.clear()
+                m = self.module.merge(gen([1, 4, 7]), gen([2, 3, 8]), **kw)
+                self.assertEqual(m.take(3), [1, 2, 3])
+                if 'stop_key' in kw:
+                    self.assertIsNone(next(m, None))
+                self.assertEqual(sorted(closed), [1, 2])
+                self.assertEqual(list(m), [])
+
+    def test_merge_of_merges(self):
+        # Keys computed by an inner merge are not computed again.
+        calls = 0
+        def key(x):
+            nonlocal calls
+            calls += 1
+            return -x
+        merge = self.module.merge
+        for reverse, flat in product([False, True], [False, True]):
+            inputs = [sorted(random.choices(range(100), k=50), key=key,
+                             reverse=reverse)
+                      for _ in range(6)]
+            expected = sorted(chain(*inputs), key=key, reverse=reverse)
+            with self.subTest(reverse=reverse, flat=flat):
+                calls = 0
+                inner = [multimerge.merge(*inputs[i:i+2], key=key,
+                                          reverse=reverse, flat=flat)
+                         for i in range(0, 4, 2)]
+                outer = merge(*inner, inputs[4], iter(inputs[5]), key=key,
+                              reverse=reverse)
+                self.assertEqual(list(outer), expected)
+                self.assertLessEqual(calls, len(expected))
+
+        # Other inner merges are read as plain iterators.
+        calls = 0
+        inner = multimerge.merge([3, 2], [1], key=key, with_source=True)
+        outer = merge(inner, [(0, 0, 4)], key=lambda t: -t[2])
+        self.assertEqual(list(outer), [(0, 0, 4), (0, 0, 3), (0, 1, 2),
+                                       (1, 0, 1)])
+        inner = multimerge.merge([1, 3], [2])
+        outer = merge(inner, [2.5], key=lambda x: x)
+        self.assertEqual(list(outer), [1, 2, 2.5, 3])
+        inner = multimerge.merge([1, 3], [2], limit=2)
+        self.assertEqual(list(merge(inner, [0])), [0, 1, 2])
+
+        # An inner merge that is down to one input, after its keys are
+        # skipped.
+        inner = multimerge.merge([5, 4], key=key)
+        self.assertEqual(next(inner), 5)
+        self.assertEqual(list(merge(inner, [6, 3], key=key)), [6, 4, 3])
+
+    def test_merge_pickle(self):
+        merge = self.module.merge
+        for kw in [{}, dict(key=abs), dict(reverse=True),
+                   dict(with_source=True), dict(unique=True),
+                   dict(groupby=True), dict(prefetch=3), dict(limit=30),
+                   dict(stop_key=20), dict(lower_bounds=[None, 0] * 3)]:
+            inputs = [sorted(random.choices(range(-40, 40),
+                                            k=random.randrange(1, 30)),
+                             key=kw.get("key"),
+                             reverse=kw.get("reverse", False))
+                      for _ in range(6)]
+            if "lower_bounds" in kw:
+                inputs = [[x for x in lst if x >= 0] for lst in inputs]
+            def make():
+                its = [iter(lst) if i % 2 else lst
+                       for i, lst in enumerate(inputs)]
+                return merge(*its, **kw)
+            expected = list(make())
+            for cut in sorted({0, 1, 5, len(expected) // 2, len(expected)}):
+                with self.subTest(kw=kw, cut=cut):
+                    m = make()
+                    head = list(islice(m, cut))
+                    for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+                        copy = pickle.loads(pickle.dumps(m, proto))
+                        self.assertEqual(head + list(copy), expected)
+                    self.assertEqual(head + list(m), expected)
+
+        # Keys, merges of merges, and merges that are done.
+        m = merge(["dog", "horse"], iter(["cat", "fish"]),
+                  keys=[[3, 5], iter([3, 4])])
+        self.assertEqual(next(m), "dog")
+        self.assertEqual(list(pickle.loads(pickle.dumps(m))),
+                         ["cat", "fish", "horse"])
+        m = merge(multimerge.merge([1, 4], iter([2, 6])), iter([3, 5]))
+        self.assertEqual(next(m), 1)
+        copy = pickle.loads(pickle.dumps(m))
+        self.assertEqual(list(copy), [2, 3, 4, 5, 6])
+        self.assertEqual(list(m), [2, 3, 4, 5, 6])
+        self.assertEqual(list(pickle.loads(pickle.dumps(m))), [])
+        self.assertEqual(list(pickle.loads(pickle.dumps(merge()))), [])
+        m = multimerge.intersect([1, 2, 5], iter([2, 3, 5]))
+        self.assertEqual(next(m), 2)
+        self.assertEqual(list(pickle.loads(pickle.dumps(m))), [5])
+
+        # Sources that cannot be pickled, and bad states.
+        m = merge([1, 2], (x for x in [3]))
+        self.assertRaises(TypeError, pickle.dumps, m)
+        self.assertEqual(list(m), [1, 2, 3])
+        m = merge([1, 2], [3])
+        next(m)
+        func, args, state = m.__reduce__()
+        self.assertRaises(ValueError, merge([3]).__setstate__, state)
+        self.assertRaises(TypeError, merge().__setstate__, None)
+        self.assertRaises(ValueError, merge().__setstate__, (99,) + state[1:])
+        leaves = ((0, 0, 1, 1, [1], None, None, None),
+                  (0, 0, 2, 2, [2], None, None, None))
+        bad = state[:-1] + (leaves,)
+        self.assertRaises(ValueError, merge().__setstate__, bad)
+        bad = state[:-1] + (((0, 0, 1, 1, 5, None, None, None),),)
+        self.assertRaises(TypeError, merge().__setstate__, bad)
+
+    def test_merge_setstate_invalid(self):
+        merge = self.module.merge
+        state = merge([1, 2], [3]).__reduce__()[2]
+        lists = ([1, 2], [3])
+        for i, value in [
+            # keys and lower_bounds must match the iterables.
+            (15, (lists, None, (9,))),
+            (15, (lists, None, (9, 9, 9))),
+            (15, (lists, None, [9, 9])),
+            (15, (lists, ([1],), None)),
+            (15, (lists, [[1], [2]], None)),
+            (15, (lists, "ab", None)),
+        ]:
+            bad = state[:i] + (value,) + state[i + 1:]
+            with self.subTest(i=i, value=value):
+                self.assertRaises(ValueError, merge().__setstate__, bad)
+        # No flat set operations, m >= 1 and limit >= -1.
+        setop = multimerge.intersect([1, 2], [2]).__reduce__()[2]
+        for bad in [setop[:3] + (1,) + setop[4:],
+                    state[:8] + (4, 0, -5) + state[11:],
+                    state[:8] + (4, 0, 0) + state[11:],
+                    state[:11] + (-2,) + state[12:]]:
+            with self.subTest(bad=bad):
+                self.assertRaises(ValueError, merge().__setstate__, bad)
+        # A flat merge has no sources to count.
+        m = multimerge.merge([1, 2], [3])
+        next(m)
+        started = m.__reduce__()[2]
+        bad = started[:3] + (1,) + started[4:]
+        self.assertRaises(ValueError, multimerge.merge().__setstate__, bad)
+        # Flags are booleans, whatever value they are given as.
+        bad = started[:5] + (2,) + started[6:]
+        self.assertRaises(ValueError, multimerge.merge().__setstate__, bad)
+        results = []
+        for flag in [1, 2]:
+            m = multimerge.merge()
+            m.__setstate__(started[:2] + (flag,) + started[3:])
+            results.append(list(m))
+        self.assertEqual(results[0], results[1])
+        m = merge()
+        m.__setstate__(state[:15] + ((lists, None, (9, None)),) + state[16:])
+        self.assertEqual(list(m), list(merge(*lists, lower_bounds=[9, None])))
+
+    def test_take(self):
+        inputs = [range(0, 100, 3), range(1, 100, 3), range(2, 50, 3)]
+        expected = sorted(chain(*inputs))
+        m = self.module.merge(*inputs)
+        self.assertEqual(m.take(0), [])
+        self.assertEqual(m.take(10), expected[:10])
+        self.assertEqual(next(m), expected[10])
+        self.assertEqual(m.take(1000), expected[11:])
+        self.assertEqual(m.take(5), [])
+        self.assertEqual(self.module.merge().take(3), [])
+        self.assertRaises(ValueError, self.module.merge([1]).take, -1)
+        self.assertRaises(TypeError, self.module.merge([1]).take, 1.0)
+
+    def test_take_large_n(self):
+        # The result grows as items come out; n is only an upper bound.
+        merge = self.module.merge
+        self.assertEqual(merge([1, 2], [3]).take(2**60), [1, 2, 3])
+        self.assertEqual(merge([1, 2], [3]).take(sys.maxsize), [1, 2, 3])
+        inputs = [range(i, 10_000, 3) for i in range(3)]
+        for n in [1023, 1024, 1025, 5000, 9999, 10_000, 10**8]:
+            with self.subTest(n=n):
+                m = merge(*inputs)
+                self.assertEqual(m.take(n), list(range(min(n, 10_000))))
+                self.assertEqual(list(m), list(range(n, 10_000)))
+        # Runs copied from lists cross the points where the result grows.
+        inputs = [list(range(0, 3000)), list(range(3000, 6000))]
+        self.assertEqual(merge(*inputs).take(5000), list(range(5000)))
+
+    def test_into(self):
+        inputs = [range(0, 100, 3), range(1, 100, 3), range(2, 50, 3)]
+        expected = sorted(chain(*inputs))
+        m = self.module.merge(*inputs)
+        out = [None]
+        self.assertIsNone(m.into(out))
+        self.assertEqual(out, [None] + expected)
+        m = self.module.merge(*inputs)
+        d = deque([None])
+        self.assertEqual(m.take(3), expected[:3])
+        m.into(d)
+        self.assertEqual(list(d), [None] + expected[3:])
+        m.into(d)
+        self.assertEqual(list(d), [None] + expected[3:])
+        self.assertRaises(AttributeError, self.module.merge([1]).into, ())
+
+    def test_take_into_errors(self):
+        def nexterr_delayed():
+            yield from range(10)
+            raise ZeroDivisionError
+        m = self.module.merge(nexterr_delayed(), range(5))
+        self.assertRaises(ZeroDivisionError, m.take, 100)
+        m = self.module.merge(nexterr_delayed(), range(5))
+        self.assertRaises(ZeroDivisionError, m.into, [])
+
+    def test_take_into_runs(self):
+        # Long runs from one list or tuple are copied as slices; ties
+        # between 1 and 1.0 show that the earlier input still wins them.
+        def shards(reverse):
+            cuts = sorted(random.sample(range(1, 500), 6))
+            out = []
+            for i, (a, b) in enumerate(zip([0] + cuts, cuts + [520])):
+                num = float if i % 2 else int
+                run = [num(x) for x in range(a - 10, b)]
+                run.sort(reverse=reverse)
+                out.append(tuple(run) if i % 3 else run)
+            return out
+        for reverse, limit, i in product([False, True], [None, 300],
+                                         range(20)):
+            inputs = shards(reverse)
+            expected = sorted(chain(*inputs), reverse=reverse)[:limit]
+            types = list(map(type, expected))
+            with self.subTest(reverse=reverse, limit=limit):
+                m = self.module.merge(*inputs, reverse=reverse, limit=limit)
+                got = []
+                while chunk := m.take(random.choice([1, 5, 50, 1000])):
+                    got += chunk
+                self.assertEqual(got, expected)
+                self.assertEqual(list(map(type, got)), types)
+                for out in [[], deque()]:
+                    m = self.module.merge(*inputs, reverse=reverse,
+                                          limit=limit)
+                    m.into(out)
+                    self.assertEqual(list(out), expected)
+                    self.assertEqual(list(map(type, out)), types)
+        inputs = [[-2, -3], list(range(-1, -100, -1))]
+        m = self.module.merge(*inputs, key=abs)
+        self.assertEqual(m.take(1000), sorted(chain(*inputs), key=abs))
+
+    def test_getter_keys(self):
+        # itemgetter and attrgetter keys are read without calling them.
+        Row = namedtuple('Row', 'a b c')
+        rng = random.Random(29)
+        def rows(n):
+            return [Row(rng.randrange(3), rng.choice([0.5, 1.5, 2]),
+                        str(rng.randrange(3))) for _ in range(n)]
+        keys = [itemgetter(0), itemgetter(0, 2), itemgetter(-1, 1, 0),
+                attrgetter('a', 'c'), attrgetter('c', 'a'),
+                attrgetter('a'), lambda r: (r.a, r.c)]
+        for key, reverse in product(keys, [False, True]):
+            inputs = [sorted(rows(rng.randrange(30)), key=key,
+                             reverse=reverse) for _ in range(5)]
+            expected = sorted(chain(*inputs), key=key, reverse=reverse)
+            with self.subTest(key=key, reverse=reverse):
+                m = self.module.merge(*inputs, key=key, reverse=reverse)
+                self.assertEqual(list(m), expected)
+                # Keys handed out are never filled in again.
+                groups = [(k, list(g)) for k, g in
+                          self.module.merge(*inputs, key=key,
+                                            reverse=reverse, groupby=True)]
+                for k, group in groups:
+                    self.assertTrue(all(key(x) == k for x in group))
+
+    def test_tuple_keys_nan(self):
+        # Compared as tuples are: a NaN is not equal even to itself,
+        # unless it is the same object.
+        nan = math.nan
+        for a, b in [(float('nan'), float('nan')), (nan, nan)]:
+            with self.subTest(same=a is b):
+                x, y = (a, 1), (b, 0)
+                got = list(self.module.merge([x], [y]))
+                self.assertEqual(got[0] is x, not y < x)
+                got = list(self.module.merge([x], [y], key=itemgetter(0, 1)))
+                self.assertEqual(got[0] is x, not y < x)
+
+    def test_getter_keys_nested(self):
+        class Obj:
+            def __init__(self, x):
+                self.x = x
+                self.inner = SimpleNamespace(tens=x // 10)
+        inputs = [[Obj(x) for x in range(i, 100, 7)] for i in range(7)]
+        key = attrgetter('inner.tens', 'x')
+        got = self.module.merge(*inputs, key=key)
+        self.assertEqual([o.x for o in got], list(range(100)))
+        inputs = [[{'t': i, 's': j} for j in range(5)] for i in range(3)]
+        got = self.module.merge(*inputs, key=itemgetter('s', 't'))
+        self.assertEqual([(d['s'], d['t']) for d in got],
+                         sorted((j, i) for i in range(3) for j in range(5)))
+
+    def test_getter_keys_errors(self):
+        m = self.module.merge([(1, 2)], [(0,)], key=itemgetter(0, 1))
+        self.assertRaises(IndexError, list, m)
+        m = self.module.merge([(1, 2)], [(0,)], key=itemgetter(-2))
+        self.assertRaises(IndexError, list, m)
+        m = self.module.merge([1], [2], key=attrgetter('real', 'nope'))
+        self.assertRaises(AttributeError, list, m)
+
+    def test_getter_keys_by_type(self):
+        # Only the real getters are read natively, not look-alikes.
+        for name in ['operator.itemgetter', 'operator.attrgetter']:
+            fake = type(name, (), {
+                '__call__': lambda self, x: -x[0],
+                '__reduce__': lambda self: (type(self), (0,)),
+            })
+            with self.subTest(name=name):
+                self.assertEqual(
+                    list(self.module.merge([(3,), (1,)], [(2,)], key=fake())),
+                    [(3,), (2,), (1,)])
+        # A key tuple that was handed out is never changed afterwards.
+        m = self.module.merge([(1, 'a'), (2, 'b')], [(3, 'c')],
+                              key=itemgetter(0, 1), groupby=True)
+        groups = list(m)
+        self.assertEqual([key for key, _ in groups],
+                         [(1, 'a'), (2, 'b'), (3, 'c')])
+
+    def test_take_into_runs_errors(self):
+        class Bad:
+            def __lt__(self, other):
+                raise ZeroDivisionError
+            __gt__ = __lt__
+        inputs = [[0], list(range(1, 50)) + [Bad()], [101]]
+        self.assertRaises(ZeroDivisionError,
+                          self.module.merge(*inputs).take, 100)
+        self.assertRaises(ZeroDivisionError,
+                          self.module.merge(*inputs).into, [])
+        self.assertRaises(ZeroDivisionError,
+                          self.module.merge(*inputs).into, deque())
+
+    def test_take_into_runs_use_up_limit(self):
+        # A run that uses up limit= ends the merge, and with it the
+        # merge's hold on the list the run is copied from.
+        def inputs():
+            return [[0] + list(range(1000, 1100)), list(range(1, 900))]
+        expected = sorted(chain(*inputs()))[:950]
+        merge = self.module.merge
+        self.assertEqual(merge(*inputs(), limit=950).take(2000), expected)
+        for out in [[], deque()]:
+            merge(*inputs(), limit=950).into(out)
+            self.assertEqual(list(out), expected)
+
+    def test_shared_between_threads(self):
+        inputs = [range(i, 20_000, 7) for i in range(7)]
+        m = self.module.merge(*inputs)
+        chunks = []
+        singles = []
+
+        def worker():
+            while chunk := m.take(50):
+                chunks.append(chunk)
+                singles.extend(m.take(1) if random.random() < 0.5 else [])
+
+        threads = [threading.Thread(target=worker) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        for chunk in chunks:
+            # Each take() is one consecutive run of the output.
+            self.assertEqual(chunk, list(range(chunk[0],
+                                               chunk[0] + len(chunk))))
+        self.assertEqual(sorted(chain(singles, *chunks)),
+                         list(range(20_000)))
+
     def test_empty_merges(self):
         # Merging two empty lists (with or without a key) should produce
         # another empty list.
@@ -104,5 +777,905 @@ class TestMerge(unittest.TestCase):
             mo = merge(range(10), key=object(), reverse=reverse)
             self.assertRaises(TypeError, list, merge)
 
+    def test_merge_long_runs(self):
+        # Long stretches won by one input exercise galloping, including
+        # ties between the galloping input and the runner-up.
+        for n, reverse in product([1, 2, 3, 5, 8, 17], [False, True]):
+            inputs = [[] for _ in range(n)]
+            x = 0
+            for _ in range(200):
+                stream = random.randrange(n)
+                for _ in range(random.randrange(1, 40)):
+                    x += random.randrange(2)
+                    inputs[stream].append((x, stream))
+            if reverse:
+                for stream in inputs:
+                    stream.reverse()
+            key = itemgetter(0)
+            expected = sorted(chain(*inputs), key=key, reverse=reverse)
+            with self.subTest(n=n, reverse=reverse):
+                m = self.module.merge(*inputs, key=key, reverse=reverse)
+                self.assertEqual(list(m), expected)
+
+    def test_merge_many_iterables(self):
+        for n in [31, 32, 33, 1000]:
+            inputs = [sorted(random.choices(range(1000),
+                                            k=random.randrange(10)))
+                      for _ in range(n)]
+            expected = sorted(chain(*inputs))
+            with self.subTest(n=n):
+                self.assertEqual(list(self.module.merge(*inputs)), expected)
+
+    def test_merge_uneven_exhaustion(self):
+        # Leaving only a few long inputs, scattered so that they form one
+        # deep path, makes the tree rebalance as the rest run out.
+        for reverse in [False, True]:
+            survivors = {0} | {1 << j for j in range(10)}
+            inputs = [sorted(random.choices(range(100),
+                                            k=300 if i in survivors else 1),
+                             reverse=reverse)
+                      for i in range(1024)]
+            expected = sorted(((x, i, j) for i, lst in enumerate(inputs)
+                               for j, x in enumerate(lst)),
+                              key=lambda t: (-t[0] if reverse else t[0]))
+            expected = [(i, j, x) for x, i, j in expected]
+            with self.subTest(reverse=reverse):
+                m = self.module.merge(*inputs, reverse=reverse,
+                                      with_source=True)
+                self.assertEqual(list(m), expected)
+
+
+class TestMergeFlat(TestMerge):
+    module = SimpleNamespace(merge=partial(multimerge.merge, flat=True))
+
+
+class TestMergeDynamic(unittest.TestCase):
+
+    def check_random_ops(self, key=None, reverse=False):
+        # A model of the merge: the remaining items of each source.
+        remaining = {}
+        m = multimerge.merge(key=key, reverse=reverse, with_source=True)
+        sortkey = key or (lambda x: x)
+
+        def expected_next():
+            best = None
+            for i, items in remaining.items():
+                if items:
+                    k = sortkey(items[0])
+                    if (best is None or (k > best[0] if reverse
+                                         else k < best[0])):
+                        best = (k, i)
+            if best is None:
+                return None
+            i = best[1]
+            ordinal = counts[i]
+            counts[i] += 1
+            return (i, ordinal, remaining[i].popleft())
+
+        counts = []
+        for _ in range(300):
+            op = random.random()
+            if op < 0.15:
+                lst = sorted(random.choices(range(20),
+                                            k=random.randrange(8)),
+                             key=sortkey, reverse=reverse)
+                self.assertEqual(m.add_iterable(iter(lst)), len(counts))
+                remaining[len(counts)] = deque(lst)
+                counts.append(0)
+            elif op < 0.2 and remaining:
+                # Exhausted iterables have already left the merge.
+                i = random.choice(list(remaining))
+                if remaining.pop(i):
+                    m.remove(i)
+                self.assertRaises(ValueError, m.remove, i)
+            else:
+                self.assertEqual(next(m, None), expected_next())
+
+    def test_random_ops(self):
+        for _ in range(20):
+            self.check_random_ops()
+            self.check_random_ops(reverse=True)
+            self.check_random_ops(key=lambda x: -x)
+
+    def test_add_iterable(self):
+        m = multimerge.merge([1, 4, 7], [2, 5])
+        self.assertEqual(next(m), 1)
+        self.assertEqual(m.add_iterable([0, 3, 6]), 2)
+        self.assertEqual(m.add_iterable([]), 3)
+        self.assertEqual(list(m), [0, 2, 3, 4, 5, 6, 7])
+        # An exhausted merge starts again.
+        self.assertEqual(m.add_iterable([8, 9]), 4)
+        self.assertEqual(list(m), [8, 9])
+
+        m = multimerge.merge(key=len)
+        self.assertIsNone(next(m, None))
+        m.add_iterable(['bbb'])
+        m.add_iterable(['a', 'cc'])
+        m.add_iterable(['zz'], lower_bound=2)
+        self.assertEqual(list(m), ['a', 'cc', 'zz', 'bbb'])
+
+        # Ties go to earlier iterables, including added ones.
+        m = multimerge.merge([1, 1], with_source=True)
+        for _ in range(100):
+            m.add_iterable([1, 2])
+        self.assertEqual(list(m)[:4], [(0, 0, 1), (0, 1, 1),
+                                       (1, 0, 1), (2, 0, 1)])
+
+    def test_add_many(self):
+        m = multimerge.merge()
+        lists = [list(range(i, 10_000, 1000)) for i in range(1000)]
+        for lst in lists:
+            m.add_iterable(lst)
+            next(m)
+        self.assertEqual(sorted(m.take(20_000) + list(range(1000))),
+                         sorted(chain(*lists)))
+
+    def test_remove(self):
+        m = multimerge.merge([1, 4], [2, 5], [3, 6], with_source=True)
+        m.remove(1)
+        self.assertEqual(next(m), (0, 0, 1))
+        m.remove(0)
+        self.assertEqual(list(m), [(2, 0, 3), (2, 1, 6)])
+        self.assertRaises(ValueError, m.remove, 2)
+        self.assertRaises(ValueError, m.remove, -1)
+        self.assertRaises(ValueError, m.remove, 3)
+
+        m = multimerge.merge([1], [2, 3])
+        m.remove(1)
+        m.remove(0)
+        self.assertEqual(list(m), [])
+
+    def test_remove_many(self):
+        # Removing all but a few scattered inputs rebalances the tree.
+        inputs = [list(range(i, 3000, 1024)) for i in range(1024)]
+        survivors = {0} | {1 << j for j in range(10)}
+        m = multimerge.merge(*inputs, with_source=True)
+        self.assertEqual(next(m), (0, 0, 0))
+        for i in range(1024):
+            if i not in survivors:
+                m.remove(i)
+        expected = sorted((x, i, j) for i, lst in enumerate(inputs)
+                          if i in survivors for j, x in enumerate(lst))
+        self.assertEqual(list(m), [(i, j, x) for x, i, j in expected[1:]])
+
+    def test_dynamic_unique(self):
+        m = multimerge.merge([1, 2], [2, 3], unique=True)
+        self.assertEqual(next(m), 1)
+        m.add_iterable([2, 2, 4])
+        self.assertEqual(list(m), [2, 3, 4])
+        # Starting again also forgets the last key.
+        m.add_iterable(['a', 'a'])
+        self.assertEqual(list(m), ['a'])
+
+    def test_skip_to_random(self):
+        class Seekable:
+            # An iterator over a list that can jump ahead by itself.
+            def __init__(self, lst, key, reverse):
+                self.lst, self.i = lst, 0
+                self.key, self.reverse = key, reverse
+            def __iter__(self):
+                return self
+            def __next__(self):
+                if self.i >= len(self.lst):
+                    raise StopIteration
+                self.i += 1
+                return self.lst[self.i - 1]
+            def seek(self, k):
+                while (self.i < len(self.lst) and
+                       (k < self.key(self.lst[self.i]) if self.reverse
+                        else self.key(self.lst[self.i]) < k)):
+                    self.i += 1
+
+        for key, reverse in product([None, abs], [False, True]):
+            sortkey = key or (lambda x: x)
+            before = ((lambda a, b: b < a) if reverse
+                      else (lambda a, b: a < b))
+            inputs = [sorted(random.choices(range(-50, 50), k=40),
+                             key=sortkey, reverse=reverse)
+                      for _ in range(6)]
+            kinds = [list, tuple, iter,
+                     lambda lst: Seekable(lst, sortkey, reverse)]
+            m = multimerge.merge(*[kinds[i % 4](lst)
+                                   for i, lst in enumerate(inputs)],
+                                 key=key, reverse=reverse)
+            remaining = [deque(lst) for lst in inputs]
+            for _ in range(60):
+                if random.random() < 0.3:
+                    k = random.randrange(-50, 50)
+                    m.skip_to(k)
+                    for d in remaining:
+                        while d and before(sortkey(d[0]), k):
+                            d.popleft()
+                else:
+                    live = [d for d in remaining if d]
+                    if not live:
+                        self.assertIsNone(next(m, None))
+                        continue
+                    best = live[0]
+                    for d in live[1:]:
+                        if before(sortkey(d[0]), sortkey(best[0])):
+                            best = d
+                    with self.subTest(key=key, reverse=reverse):
+                        self.assertEqual(next(m), best.popleft())
+
+    def test_skip_to(self):
+        m = multimerge.merge(range(0, 100, 2), list(range(1, 100, 2)),
+                             with_source=True)
+        self.assertEqual(next(m), (0, 0, 0))
+        m.skip_to(51)
+        self.assertEqual(m.take(3), [(1, 25, 51), (0, 26, 52), (1, 26, 53)])
+        m.skip_to(10)
+        self.assertEqual(next(m), (0, 27, 54))
+        m.skip_to(1000)
+        self.assertEqual(list(m), [])
+        m.skip_to(5)
+        m.add_iterable([1, 2])
+        self.assertEqual(list(m), [(2, 0, 1), (2, 1, 2)])
+
+        # With one input left, keys are still compared as keys.
+        m = multimerge.merge(['a', 'bbb', 'cccc'], key=len)
+        m.skip_to(3)
+        self.assertEqual(list(m), ['bbb', 'cccc'])
+
+        # Parallel keys, and deferred inputs that skip_to opens.
+        m = multimerge.merge('xyz', iter('uvw'), keys=[[1, 5, 9], [2, 3, 7]])
+        m.skip_to(4)
+        self.assertEqual(list(m), ['y', 'w', 'z'])
+        opened = []
+        class Lazy:
+            def __init__(self, lst):
+                self.lst = lst
+            def __iter__(self):
+                opened.append(self.lst[0])
+                return iter(self.lst)
+        m = multimerge.merge(Lazy([0, 5]), Lazy([10, 15]), Lazy([20, 25]),
+                             lower_bounds=[0, 10, 20])
+        m.skip_to(12)
+        self.assertEqual(next(m), 15)
+        self.assertEqual(opened, [0, 10])
+
+        # Skipping within a set operation is allowed too.
+        m = multimerge.intersect(range(100), range(0, 100, 5))
+        m.skip_to(42)
+        self.assertEqual(m.take(2), [45, 50])
+
+    def test_skip_to_errors(self):
+        m = multimerge.merge([1, 2], flat=True)
+        self.assertRaises(TypeError, m.skip_to, 1)
+        m = multimerge.merge([1, 2], [3])
+        self.assertRaises(TypeError, m.skip_to, 'x')
+        class BadSeek:
+            def __iter__(self):
+                return self
+            def __next__(self):
+                return 1
+            def seek(self, k):
+                raise ZeroDivisionError
+        m = multimerge.merge(BadSeek(), [0, 5])
+        self.assertEqual(next(m), 0)
+        self.assertRaises(ZeroDivisionError, m.skip_to, 3)
+
+    def test_skip_to_inner_merge(self):
+        inner = multimerge.merge(list(range(0, 100, 2)), range(1, 100, 2))
+        m = multimerge.merge(inner, [50.5])
+        m.skip_to(50)
+        self.assertEqual(m.take(3), [50, 50.5, 51])
+        self.assertRaises(ValueError, m.add_iterable, m)
+
+    def test_dynamic_keys(self):
+        m = multimerge.merge(['b', 'c'], keys=[[2, 3]])
+        self.assertRaises(TypeError, m.add_iterable, ['a'])
+        m.add_iterable(['a', 'd'], keys=[1, 4])
+        self.assertEqual(list(m), ['a', 'b', 'c', 'd'])
+        m = multimerge.merge([1])
+        self.assertRaises(TypeError, m.add_iterable, [2], keys=[2])
+
+    def test_dynamic_errors(self):
+        m = multimerge.merge([1], flat=True)
+        self.assertRaises(TypeError, m.add_iterable, [2])
+        self.assertRaises(TypeError, m.remove, 0)
+        m = multimerge.merge([1])
+        self.assertRaises(TypeError, m.add_iterable, 5)
+        self.assertRaises(TypeError, m.remove, 'x')
+        self.assertEqual(list(m), [1])
+        m = multimerge.merge([1, 2])
+        self.assertRaises(TypeError, m.add_iterable, ['x'])
+
+    def test_errors_while_galloping(self):
+        # A comparison that fails while one input gallops ends the merge,
+        # and adding to it afterwards starts it over with a fresh tree.
+        class K:
+            fail = False
+            def __init__(self, value):
+                self.value = value
+            def __lt__(self, other):
+                if K.fail:
+                    raise ZeroDivisionError
+                return self.value < other.value
+        for kw, fail_in in product([{}, dict(unique=True),
+                                    dict(groupby=True)],
+                                   ['next', 'add_iterable']):
+            with self.subTest(kw=kw, fail_in=fail_in):
+                K.fail = False
+                m = multimerge.merge([K(i) for i in range(100)], [K(1000)],
+                                     **kw)
+                for _ in range(20):
+                    next(m)
+                K.fail = True
+                if fail_in == 'next':
+                    self.assertRaises(ZeroDivisionError, next, m)
+                else:
+                    self.assertRaises(ZeroDivisionError,
+                                      m.add_iterable, [K(5)])
+                K.fail = False
+                m.add_iterable([K(6), K(7)])
+                out = list(m)
+                if kw.get('groupby'):
+                    out = [x for _, group in out for x in group]
+                values = [x.value for x in out]
+                self.assertEqual(values, sorted(values))
+                self.assertIn(6, values)
+
+
+class TestSetOperations(unittest.TestCase):
+
+    def reference(self, inputs, key, reverse):
+        # For each key in order: the first item and the set of inputs.
+        key = key or (lambda x: x)
+        triples = sorted(((key(x), i, x) for i, lst in enumerate(inputs)
+                          for x in lst), key=itemgetter(0), reverse=reverse)
+        groups = []
+        for k, i, x in triples:
+            if groups and not (groups[-1][0] < k or k < groups[-1][0]):
+                groups[-1][2].add(i)
+            else:
+                groups.append((k, x, {i}))
+        return groups
+
+    def test_random(self):
+        for n, key, reverse, kind in product([1, 2, 3, 5], [None, abs],
+                                             [False, True],
+                                             [list, tuple, iter]):
+            inputs = [sorted(random.choices(range(-30, 30),
+                                            k=random.randrange(40)),
+                             key=key, reverse=reverse)
+                      for _ in range(n)]
+            groups = self.reference(inputs, key, reverse)
+            args = [kind(lst) for lst in inputs]
+            kw = dict(key=key, reverse=reverse)
+            with self.subTest(n=n, key=key, reverse=reverse, kind=kind):
+                self.assertEqual(list(multimerge.intersect(*args, **kw)),
+                                 [x for k, x, s in groups if len(s) == n])
+                args = [kind(lst) for lst in inputs]
+                self.assertEqual(list(multimerge.difference(*args, **kw)),
+                                 [x for k, x, s in groups if s == {0}])
+                for m in range(1, n + 2):
+                    args = [kind(lst) for lst in inputs]
+                    self.assertEqual(
+                        list(multimerge.threshold(m, *args, **kw)),
+                        [x for k, x, s in groups if len(s) >= m])
+
+    def test_skipping(self):
+        # Long stretches that can be skipped, in lists and iterators.
+        big = list(range(0, 1_000_000, 3))
+        small = [0, 30, 33, 40, 999_999]
+        for a, b in [(big, small), (small, big), (iter(big), small)]:
+            self.assertEqual(list(multimerge.intersect(a, b)), [0, 30, 33,
+                                                                999_999])
+        self.assertEqual(list(multimerge.difference(small, big)), [40])
+        self.assertEqual(multimerge.difference(big, small).take(3),
+                         [3, 6, 9])
+
+    def test_examples(self):
+        self.assertEqual(list(multimerge.intersect([1, 3, 5, 7], [3, 4, 5],
+                                                   [0, 3, 5, 6])), [3, 5])
+        self.assertEqual(list(multimerge.threshold(2, [1, 3, 5], [2, 3, 4],
+                                                   [4, 5, 6])), [3, 4, 5])
+        self.assertEqual(list(multimerge.difference([1, 2, 3, 4, 5], [2, 3],
+                                                    [5, 6])), [1, 4])
+        self.assertEqual(list(multimerge.intersect()), [])
+        self.assertEqual(list(multimerge.intersect([1, 2], [])), [])
+        self.assertEqual(list(multimerge.difference([1, 2])), [1, 2])
+        self.assertEqual(list(multimerge.difference([], [1, 2])), [])
+        self.assertEqual(list(multimerge.intersect('abc', 'ABC',
+                                                   key=str.lower)),
+                         ['a', 'b', 'c'])
+
+    def test_errors(self):
+        self.assertRaises(TypeError, multimerge.difference)
+        self.assertRaises(TypeError, multimerge.threshold)
+        self.assertRaises(TypeError, multimerge.threshold, 'x', [1])
+        self.assertRaises(ValueError, multimerge.threshold, 0, [1])
+        self.assertRaises(TypeError, multimerge.intersect, [1], flat=True)
+        m = multimerge.intersect([1], [1])
+        self.assertRaises(TypeError, m.add_iterable, [1])
+        self.assertRaises(TypeError, m.remove, 0)
+        def key(x):
+            if x == 5:
+                raise ZeroDivisionError
+            return x
+        m = multimerge.intersect(iter(range(10)), [1, 7], key=key)
+        self.assertEqual(next(m), 1)
+        self.assertRaises(ZeroDivisionError, next, m)
+        self.assertEqual(list(m), [])
+
+
+class TestSortExternal(unittest.TestCase):
+
+    def test_sort_external_random(self):
+        for n, run_size, fan_in in product([0, 1, 5, 100, 1000],
+                                           [1, 7, 100, 10_000], [2, 3, 64]):
+            data = [random.randrange(-50, 50) for _ in range(n)]
+            with self.subTest(n=n, run_size=run_size, fan_in=fan_in):
+                self.assertEqual(
+                    list(multimerge.sort_external(data, run_size=run_size,
+                                                  fan_in=fan_in)),
+                    sorted(data))
+
+    def test_sort_external_stability(self):
+        data = [(random.randrange(10), i) for i in range(500)]
+        for key, reverse in product([itemgetter(0), None], [False, True]):
+            with self.subTest(key=key, reverse=reverse):
+                self.assertEqual(
+                    list(multimerge.sort_external(
+                        iter(data), key=key, reverse=reverse,
+                        run_size=9, fan_in=2)),
+                    sorted(data, key=key, reverse=reverse))
+
+    def test_sort_external_in_memory(self):
+        # One run is never written, so its items need not be picklable.
+        data = [lambda: i for i in range(10)]
+        self.assertEqual(list(multimerge.sort_external(data, key=id)),
+                         sorted(data, key=id))
+        with self.assertRaises(Exception):
+            list(multimerge.sort_external(data, key=id, run_size=3))
+
+    def test_sort_external_tmpdir(self):
+        data = [str(random.random()) for _ in range(1000)]
+        with tempfile.TemporaryDirectory() as tmpdir:
+            it = multimerge.sort_external(data, run_size=100, tmpdir=tmpdir)
+            self.assertEqual(list(it), sorted(data))
+            del it
+        self.assertRaises(OSError, multimerge.sort_external, data,
+                          run_size=100, tmpdir=os.path.join(tmpdir, "gone"))
+
+    def test_sort_external_errors(self):
+        se = multimerge.sort_external
+        self.assertRaises(TypeError, se)
+        self.assertRaises(TypeError, se, 1)
+        self.assertRaises(TypeError, se, [], 100)
+        self.assertRaises(ValueError, se, [], run_size=0)
+        self.assertRaises(ValueError, se, [], fan_in=1)
+        def gen():
+            yield from range(10)
+            raise ZeroDivisionError
+        self.assertRaises(ZeroDivisionError, se, gen(), run_size=3)
+        self.assertRaises(ZeroDivisionError, se, gen())
+        self.assertRaises(TypeError, se, [1, "a", 2, "b"], run_size=2)
+        self.assertRaises(ZeroDivisionError, se, [1, 2, 3], run_size=2,
+                          key=lambda x: 1 / (x - 3))
+
+
+class TestMmapRecords(unittest.TestCase):
+
+    def write(self, data):
+        fd, path = tempfile.mkstemp()
+        with os.fdopen(fd, "wb") as f:
+            f.write(data)
+        self.addCleanup(os.remove, path)
+        return path
+
+    def test_mmap_records(self):
+        for data, kw, expected in [
+            (b"a\nbb\nccc\n", {}, [b"a", b"bb", b"ccc"]),
+            (b"a\nbb\nccc", {}, [b"a", b"bb", b"ccc"]),
+            (b"\n\na\n", {}, [b"", b"", b"a"]),
+            (b"", {}, []),
+            (b"x", {}, [b"x"]),
+            (b"a, b,, b,,c", dict(sep=b", "), [b"a", b"b,", b"b,,c"]),
+            (b"a\r\nb\rc\r\n", dict(sep=b"\r\n"), [b"a", b"b\rc"]),
+            (b"abcdef", dict(record_size=2), [b"ab", b"cd", b"ef"]),
+            (b"", dict(record_size=3), []),
+        ]:
+            with self.subTest(data=data, kw=kw):
+                path = self.write(data)
+                self.assertEqual(list(multimerge.mmap_records(path, **kw)),
+                                 expected)
+                self.assertEqual(
+                    list(multimerge.merge(multimerge.mmap_records(path, **kw))),
+                    expected)
+
+    def test_mmap_records_merge(self):
+        lines = [sorted(b"%08d" % random.randrange(10**8)
+                        for _ in range(random.randrange(300)))
+                 for _ in range(20)]
+        paths = [self.write(b"".join(x + b"\n" for x in lst))
+                 for lst in lines]
+        expected = sorted(chain.from_iterable(lines))
+        for kw in [{}, dict(record_size=9)]:
+            with self.subTest(kw=kw):
+                sources = [multimerge.mmap_records(p, **kw) for p in paths]
+                result = list(multimerge.merge(*sources))
+                if kw:
+                    result = [x[:-1] for x in result]
+                self.assertEqual(result, expected)
+                self.assertEqual(list(sources[0]), [])
+        sources = [multimerge.mmap_records(p) for p in paths]
+        self.assertEqual(list(multimerge.merge(*sources, key=int)),
+                         expected)
+
+    def test_mmap_records_pickle(self):
+        path = self.write(b"".join(b"%03d\n" % i for i in range(100)))
+        for kw in [{}, dict(sep=b"1\n"), dict(record_size=4)]:
+            with self.subTest(kw=kw):
+                expected = list(multimerge.mmap_records(path, **kw))
+                mr = multimerge.mmap_records(path, **kw)
+                head = list(islice(mr, 7))
+                copy = pickle.loads(pickle.dumps(mr))
+                self.assertEqual(head + list(copy), expected)
+                self.assertEqual(list(pickle.loads(pickle.dumps(copy))), [])
+        m = multimerge.merge(multimerge.mmap_records(path),
+                             [b"050", b"150"])
+        head = list(islice(m, 60))
+        self.assertEqual(head + list(pickle.loads(pickle.dumps(m))),
+                         sorted([b"%03d" % i for i in range(100)]
+                                + [b"050", b"150"]))
+        state = pickle.dumps(multimerge.mmap_records(path))
+        with open(path, "wb") as f:
+            f.write(b"abc")
+        self.assertEqual(list(pickle.loads(state)), [b"abc"])
+        mr = multimerge.mmap_records(path)
+        self.assertRaises(ValueError, mr.__setstate__, (b"\n", 0, 4))
+        self.assertRaises(ValueError, mr.__setstate__, (b"\n", 2, 0))
+        self.assertRaises(ValueError, mr.__setstate__, (b"", 0, 0))
+        self.assertRaises(TypeError, mr.__setstate__, ("\n", 0, 0))
+        # Records are read from pos, so it must be a multiple of their size.
+        path = self.write(b"abcdefgh")
+        mr = multimerge.mmap_records(path, record_size=4)
+        self.assertRaises(ValueError, mr.__setstate__, (b"\n", 4, 3))
+        mr.__setstate__((b"\n", 4, 4))
+        self.assertEqual(list(mr), [b"efgh"])
+
+    def test_mmap_records_errors(self):
+        path = self.write(b"abcde")
+        mr = multimerge.mmap_records
+        self.assertRaises(TypeError, mr)
+        self.assertRaises(TypeError, mr, path, "\n")
+        self.assertRaises(TypeError, mr, path, b"\n", 1)
+        self.assertRaises(TypeError, mr, path, sep=b"\n", record_size=1)
+        self.assertRaises(ValueError, mr, path, sep=b"")
+        self.assertRaises(ValueError, mr, path, sep=b"x" * 17)
+        self.assertRaises(ValueError, mr, path, record_size=0)
+        self.assertRaises(ValueError, mr, path, record_size=2)
+        self.assertRaises(OSError, mr, path + ".missing")
+        with self.assertRaises(TypeError):
+            class C(mr):
+                pass
+
+
+class TestAmerge(unittest.TestCase):
+
+    @staticmethod
+    async def agen(iterable, delay=0):
+        for x in iterable:
+            await asyncio.sleep(delay)
+            yield x
+
+    class Counter:
+        # An async iterator whose __anext__ is a coroutine function.
+        def __init__(self, lst):
+            self.it = iter(lst)
+        def __aiter__(self):
+            return self
+        async def __anext__(self):
+            try:
+                return next(self.it)
+            except StopIteration:
+                raise StopAsyncIteration
+
+    def collect(self, am):
+        async def main():
+            return [x async for x in am]
+        return asyncio.run(main())
+
+    def test_amerge_random(self):
+        for n, key, reverse, prefetch in product([0, 1, 2, 5, 20],
+                                                 [None, abs], [False, True],
+                                                 [False, True]):
+            inputs = [sorted(random.choices(range(-30, 30),
+                                            k=random.randrange(30)),
+                             key=key, reverse=reverse)
+                      for _ in range(n)]
+            expected = sorted(chain.from_iterable(inputs), key=key,
+                              reverse=reverse)
+            with self.subTest(n=n, key=key, reverse=reverse,
+                              prefetch=prefetch):
+                for make in [self.agen, self.Counter]:
+                    am = multimerge.amerge(*map(make, inputs), key=key,
+                                           reverse=reverse, prefetch=prefetch)
+                    self.assertEqual(self.collect(am), expected)
+
+    def test_amerge_stability(self):
+        inputs = [[(i // 3, j) for i in range(30)] for j in range(4)]
+        am = multimerge.amerge(*map(self.agen, inputs), key=itemgetter(0))
+        self.assertEqual(self.collect(am),
+                         sorted(chain.from_iterable(inputs),
+                                key=itemgetter(0)))
+
+    def test_amerge_awaits_only_the_winner(self):
+        reads = []
+        async def logged(name, lst):
+            for x in lst:
+                reads.append(name)
+                yield x
+        async def main():
+            am = multimerge.amerge(logged("a", [1, 2, 3]),
+                                   logged("b", [10, 20]))
+            self.assertEqual(await am.__anext__(), 1)
+            self.assertEqual(reads, ["a", "b"])
+            self.assertEqual(await am.__anext__(), 2)
+            self.assertEqual(await am.__anext__(), 3)
+            self.assertEqual(reads, ["a", "b", "a", "a"])
+            self.assertEqual([x async for x in am], [10, 20])
+            with self.assertRaises(StopAsyncIteration):
+                await am.__anext__()
+        asyncio.run(main())
+
+    def test_amerge_prefetch(self):
+        # With prefetch, the inputs are read while the caller waits.
+        async def main():
+            loop = asyncio.get_running_loop()
+            start = loop.time()
+            am = multimerge.amerge(*(self.agen(range(i, 40, 4), 0.01)
+                                     for i in range(4)), prefetch=True)
+            result = []
+            async for x in am:
+                await asyncio.sleep(0.01)
+                result.append(x)
+            self.assertEqual(result, list(range(40)))
+            self.assertLess(loop.time() - start, 0.7)
+        asyncio.run(main())
+
+    def test_amerge_errors(self):
+        self.assertRaises(TypeError, multimerge.amerge, [1, 2])
+        self.assertRaises(TypeError, multimerge.amerge, 1)
+        self.assertRaises(TypeError, multimerge.amerge, self.agen([]), foo=1)
+        async def broken():
+            yield 1
+            raise ZeroDivisionError
+        for prefetch in [False, True]:
+            async def main():
+                am = multimerge.amerge(broken(), self.agen([3, 4]),
+                                       prefetch=prefetch)
+                self.assertEqual(await am.__anext__(), 1)
+                with self.assertRaises(ZeroDivisionError):
+                    await am.__anext__()
+                with self.assertRaises(StopAsyncIteration):
+                    await am.__anext__()
+                am = multimerge.amerge(self.agen([1, 0]), self.agen([0.5]),
+                                       key=lambda x: 1 / x,
+                                       prefetch=prefetch)
+                with self.assertRaises(ZeroDivisionError):
+                    [x async for x in am]
+            with self.subTest(prefetch=prefetch):
+                asyncio.run(main())
+
+    def test_amerge_concurrent_anext(self):
+        async def main():
+            am = multimerge.amerge(self.agen([1, 2], 0.01))
+            first = asyncio.ensure_future(am.__anext__())
+            await asyncio.sleep(0)
+            with self.assertRaises(RuntimeError):
+                await am.__anext__()
+            self.assertEqual(await first, 1)
+            self.assertEqual(await am.__anext__(), 2)
+            aw = am.__anext__()
+            self.assertRaises(StopAsyncIteration, aw.send, None)
+            self.assertRaises(RuntimeError, aw.send, None)
+        asyncio.run(main())
+
+    def test_amerge_cancel(self):
+        for prefetch in [False, True]:
+            async def main():
+                am = multimerge.amerge(self.agen([1, 2], 10),
+                                       self.agen([3], 10), prefetch=prefetch)
+                with self.assertRaises(asyncio.TimeoutError):
+                    await asyncio.wait_for(am.__anext__(), 0.01)
+                with self.assertRaises(StopAsyncIteration):
+                    await am.__anext__()
+            with self.subTest(prefetch=prefetch):
+                asyncio.run(main())
+
+
+@unittest.skipIf(interpreters is None, "no subinterpreters")
+class TestSubinterpreters(unittest.TestCase):
+
+    def run_script(self, script):
+        # Returns a description of an uncaught exception, or None.
+        interp = interpreters.create()
+        try:
+            return interpreters.run_string(
+                interp, f"import sys\nsys.path[:0] = {sys.path!r}\n" + script)
+        except Exception as e:
+            return e
+        finally:
+            interpreters.destroy(interp)
+
+    def run_in_interpreter(self, script):
+        self.assertIsNone(self.run_script(script))
+
+    def test_merge_in_subinterpreter(self):
+        self.run_in_interpreter(
+            "import multimerge, asyncio, pickle\n"
+            "data = [list(range(i, 1000, 7)) for i in range(7)]\n"
+            "assert list(multimerge.merge(*data)) == list(range(1000))\n"
+            "assert list(multimerge.merge(*map(iter, data), prefetch=4))"
+            " == list(range(1000))\n"
+            "m = multimerge.merge(*data)\n"
+            "next(m)\n"
+            "assert list(pickle.loads(pickle.dumps(m))) == list(range(1, 1000))\n"
+            "async def agen(lst):\n"
+            "    for x in lst:\n"
+            "        yield x\n"
+            "async def main():\n"
+            "    return [x async for x in multimerge.amerge(*map(agen, data))]\n"
+            "assert asyncio.run(main()) == list(range(1000))\n")
+        # The main interpreter's merge nodes and types are unaffected.
+        self.assertEqual(list(multimerge.merge([1, 3], [2, 4])), [1, 2, 3, 4])
+
+    def test_interpreters_in_parallel(self):
+        script = ("import multimerge\n"
+                  "data = [list(range(i, 20000, 16)) for i in range(16)]\n"
+                  "for _ in range(5):\n"
+                  "    assert list(multimerge.merge(*data)) =="
+                  " list(range(20000))\n")
+        failures = []
+        threads = [threading.Thread(
+                       target=lambda: failures.append(self.run_script(script)))
+                   for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(failures, [None] * 4)
+
+
+@unittest.skipUnless(hasattr(multimerge.merge, "stats"),
+                     "built without MULTIMERGE_STATS")
+class TestStats(unittest.TestCase):
+
+    def test_stats(self):
+        for flat in [False, True]:
+            with self.subTest(flat=flat):
+                m = multimerge.merge([1, 3, 5], [2, 4], [0], [],
+                                     key=abs, flat=flat)
+                self.assertEqual(m.stats()["comparisons"], 0)
+                self.assertEqual(list(m), [0, 1, 2, 3, 4, 5])
+                stats = m.stats()
+                self.assertEqual(stats["key_calls"], 6)
+                self.assertGreater(stats["comparisons"], 0)
+                self.assertEqual(stats["refills"], [3, 2, 1, 0])
+                self.assertEqual(stats["exhausted"], 4)
+                self.assertEqual(stats["max_depth"], 2)
+                self.assertEqual(stats["depth"], 0)
+
+
+class TestMergeArrays(unittest.TestCase):
+
+    def test_merge_arrays_random(self):
+        for typecode, reverse in product('bBhHiIlLqQfd', [False, True]):
+            info = 2 ** (8 * array(typecode).itemsize - 1)
+            if typecode in 'fd':
+                lo, hi = -1000, 1000
+            elif typecode.islower():
+                lo, hi = -info, info
+            else:
+                lo, hi = 0, 2 * info
+            for n in [1, 2, 3, 7, 16]:
+                lists = [
+                    sorted((random.randrange(lo, hi)
+                            for _ in range(random.randrange(30))),
+                           reverse=reverse)
+                    for _ in range(n)
+                ]
+                arrays = [array(typecode, lst) for lst in lists]
+                expected = array(typecode, multimerge.merge(*arrays,
+                                                            reverse=reverse))
+                with self.subTest(typecode=typecode, reverse=reverse):
+                    res = multimerge.merge_arrays(*arrays, reverse=reverse)
+                    self.assertEqual(res, expected)
+                    self.assertEqual(res.typecode, typecode)
+
+    def test_merge_arrays_stability(self):
+        # -0.0 == 0.0, so the output must take them in input order.
+        a = array('d', [-1.0, -0.0, 0.0, 1.0])
+        b = array('d', [0.0, -0.0, 2.0])
+        res = multimerge.merge_arrays(a, b)
+        expected = list(multimerge.merge(a, b))
+        self.assertEqual([math.copysign(1, x) for x in res],
+                         [math.copysign(1, x) for x in expected])
+
+    def test_merge_arrays_with_source(self):
+        for reverse in [False, True]:
+            lists = [sorted(random.choices(range(50), k=random.randrange(40)),
+                            reverse=reverse)
+                     for _ in range(5)]
+            arrays = [array('l', lst) for lst in lists]
+            res = multimerge.merge_arrays(*arrays, reverse=reverse,
+                                          with_source=True)
+            values, sources, positions = res
+            expected = list(multimerge.merge(*lists, reverse=reverse,
+                                             with_source=True))
+            self.assertEqual(list(zip(sources, positions, values)), expected)
+            self.assertEqual(sources.typecode, 'q')
+            self.assertEqual(positions.typecode, 'q')
+            out = array('l', [0] * len(values))
+            res = multimerge.merge_arrays(*arrays, reverse=reverse,
+                                          with_source=True, out=out)
+            self.assertIs(res[0], out)
+            self.assertEqual(out, values)
+
+    def test_merge_arrays_threads(self):
+        merge_arrays = multimerge.merge_arrays
+        cases = [
+            # few distinct values, so many ties across chunk boundaries
+            ('b', [sorted(random.choices(range(-3, 3), k=random.randrange(
+                3000, 30000))) for _ in range(7)]),
+            ('q', [sorted(random.sample(range(10**9), 40000))
+                   for _ in range(3)]),
+            ('d', [sorted(random.random() for _ in range(20000))
+                   for _ in range(4)] + [[], [0.5] * 30000]),
+            ('H', [list(range(i, 60000, 2)) for i in range(2)]
+                  + [[0] * 20000]),
+            ('I', [list(range(70000))]),
+        ]
+        for (typecode, lists), reverse in product(cases, [False, True]):
+            arrays = [array(typecode, sorted(lst, reverse=reverse))
+                      for lst in lists]
+            expected = merge_arrays(*arrays, reverse=reverse,
+                                    with_source=True)
+            for threads in [2, 3, 8, 1000]:
+                with self.subTest(typecode=typecode, reverse=reverse,
+                                  threads=threads):
+                    res = merge_arrays(*arrays, reverse=reverse,
+                                       with_source=True, threads=threads)
+                    self.assertEqual(res, expected)
+                    res = merge_arrays(*arrays, reverse=reverse,
+                                       threads=threads)
+                    self.assertEqual(res, expected[0])
+        self.assertRaises(ValueError, merge_arrays, array('i'), threads=0)
+        self.assertRaises(TypeError, merge_arrays, array('i'), threads=1.0)
+
+    def test_merge_arrays_out(self):
+        a = array('i', [1, 4, 9])
+        b = array('i', [2, 3, 10])
+        out = array('i', [0] * 8)
+        self.assertIs(multimerge.merge_arrays(a, b, out=out), out)
+        self.assertEqual(out, array('i', [1, 2, 3, 4, 9, 10, 0, 0]))
+        buf = bytearray(6)
+        self.assertIs(multimerge.merge_arrays(b'ace', b'bdf', out=buf), buf)
+        self.assertEqual(buf, bytearray(b'abcdef'))
+        self.assertEqual(multimerge.merge_arrays(memoryview(buf), b''),
+                         array('B', b'abcdef'))
+        self.assertRaises(ValueError, multimerge.merge_arrays, a, b,
+                          out=array('i', [0] * 5))
+        self.assertRaises(TypeError, multimerge.merge_arrays, a, b,
+                          out=array('l', [0] * 6))
+        self.assertRaises(BufferError, multimerge.merge_arrays, a, b,
+                          out=bytes(24))
+        self.assertRaises(ValueError, multimerge.merge_arrays, a, b, out=a)
+
+    def test_merge_arrays_errors(self):
+        self.assertRaises(TypeError, multimerge.merge_arrays)
+        self.assertRaises(TypeError, multimerge.merge_arrays, [1, 2])
+        self.assertRaises(TypeError, multimerge.merge_arrays,
+                          array('i', [1]), array('d', [1.0]))
+        self.assertRaises(TypeError, multimerge.merge_arrays,
+                          memoryview(b'abcd').cast('c'))
+        self.assertRaises(ValueError, multimerge.merge_arrays,
+                          memoryview(bytes(4)).cast('B', (2, 2)))
+        self.assertEqual(multimerge.merge_arrays(array('q')), array('q'))
+
+
 if __name__ == "__main__":
     unittest.main()
@@ -0,0 +1,48 @@
+"""Throughput of independent merges run from several threads at once.
+
+Each thread repeatedly merges its own inputs, so nothing is shared.
+On a free-threaded build (python3.13t and later) the module does not
+re-enable the GIL, and the total throughput should grow about linearly
+with the number of threads, up to the number of cores. With the GIL,
+it stays flat.
+"""
+
+import os
+import sys
+import threading
+import time
+from multimerge import merge
+
+ITEMS = 200_000
+ROUNDS = 5
+
+def inputs(seed):
+    return [list(range(i + seed, ITEMS + seed, 16)) for i in range(16)]
+
+def work(seed):
+    data = inputs(seed)
+    for _ in range(ROUNDS):
+        for _ in merge(*data):
+            pass
+
+def throughput(nthreads):
+    threads = [threading.Thread(target=work, args=(i,))
+               for i in range(nthreads)]
+    t0 = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - t0
+    return nthreads * ROUNDS * ITEMS / elapsed
+
+if __name__ == "__main__":
+    gil = getattr(sys, "_is_gil_enabled", lambda: True)()
+    print(f"Python {sys.version.split()[0]}, GIL enabled: {gil}")
+    base = None
+    n = 1
+    while n <= (os.cpu_count() or 1):
+        rate = throughput(n)
+        base = base or rate
+        print(f"{n:3} threads: {rate:14,.0f} items/s ({rate / base:.2f}x)")
+        n *= 2